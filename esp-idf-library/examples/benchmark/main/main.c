@@ -0,0 +1,365 @@
+#include "fpga.h"
+#include "master_spi.h"
+#include "output_trans_pool.h"
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
+#include <stdlib.h>
+
+static const char* TAG = "benchmark";
+
+// FPGA image ////////////////////////////////////////////////////////////////////////////
+
+const uint8_t top_bin_start asm("_binary_top_bin_start");
+const uint8_t top_bin_end asm("_binary_top_bin_end");
+
+const fpga_bin_t fpga_bin = {
+    .start = &top_bin_start,
+    .end = &top_bin_end,
+};
+
+// The same image, compressed with tools/fpga_compress.py at build time
+const uint8_t top_bin_rle_start asm("_binary_top_bin_rle_start");
+const uint8_t top_bin_rle_end asm("_binary_top_bin_rle_end");
+
+const fpga_bin_t fpga_bin_rle = {
+    .start = &top_bin_rle_start,
+    .end = &top_bin_rle_end,
+};
+
+// Output transaction pool ///////////////////////////////////////////////////////////////
+
+#define POOL_TASK_COUNT 4
+#define POOL_TEST_TIME_US (1000 * 1000)
+
+#define POOL_MAX_BUFFERS_PER_TASK 4
+
+typedef struct {
+    SemaphoreHandle_t done;
+    int buffers_per_task;
+    uint32_t operations;
+} pool_task_ctx_t;
+
+static void pool_task(void* param)
+{
+    pool_task_ctx_t* ctx = (pool_task_ctx_t*)param;
+    output_trans_pool_t* output_trans_pools[POOL_MAX_BUFFERS_PER_TASK];
+
+    const int64_t end_time = esp_timer_get_time() + POOL_TEST_TIME_US;
+
+    while (esp_timer_get_time() < end_time) {
+        int taken = 0;
+        while (taken < ctx->buffers_per_task) {
+            output_trans_pools[taken] = output_trans_pool_take_wait(pdMS_TO_TICKS(10));
+            if (output_trans_pools[taken] == NULL)
+                break;
+            taken++;
+        }
+
+        // Release everything on a timeout too, so that tasks holding partial
+        // sets can't deadlock each other
+        for (int i = 0; i < taken; i++) {
+            output_trans_pool_release(output_trans_pools[i]);
+        }
+
+        ctx->operations += taken;
+    }
+
+    xSemaphoreGive(ctx->done);
+    vTaskDelete(NULL);
+}
+
+//! @brief Hammer the transaction pool from several tasks at once
+//!
+//! Each task repeatedly takes and releases a set of pool entries. The tasks run
+//! at the same priority, so they are time sliced against each other and
+//! contend for the pool lock. If the tasks hold more buffers in total than the
+//! pool contains, they also have to wait for each other to release them.
+//!
+//! @param[in] buffers_per_task Number of buffers each task holds at once
+static void benchmark_pool(int buffers_per_task)
+{
+    static pool_task_ctx_t ctxs[POOL_TASK_COUNT];
+
+    SemaphoreHandle_t done = xSemaphoreCreateCounting(POOL_TASK_COUNT, 0);
+
+    for (int i = 0; i < POOL_TASK_COUNT; i++) {
+        ctxs[i].done = done;
+        ctxs[i].buffers_per_task = buffers_per_task;
+        ctxs[i].operations = 0;
+        xTaskCreate(pool_task, "pool_task", 2048, &ctxs[i], 5, NULL);
+    }
+
+    uint32_t operations = 0;
+    for (int i = 0; i < POOL_TASK_COUNT; i++) {
+        xSemaphoreTake(done, portMAX_DELAY);
+    }
+    for (int i = 0; i < POOL_TASK_COUNT; i++) {
+        operations += ctxs[i].operations;
+    }
+
+    vSemaphoreDelete(done);
+
+    ESP_LOGI(TAG, "pool: tasks:%i buffers_per_task:%i buffers:%i take/release per second:%u",
+        POOL_TASK_COUNT,
+        buffers_per_task,
+        CONFIG_FPGA_SPI_BUFFER_COUNT,
+        (uint32_t)((uint64_t)operations * 1000000 / POOL_TEST_TIME_US));
+
+    output_trans_pool_stats_print();
+}
+
+// Register writes ///////////////////////////////////////////////////////////////////////
+
+#define REGISTER_BASE_ADDRESS 0x00F0
+#define REGISTER_TEST_WRITES 4096
+#define REGISTER_MAX_BATCH 64
+
+//! @brief Wait for all queued transactions to finish
+//!
+//! Transactions are sent in order, so once a register read returns, all
+//! previously queued writes have been sent.
+static void fpga_comms_drain()
+{
+    uint16_t value;
+    fpga_comms_register_read(REGISTER_BASE_ADDRESS, &value);
+}
+
+//! @brief Measure register write throughput, with and without batching
+//!
+//! Writes a total of REGISTER_TEST_WRITES registers, in groups of
+//! batch_size consecutive addresses. Each group is written once with
+//! individual fpga_comms_register_write() calls, and once with a single
+//! fpga_comms_register_write_batch() call.
+//!
+//! @param[in] batch_size Number of registers written per group
+static void benchmark_register_write(int batch_size)
+{
+    static fpga_comms_register_t registers[REGISTER_MAX_BATCH];
+
+    for (int i = 0; i < batch_size; i++) {
+        registers[i].address = REGISTER_BASE_ADDRESS + i;
+        registers[i].value = i;
+    }
+
+    const int iterations = REGISTER_TEST_WRITES / batch_size;
+
+    int64_t start_time = esp_timer_get_time();
+    for (int iteration = 0; iteration < iterations; iteration++) {
+        for (int i = 0; i < batch_size; i++) {
+            fpga_comms_register_write(registers[i].address, registers[i].value);
+        }
+    }
+    fpga_comms_drain();
+    const int64_t single_time = esp_timer_get_time() - start_time;
+
+    start_time = esp_timer_get_time();
+    for (int iteration = 0; iteration < iterations; iteration++) {
+        fpga_comms_register_write_batch(registers, batch_size);
+    }
+    fpga_comms_drain();
+    const int64_t batch_time = esp_timer_get_time() - start_time;
+
+    const uint64_t writes = (uint64_t)iterations * batch_size;
+
+    ESP_LOGI(TAG, "register write: batch_size:%i single writes/s:%u batched writes/s:%u",
+        batch_size,
+        (uint32_t)(writes * 1000000 / single_time),
+        (uint32_t)(writes * 1000000 / batch_time));
+}
+
+// Register reads ////////////////////////////////////////////////////////////////////////
+
+#define REGISTER_TEST_READS 1024
+
+//! @brief Measure register read round-trip time, queued and polled
+//!
+//! Each read waits for the value to come back before the next one starts,
+//! so this measures the latency of a single fpga_comms_register_read() call
+//! rather than throughput.
+//!
+//! @param[in] polling_threshold Polling threshold to use, 0 to queue every read
+static void benchmark_register_read(int polling_threshold)
+{
+    if (fpga_comms_polling_threshold_set(polling_threshold) != ESP_OK) {
+        ESP_LOGE(TAG, "Unable to set polling threshold");
+        return;
+    }
+
+    int64_t time_us_max = 0;
+    int failures = 0;
+
+    const int64_t start_time = esp_timer_get_time();
+    for (int i = 0; i < REGISTER_TEST_READS; i++) {
+        const int64_t read_start_time = esp_timer_get_time();
+
+        uint16_t value;
+        if (fpga_comms_register_read(REGISTER_BASE_ADDRESS, &value) != ESP_OK)
+            failures++;
+
+        const int64_t read_time = esp_timer_get_time() - read_start_time;
+        if (read_time > time_us_max)
+            time_us_max = read_time;
+    }
+    const int64_t total_time = esp_timer_get_time() - start_time;
+
+    ESP_LOGI(TAG, "register read: polling_threshold:%i mean us:%.2f max us:%u failures:%i",
+        polling_threshold,
+        (double)total_time / REGISTER_TEST_READS,
+        (uint32_t)time_us_max,
+        failures);
+
+    fpga_comms_polling_threshold_set(CONFIG_FPGA_COMMS_POLLING_THRESHOLD);
+}
+
+// Memory writes /////////////////////////////////////////////////////////////////////////
+
+#define MEMORY_TEST_BYTES (256 * 1024)
+#define MEMORY_MAX_WRITE (16 * 1024)
+
+//! @brief Measure memory write throughput for a given write size
+//!
+//! Writes a total of MEMORY_TEST_BYTES, in writes of write_size bytes. Writes
+//! larger than one pool buffer are split into chunks by the driver.
+//!
+//! @param[in] write_size Number of bytes per write
+static void benchmark_memory_write(int write_size)
+{
+    uint8_t* buffer = malloc(write_size);
+    if (buffer == NULL) {
+        ESP_LOGE(TAG, "Unable to allocate memory write buffer");
+        return;
+    }
+
+    for (int i = 0; i < write_size; i++) {
+        buffer[i] = i;
+    }
+
+    const int iterations = MEMORY_TEST_BYTES / write_size;
+    int failures = 0;
+
+    const int64_t start_time = esp_timer_get_time();
+    for (int iteration = 0; iteration < iterations; iteration++) {
+        if (fpga_comms_memory_write(0x0000, buffer, write_size, 10) != ESP_OK)
+            failures++;
+    }
+    fpga_comms_drain();
+    const int64_t write_time = esp_timer_get_time() - start_time;
+
+    free(buffer);
+
+    // Bytes per microsecond is equivalent to MB/s
+    ESP_LOGI(TAG, "memory write: write_size:%i MB/s:%.2f failures:%i",
+        write_size,
+        (double)iterations * write_size / write_time,
+        failures);
+}
+
+// Buffer count ////////////////////////////////////////////////////////////////////////
+
+//! @brief Measure write throughput with fewer pool buffers available
+//!
+//! The pool size is fixed by CONFIG_FPGA_SPI_BUFFER_COUNT, so the smaller pool
+//! is simulated by holding the remaining buffers for the length of the test.
+//!
+//! @param[in] buffer_count Number of pool buffers left available to the driver
+static void benchmark_buffer_count(int buffer_count)
+{
+    static output_trans_pool_t* held[CONFIG_FPGA_SPI_BUFFER_COUNT];
+
+    int held_count = 0;
+    while (held_count < CONFIG_FPGA_SPI_BUFFER_COUNT - buffer_count) {
+        held[held_count] = output_trans_pool_take(10);
+        if (held[held_count] == NULL) {
+            ESP_LOGE(TAG, "Unable to reserve pool buffer");
+            break;
+        }
+        held_count++;
+    }
+
+    ESP_LOGI(TAG, "buffer count: buffers:%i", CONFIG_FPGA_SPI_BUFFER_COUNT - held_count);
+    benchmark_register_write(16);
+    benchmark_memory_write(4 * 1024);
+
+    for (int i = 0; i < held_count; i++) {
+        output_trans_pool_release(held[i]);
+    }
+}
+
+// Bitstream loading /////////////////////////////////////////////////////////////////////
+
+//! @brief Measure the time to load a bitstream into the FPGA
+//!
+//! @param[in] name Name to print with the results
+//! @param[in] bin Bitstream to load
+static void benchmark_bitstream_load(const char* name, const fpga_bin_t* bin)
+{
+    const int64_t start_time = esp_timer_get_time();
+    const esp_err_t ret = fpga_loader_load_from_rom(bin);
+    const int64_t load_time = esp_timer_get_time() - start_time;
+
+    ESP_LOGI(TAG, "bitstream load: %s size:%i ratio:%.3f ms:%.2f result:%s",
+        name,
+        bin->end - bin->start,
+        (double)(bin->end - bin->start) / (fpga_bin.end - fpga_bin.start),
+        load_time / 1000.0,
+        esp_err_to_name(ret));
+
+    // If most of the time is spent waiting for SPI, the load is SPI-bound
+    fpga_loader_stats_t stats;
+    fpga_loader_stats_get(&stats);
+    ESP_LOGI(TAG, "bitstream load: %s chunk_size:%i read ms:%.2f spi wait ms:%.2f",
+        name,
+        CONFIG_FPGA_LOADER_CHUNK_SIZE,
+        stats.source_time_us / 1000.0,
+        stats.spi_wait_time_us / 1000.0);
+    ESP_LOGI(TAG, "bitstream load: %s us reset:%u bitstream:%u cdone:%u wake:%u",
+        name,
+        stats.reset_time_us,
+        stats.bitstream_time_us,
+        stats.cdone_time_us,
+        stats.wake_time_us);
+}
+
+// MAIN ///////////////////////////////////////////////////////////////////////
+
+void app_main(void)
+{
+    ESP_ERROR_CHECK(fpga_start(&fpga_bin));
+
+#ifdef CONFIG_FPGA_COMMS_COMPLETION_REAPER
+    ESP_LOGI(TAG, "completion: reaper task");
+#else
+    ESP_LOGI(TAG, "completion: SPI ISR");
+#endif
+
+    benchmark_pool(1);
+    benchmark_pool(POOL_MAX_BUFFERS_PER_TASK);
+
+    benchmark_register_write(1);
+    benchmark_register_write(3);
+    benchmark_register_write(16);
+    benchmark_register_write(REGISTER_MAX_BATCH);
+
+    benchmark_register_read(0);
+    benchmark_register_read(2);
+
+    benchmark_memory_write(1024);
+    benchmark_memory_write(4 * 1024);
+    benchmark_memory_write(MEMORY_MAX_WRITE);
+
+    benchmark_buffer_count(2);
+    benchmark_buffer_count(CONFIG_FPGA_SPI_BUFFER_COUNT / 2);
+
+    benchmark_bitstream_load("raw", &fpga_bin);
+    benchmark_bitstream_load("compressed", &fpga_bin_rle);
+
+    fpga_comms_latency_print();
+    master_spi_lock_stats_print();
+
+    while (true) {
+        vTaskDelay(1000 / portTICK_PERIOD_MS);
+    }
+}
@@ -1,4 +1,5 @@
 # Clock frequency constraints
 
 #ctx.addClock("clk", 24)   # Global clock
-ctx.addClock("FSPI_CLK", 20)     # SPI input clock
+ctx.addClock("FSPI_CLK", 20)     # SPI input clock. See spi.v for the limits
+                                 # set by the clock domain crossing.
@@ -17,6 +17,40 @@ module spi (
     input [15:0] i_read_data       // Data read from FPGA memory
 );
 
+// Timing
+//
+// Transactions are 8 SCK cycles of command and 16 of address, followed by
+// 16 SCK cycles per data word. Reads add 8 cycles of turnaround after the
+// address.
+//
+// Each word is handed to the system clock domain by flipping
+// transaction_toggle. With a 24 MHz system clock (T = 41.7ns), the toggle
+// takes up to 3T to become o_transaction_strobe: up to 1T to be sampled,
+// then 1T each through sync_ss and toggle_to_strobe. The consumer in top.v
+// then needs:
+//
+// * Register write: o_write_data and o_address held until 4T (167ns)
+// * Memory write: held until 5T (208ns), since the RAM write enable is
+//   registered
+// * Register read: i_read_data valid by 4T
+//
+// Write data and address are held until the next word is complete, which is
+// 16 SCK cycles later. The first read word is sampled from read_data_sync 7
+// SCK cycles after the toggle. Later read words have 15 cycles. Each of these must be longer than the time the consumer needs,
+// which gives these limits on the SCK frequency (rounded down to whole MHz):
+//
+// * Writes: 76 MHz (16 cycles > 5T)
+// * Register reads: 41 MHz (7 cycles > 4T)
+//
+// top_tb.v sweeps the SCK frequency for each of these, with random phase
+// against the system clock, and fails if any works only below its limit
+// here ('make sim'). The host co-simulation (esp-idf-library/host/cosim)
+// runs fpga_comms against this gateware at each SCK frequency the ESP32 can
+// make, and checks the one set for the CM-2 example.
+//
+// Separately, the SCK domain logic is only constrained to 20 MHz (see
+// clocks.py). Check the nextpnr report ('make stats') for the actual limit.
+
 // System data register to SPI input
 
     reg [15:0] read_data_sync;
@@ -0,0 +1,337 @@
+// Testbench for the CM-2 gateware
+//
+// Drives the SPI interface of top.v the same way as the ESP32-S2 (mode 3,
+// 8 bit command, 16 bit address, then data) and checks what arrives in the
+// system clock domain against the SCK frequency limits given in spi.v. Run
+// it with 'make sim'.
+//
+// The system clock normally comes from the SB_HFOSC, which has no
+// simulation model, so it is forced from here.
+
+`timescale 1ps / 1ps
+
+module top_tb;
+
+    localparam CLK_PERIOD_PS = 41667;       // 24 MHz system clock
+
+    localparam COMMAND_WRITE_MEM = 8'h01;
+    localparam COMMAND_READ_REG = 8'h02;
+    localparam COMMAND_WRITE_REG = 8'h03;
+
+    localparam WORDS_MAX = 256;
+
+    //############ Clock ####################################################
+
+    reg clk;
+
+    initial begin
+        clk = 1'b0;
+        force dut.clk = clk;
+    end
+
+    always #(CLK_PERIOD_PS / 2) clk = ~clk;
+
+    //############ Device under test ########################################
+
+    reg sck;
+    reg cs;
+    reg mosi;
+
+    wire miso_pin;
+
+    top dut (
+        .FSPI_CLK(sck),
+        .FSPI_MOSI(mosi),
+        .FSPI_CS(cs),
+        .FSPI_MISO(miso_pin),
+
+        .SW_1(1'b1),
+        .SW_2(1'b1),
+        .SW_T(1'b1)
+    );
+
+    //############ SPI master ###############################################
+
+    integer sck_half_ps;                    // Half of the SCK period
+
+    // Words to send with spi_write(), and received by spi_read()
+    reg [15:0] tx_words [0:WORDS_MAX-1];
+    reg [15:0] rx_words [0:WORDS_MAX-1];
+
+    // Words the tests expect to read back
+    reg [15:0] expected_words [0:WORDS_MAX-1];
+
+    integer errors;
+
+    initial begin
+        sck = 1'b1;                         // Mode 3: SCK idles high
+        cs = 1'b1;
+        mosi = 1'b0;
+
+        sck_half_ps = 50000;                // 10 MHz
+        errors = 0;
+    end
+
+    task spi_set_frequency;
+        input integer mhz;
+        begin
+            sck_half_ps = 500000 / mhz;
+        end
+    endtask
+
+    // Start a transaction at a random point in the system clock cycle
+    task spi_begin;
+        begin
+            #({$random} % CLK_PERIOD_PS);
+            cs = 1'b0;
+            #(sck_half_ps);
+        end
+    endtask
+
+    // End a transaction, and leave time for the last word to be used
+    task spi_end;
+        begin
+            #(sck_half_ps);
+            cs = 1'b1;
+            #(CLK_PERIOD_PS * 8);
+        end
+    endtask
+
+    // Send bits on MOSI. Data changes on the falling edge of SCK, and is
+    // sampled by the FPGA on the rising edge.
+    task spi_send;
+        input [15:0] value;
+        input integer bits;
+        integer index;
+        begin
+            for (index = bits - 1; index >= 0; index = index - 1) begin
+                sck = 1'b0;
+                mosi = value[index];
+                #(sck_half_ps);
+                sck = 1'b1;
+                #(sck_half_ps);
+            end
+        end
+    endtask
+
+    // Receive bits on MISO, sampled on the rising edge of SCK
+    task spi_receive;
+        output [15:0] value;
+        input integer bits;
+        integer index;
+        begin
+            value = 16'd0;
+            for (index = bits - 1; index >= 0; index = index - 1) begin
+                sck = 1'b0;
+                #(sck_half_ps);
+                value[index] = miso_pin;
+                sck = 1'b1;
+                #(sck_half_ps);
+            end
+        end
+    endtask
+
+    // Write count words from tx_words, starting at address
+    task spi_write;
+        input [7:0] command;
+        input [15:0] address;
+        input integer count;
+        integer word;
+        begin
+            spi_begin;
+            spi_send(command, 8);
+            spi_send(address, 16);
+
+            for (word = 0; word < count; word = word + 1)
+                spi_send(tx_words[word], 16);
+
+            spi_end;
+        end
+    endtask
+
+    // Read count words into rx_words, starting at address
+    task spi_read;
+        input [7:0] command;
+        input [15:0] address;
+        input integer count;
+        integer word;
+        reg [15:0] turnaround;
+        begin
+            spi_begin;
+            spi_send(command, 8);
+            spi_send(address, 16);
+            spi_receive(turnaround, 8);
+
+            for (word = 0; word < count; word = word + 1)
+                spi_receive(rx_words[word], 16);
+
+            spi_end;
+        end
+    endtask
+
+    //############ RAM write log ############################################
+
+    // Every word written to the LED RAM, as {bank, address, data}. The CM-2
+    // gateware can't read its memory back over SPI, so memory writes are
+    // checked here, with the address and data the RAM actually latched.
+    localparam LOG_MAX = 1024;
+
+    integer ram_log_count;
+    reg [31:0] ram_log_entries [0:LOG_MAX-1];
+
+    initial begin
+        ram_log_count = 0;
+    end
+
+    always @(posedge clk) begin
+        if ((dut.matrix_1_we || dut.matrix_2_we) && (ram_log_count < LOG_MAX)) begin
+            ram_log_entries[ram_log_count] <= dut.matrix_1_we
+                ? {8'h00, dut.matrix_1_waddr, dut.matrix_1_wdata}
+                : {8'h01, dut.matrix_2_waddr, dut.matrix_2_wdata};
+            ram_log_count <= ram_log_count + 1;
+        end
+    end
+
+    // Check that the RAM log holds exactly count words from expected_words,
+    // written from address up
+    task ram_log_check;
+        input [15:0] address;
+        input integer count;
+        output passed;
+        integer word;
+        begin
+            passed = (ram_log_count == count);
+            for (word = 0; (word < count) && (word < ram_log_count); word = word + 1) begin
+                if (ram_log_entries[word] !== {address + word[15:0], expected_words[word]})
+                    passed = 1'b0;
+            end
+        end
+    endtask
+
+    //############ Timing limits ############################################
+
+    // Operations with an SCK frequency limit, see the timing notes in spi.v
+    localparam OP_WRITE_REG = 0;
+    localparam OP_WRITE_MEM = 1;
+    localparam OP_READ_REG = 2;
+
+    localparam SLOW_MHZ = 10;               // Setup and checks, below every limit
+    localparam FAST_MHZ_MAX = 80;           // Fastest SCK the ESP32 can make
+    localparam TIMING_TRIALS = 32;          // Transactions at each frequency
+
+    // Run one transaction of an operation at the given SCK frequency, with
+    // the setup or check transaction at SLOW_MHZ. Memory writes are checked
+    // in the RAM write log instead. Returns passed = 0 if any word was lost
+    // or corrupted.
+    task timing_trial;
+        input integer op;
+        input integer mhz;
+        output passed;
+        reg [7:0] write_command;
+        reg [7:0] read_command;
+        reg [15:0] address;
+        integer count;
+        integer word;
+        begin
+            if ((op == OP_WRITE_REG) || (op == OP_READ_REG)) begin
+                // Red, green and blue duty
+                write_command = COMMAND_WRITE_REG;
+                read_command = COMMAND_READ_REG;
+                address = 16'h00F0;
+                count = 3;
+            end else begin
+                // Anywhere in the first LED RAM
+                write_command = COMMAND_WRITE_MEM;
+                read_command = 8'd0;
+                address = {$random} % (256 - 16);
+                count = 16;
+            end
+
+            for (word = 0; word < count; word = word + 1) begin
+                expected_words[word] = $random;
+                tx_words[word] = expected_words[word];
+            end
+
+            if (op == OP_READ_REG) begin
+                spi_set_frequency(SLOW_MHZ);
+                spi_write(write_command, address, count);
+                spi_set_frequency(mhz);
+                spi_read(read_command, address, count);
+            end else if (op == OP_WRITE_MEM) begin
+                ram_log_count = 0;
+                spi_set_frequency(mhz);
+                spi_write(write_command, address, count);
+            end else begin
+                spi_set_frequency(mhz);
+                spi_write(write_command, address, count);
+                spi_set_frequency(SLOW_MHZ);
+                spi_read(read_command, address, count);
+            end
+
+            if (op == OP_WRITE_MEM) begin
+                ram_log_check(address, count, passed);
+            end else begin
+                passed = 1'b1;
+                for (word = 0; word < count; word = word + 1) begin
+                    if (rx_words[word] !== expected_words[word])
+                        passed = 1'b0;
+                end
+            end
+        end
+    endtask
+
+    // Find the highest SCK frequency, in whole MHz, at which an operation
+    // works every time, and check that it isn't below the limit in spi.v.
+    // Every frequency from SLOW_MHZ up is tried, so a limit is only
+    // reported if everything below it works too.
+    task test_timing;
+        input integer op;
+        input [8*24-1:0] name;
+        input integer documented_mhz;
+        integer mhz;
+        integer trial;
+        integer measured_mhz;
+        reg passed;
+        reg failed;
+        begin
+            measured_mhz = 0;
+            failed = 1'b0;
+
+            for (mhz = SLOW_MHZ; (mhz <= FAST_MHZ_MAX) && !failed; mhz = mhz + 1) begin
+                for (trial = 0; (trial < TIMING_TRIALS) && !failed; trial = trial + 1) begin
+                    timing_trial(op, mhz, passed);
+                    if (!passed)
+                        failed = 1'b1;
+                end
+
+                if (!failed)
+                    measured_mhz = mhz;
+            end
+
+            if (measured_mhz < documented_mhz) begin
+                $display("FAIL timing: %0s works to %0d MHz, spi.v says %0d MHz",
+                    name, measured_mhz, documented_mhz);
+                errors = errors + 1;
+            end else begin
+                $display("timing: %0s works to %0d MHz, spi.v says %0d MHz",
+                    name, measured_mhz, documented_mhz);
+            end
+        end
+    endtask
+
+    initial begin
+        // Let the RAM and synchronizers settle
+        #(CLK_PERIOD_PS * 16);
+
+        test_timing(OP_WRITE_REG, "register writes", 76);
+        test_timing(OP_WRITE_MEM, "memory writes", 76);
+        test_timing(OP_READ_REG, "register reads", 41);
+
+        if (errors != 0)
+            $fatal(1, "%0d errors", errors);
+
+        $display("PASS");
+        $finish;
+    end
+
+endmodule
@@ -54,12 +54,42 @@ class IcedEspresso:
         if (response.status_code != 200):
             raise HttpError(response.status_code, response.text)
 
+    def fpga_slots_get(self):
+        """ List the bitstreams stored in the flash bitstream library """
+        return self.get('fpga/slots')['slots']
+
+    def fpga_slot_put(self, name, version, bitstream):
+        """ Store a bitstream in the library, replacing any with the same name """
+        response = requests.put(self.base_url + 'fpga/slot',
+                params={'name':name, 'version':version},
+                data = bitstream,
+                headers={'Content-Type': 'application/octet-stream'})
+
+        if (response.status_code != 200):
+            raise HttpError(response.status_code, response.text)
+
+    def fpga_slot_activate(self, name):
+        """ Load a bitstream from the library into the FPGA """
+        self.put('fpga/slot/activate', data={'name':name})
+
+    def fpga_slot_erase(self, name):
+        """ Remove a bitstream from the library """
+        self.put('fpga/slot/erase', data={'name':name})
+
     def register_get(self, address):
         return self.get('fpga/register', params={'address':address})['value']
 
     def register_put(self, address, value):
         self.put('fpga/register', params={'address':address}, data={'value':value})
 
+    def latency_get(self):
+        """ Get the FPGA transaction latency histograms, by transaction type """
+        return self.get('fpga/latency')
+
+    def bus_lock_get(self):
+        """ Get the SPI bus lock statistics, by task """
+        return self.get('fpga/bus_lock')
+
     def memory_get(self, address, length):
         response = requests.get(self.base_url + 'fpga/memory',
                 params={'address':address, 'length':length}
@@ -227,7 +257,7 @@ if __name__ == '__main__':
             with self.assertRaises(HttpError):
                 self.ie.memory_put(0, bytearray(513))
 
-# TODO
+# TODO: The CM-2 gateware (fpga/top.v) doesn't implement memory reads.
 #        def test_fpga_memory_get(self):
 #            response = self.ie.memory_get(0,1)
 #            self.assertEqual(len(response),1)
@@ -50,9 +50,12 @@ esp_err_t led_set(
     const uint16_t green_i = green * 65535;
     const uint16_t blue_i = blue * 65535;
 
-    fpga_comms_register_write(RED_DUTY_REG, red_i);
-    fpga_comms_register_write(GREEN_DUTY_REG, green_i);
-    return fpga_comms_register_write(BLUE_DUTY_REG, blue_i);
+    // Only registers that changed are sent
+    fpga_comms_register_write_deferred(RED_DUTY_REG, red_i);
+    fpga_comms_register_write_deferred(GREEN_DUTY_REG, green_i);
+    fpga_comms_register_write_deferred(BLUE_DUTY_REG, blue_i);
+
+    return fpga_comms_register_flush();
 }
 
 esp_err_t led_get(
@@ -60,17 +63,21 @@ esp_err_t led_get(
     double* green,
     double* blue)
 {
-    uint16_t red_uint;
-    uint16_t green_uint;
-    uint16_t blue_uint;
-
-    fpga_comms_register_read(RED_DUTY_REG, &red_uint);
-    fpga_comms_register_read(GREEN_DUTY_REG, &green_uint);
-    fpga_comms_register_read(BLUE_DUTY_REG, &blue_uint);
+    const uint16_t addresses[] = {
+        RED_DUTY_REG,
+        GREEN_DUTY_REG,
+        BLUE_DUTY_REG,
+    };
+    uint16_t values[3];
+
+    const esp_err_t ret = fpga_comms_register_read_batch(addresses, values, 3);
+    if (ret != ESP_OK) {
+        return ret;
+    }
 
-    *red = red_uint/65535.0;
-    *green = green_uint/65535.0;
-    *blue = blue_uint/65535.0;
+    *red = values[0]/65535.0;
+    *green = values[1]/65535.0;
+    *blue = values[2]/65535.0;
 
     return ESP_OK;
 }
@@ -115,6 +122,40 @@ static void brightness_set(double brightness)
     }
 }
 
+//! @brief Lease the DMA buffers for both panels, so that a frame can be rendered in place
+//!
+//! @param[out] led_ram_left Leased buffer for the left panel
+//! @param[out] led_ram_right Leased buffer for the right panel
+//! @return true if both buffers were leased, false otherwise
+static bool frame_lease(output_trans_pool_t** led_ram_left, output_trans_pool_t** led_ram_right)
+{
+    *led_ram_left = fpga_comms_memory_write_lease(0);
+    *led_ram_right = fpga_comms_memory_write_lease(0);
+
+    if ((*led_ram_left == NULL) || (*led_ram_right == NULL)) {
+        if (*led_ram_left != NULL)
+            fpga_comms_memory_write_cancel(*led_ram_left);
+        if (*led_ram_right != NULL)
+            fpga_comms_memory_write_cancel(*led_ram_right);
+        return false;
+    }
+
+    return true;
+}
+
+//! @brief Send a frame rendered into leased buffers to the display
+static esp_err_t frame_submit(output_trans_pool_t* led_ram_left, output_trans_pool_t* led_ram_right)
+{
+    // A failed submit releases its own lease, but not the other one
+    esp_err_t ret = fpga_comms_memory_write_submit(led_ram_right, 0x0000, LED_COUNT * sizeof(uint16_t));
+    if (ret != ESP_OK) {
+        fpga_comms_memory_write_cancel(led_ram_left);
+        return ret;
+    }
+
+    return fpga_comms_memory_write_submit(led_ram_left, 0x0200, LED_COUNT * sizeof(uint16_t));
+}
+
 static void display_random_and_pleasing()
 {
     static long int next_time;
@@ -125,23 +166,25 @@ static void display_random_and_pleasing()
     }
     next_time = now + 100*1000;
 
-    static uint16_t led_ram_left[LED_COUNT];
-    static uint16_t led_ram_right[LED_COUNT];
+    output_trans_pool_t* lease_left;
+    output_trans_pool_t* lease_right;
+    if (!frame_lease(&lease_left, &lease_right)) {
+        return;
+    }
+
+    uint16_t* led_ram_left = (uint16_t*)lease_left->buffer;
+    uint16_t* led_ram_right = (uint16_t*)lease_right->buffer;
 
     for (int i = 0; i < LED_COUNT; i++) {
         led_ram_left[i] = lookup(255*(rand()%2));
         led_ram_right[i] = lookup(255*(rand()%2));
     }
 
-    fpga_comms_memory_write(0x0000, (const uint8_t*)led_ram_right, sizeof(led_ram_right), 0);
-    fpga_comms_memory_write(0x0200, (const uint8_t*)led_ram_left, sizeof(led_ram_left), 0);
+    frame_submit(lease_left, lease_right);
 }
 
 static void display_circle()
 {
-    static uint16_t led_ram_left[LED_COUNT];
-    static uint16_t led_ram_right[LED_COUNT];
-
     static float phase = 0;
 
     static float x_focus = 3;
@@ -149,6 +192,15 @@ static void display_circle()
     static bool x_focus_dir = true;
     static bool y_focus_dir = true;
 
+    output_trans_pool_t* lease_left;
+    output_trans_pool_t* lease_right;
+    if (!frame_lease(&lease_left, &lease_right)) {
+        return;
+    }
+
+    uint16_t* led_ram_left = (uint16_t*)lease_left->buffer;
+    uint16_t* led_ram_right = (uint16_t*)lease_right->buffer;
+
     for (int x = 0; x < 8; x++) {
         for (int y = 0; y < 32; y++) {
             const int i = x + y * 8;
@@ -161,8 +213,7 @@ static void display_circle()
         }
     }
 
-    fpga_comms_memory_write(0x0000, (const uint8_t*)led_ram_right, sizeof(led_ram_right), 0);
-    fpga_comms_memory_write(0x0200, (const uint8_t*)led_ram_left, sizeof(led_ram_left), 0);
+    frame_submit(lease_left, lease_right);
 
     phase += .1;
 
@@ -317,8 +368,14 @@ static esp_err_t bitmap_put(const char* buf, int length)
 
     wifi_mode = true;
 
-    uint16_t led_ram_left[LED_COUNT];
-    uint16_t led_ram_right[LED_COUNT];
+    output_trans_pool_t* lease_left;
+    output_trans_pool_t* lease_right;
+    if (!frame_lease(&lease_left, &lease_right)) {
+        return ESP_FAIL;
+    }
+
+    uint16_t* led_ram_left = (uint16_t*)lease_left->buffer;
+    uint16_t* led_ram_right = (uint16_t*)lease_right->buffer;
 
     for (int led = 0; led < LED_COUNT; led++) {
         const int col = led % LED_COLS;
@@ -329,10 +386,7 @@ static esp_err_t bitmap_put(const char* buf, int length)
         led_ram_right[led] = lookup(buf[(row*LED_COLS*2 + (LED_COLS*2-1-8-col))]);
     }
 
-    fpga_comms_memory_write(0x0000, (const uint8_t*)led_ram_right, sizeof(led_ram_right), 0);
-    fpga_comms_memory_write(0x0200, (const uint8_t*)led_ram_left, sizeof(led_ram_left), 0);
-
-    return ESP_OK;
+    return frame_submit(lease_left, lease_right);
 }
 
 
@@ -396,6 +450,9 @@ void app_main(void)
 
     ESP_ERROR_CHECK(fpga_start(&fpga_bin));
 
+    // The LED duty registers are only written by us, so keep a copy to read back from
+    fpga_comms_register_cache_configure(RED_DUTY_REG, 3, FPGA_COMMS_REGISTER_CACHED);
+
     status_led_set(false);
     led_set(0,0,0);
     brightness_set(0.15);
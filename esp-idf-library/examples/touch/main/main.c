@@ -26,9 +26,12 @@ static void led_set(
         uint16_t green,
         uint16_t blue)
 {
-    fpga_comms_register_write(RED_DUTY_REG, red);
-    fpga_comms_register_write(GREEN_DUTY_REG, green);
-    fpga_comms_register_write(BLUE_DUTY_REG, blue);
+    // Only registers that changed are sent
+    fpga_comms_register_write_deferred(RED_DUTY_REG, red);
+    fpga_comms_register_write_deferred(GREEN_DUTY_REG, green);
+    fpga_comms_register_write_deferred(BLUE_DUTY_REG, blue);
+
+    fpga_comms_register_flush();
 }
 
 // MAIN ///////////////////////////////////////////////////////////////////////
@@ -38,6 +41,8 @@ void app_main(void)
 {
     ESP_ERROR_CHECK(fpga_start(&fpga_bin));
 
+    fpga_comms_register_cache_configure(RED_DUTY_REG, 3, FPGA_COMMS_REGISTER_WRITE_ONLY);
+
     touch_pad_init();
     touch_pad_config(4);
     touch_pad_config(5);
@@ -0,0 +1,607 @@
+//! @file benchmark.c
+//! @brief Host benchmark for the FPGA driver
+//!
+//! Runs the driver against the SPI, GPIO and FreeRTOS shims, with the CM-2
+//! gateware model in mock_fpga.c in place of the FPGA. Every benchmark also
+//! checks its results against the model, so this doubles as a test: the
+//! exit status is non-zero if any check fails.
+//!
+//! Usage:
+//!
+//!     benchmark [--quick] [--wire-time] top.bin [top.bin.rle]
+
+#include "fpga_comms.h"
+#include "fpga_loader.h"
+#include "master_spi.h"
+#include "mock_fpga.h"
+#include "output_trans_pool.h"
+#include <driver/spi_master.h>
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const char* TAG = "benchmark";
+
+//! Shorter runs, for CI
+static bool quick = false;
+
+//! Number of failed checks
+static int failures = 0;
+
+#define CHECK(condition, ...)               \
+    do {                                    \
+        if (!(condition)) {                 \
+            ESP_LOGE(TAG, __VA_ARGS__);     \
+            failures++;                     \
+        }                                   \
+    } while (0)
+
+// FPGA image ////////////////////////////////////////////////////////////////////////////
+
+//! @brief Read a file into memory
+static esp_err_t bin_read(const char* filename, fpga_bin_t* bin)
+{
+    FILE* file = fopen(filename, "rb");
+    if (file == NULL) {
+        ESP_LOGE(TAG, "Unable to open %s", filename);
+        return ESP_FAIL;
+    }
+
+    fseek(file, 0, SEEK_END);
+    const long size = ftell(file);
+    rewind(file);
+
+    uint8_t* data = malloc(size);
+    if ((data == NULL) || (fread(data, 1, size, file) != (size_t)size)) {
+        ESP_LOGE(TAG, "Unable to read %s", filename);
+        free(data);
+        fclose(file);
+        return ESP_FAIL;
+    }
+
+    fclose(file);
+
+    bin->start = data;
+    bin->end = data + size;
+    return ESP_OK;
+}
+
+// Output transaction pool ///////////////////////////////////////////////////////////////
+
+#define POOL_TASK_COUNT 4
+#define POOL_MAX_BUFFERS_PER_TASK 4
+
+typedef struct {
+    SemaphoreHandle_t done;
+    int buffers_per_task;
+    int64_t test_time_us;
+    uint32_t operations;
+} pool_task_ctx_t;
+
+static void pool_task(void* param)
+{
+    pool_task_ctx_t* ctx = (pool_task_ctx_t*)param;
+    output_trans_pool_t* output_trans_pools[POOL_MAX_BUFFERS_PER_TASK];
+
+    const int64_t end_time = esp_timer_get_time() + ctx->test_time_us;
+
+    while (esp_timer_get_time() < end_time) {
+        int taken = 0;
+        while (taken < ctx->buffers_per_task) {
+            output_trans_pools[taken] = output_trans_pool_take_wait(pdMS_TO_TICKS(10));
+            if (output_trans_pools[taken] == NULL)
+                break;
+            taken++;
+        }
+
+        // Release everything on a timeout too, so that tasks holding partial
+        // sets can't deadlock each other
+        for (int i = 0; i < taken; i++) {
+            output_trans_pool_release(output_trans_pools[i]);
+        }
+
+        ctx->operations += taken;
+    }
+
+    xSemaphoreGive(ctx->done);
+    vTaskDelete(NULL);
+}
+
+//! @brief Hammer the transaction pool from several tasks at once
+//!
+//! As in examples/benchmark. The tasks are threads here, so they run in
+//! parallel on a multi-core host rather than being time sliced.
+//!
+//! @param[in] buffers_per_task Number of buffers each task holds at once
+static void benchmark_pool(int buffers_per_task)
+{
+    static pool_task_ctx_t ctxs[POOL_TASK_COUNT];
+
+    const int64_t test_time_us = quick ? (100 * 1000) : (1000 * 1000);
+    SemaphoreHandle_t done = xSemaphoreCreateCounting(POOL_TASK_COUNT, 0);
+
+    for (int i = 0; i < POOL_TASK_COUNT; i++) {
+        ctxs[i].done = done;
+        ctxs[i].buffers_per_task = buffers_per_task;
+        ctxs[i].test_time_us = test_time_us;
+        ctxs[i].operations = 0;
+        xTaskCreate(pool_task, "pool_task", 2048, &ctxs[i], 5, NULL);
+    }
+
+    uint32_t operations = 0;
+    for (int i = 0; i < POOL_TASK_COUNT; i++) {
+        xSemaphoreTake(done, portMAX_DELAY);
+    }
+    for (int i = 0; i < POOL_TASK_COUNT; i++) {
+        operations += ctxs[i].operations;
+    }
+
+    vSemaphoreDelete(done);
+
+    ESP_LOGI(TAG, "pool: tasks:%i buffers_per_task:%i buffers:%i take/release per second:%" PRIu32,
+        POOL_TASK_COUNT,
+        buffers_per_task,
+        CONFIG_FPGA_SPI_BUFFER_COUNT,
+        (uint32_t)((uint64_t)operations * 1000000 / test_time_us));
+
+    CHECK(operations > 0, "pool: no buffers taken");
+
+    // Every buffer must be back in the pool
+    output_trans_pool_t* held[CONFIG_FPGA_SPI_BUFFER_COUNT];
+    int held_count = 0;
+    while ((held_count < CONFIG_FPGA_SPI_BUFFER_COUNT)
+        && ((held[held_count] = output_trans_pool_take_wait(0)) != NULL))
+        held_count++;
+    for (int i = 0; i < held_count; i++)
+        output_trans_pool_release(held[i]);
+
+    CHECK(held_count == CONFIG_FPGA_SPI_BUFFER_COUNT, "pool: only %i of %i buffers free after the test",
+        held_count, CONFIG_FPGA_SPI_BUFFER_COUNT);
+
+    output_trans_pool_stats_print();
+}
+
+// Register writes ///////////////////////////////////////////////////////////////////////
+
+#define REGISTER_BASE_ADDRESS 0x00F0
+#define REGISTER_MAX_BATCH 64
+
+//! @brief Wait for all queued transactions to finish
+//!
+//! Transactions are sent in order, so once a register read returns, all
+//! previously queued writes have been sent.
+static void fpga_comms_drain()
+{
+    uint16_t value;
+    fpga_comms_register_read(REGISTER_BASE_ADDRESS, &value);
+}
+
+//! @brief Check that the registers hold the values last written
+static void register_check(const char* name, const fpga_comms_register_t* registers, int count)
+{
+    for (int i = 0; i < count; i++) {
+        const uint16_t value = mock_fpga_register_get(registers[i].address);
+        CHECK(value == registers[i].value, "register write: %s address:0x%04x expected:0x%04x read:0x%04x",
+            name, registers[i].address, registers[i].value, value);
+    }
+}
+
+//! @brief Measure register write throughput, with and without batching
+//!
+//! As in examples/benchmark. Each pass writes different values, so that the
+//! check catches writes that were dropped.
+//!
+//! @param[in] batch_size Number of registers written per group
+static void benchmark_register_write(int batch_size)
+{
+    static fpga_comms_register_t registers[REGISTER_MAX_BATCH];
+
+    const int total_writes = quick ? 1024 : 65536;
+    const int iterations = total_writes / batch_size;
+
+    for (int i = 0; i < batch_size; i++) {
+        registers[i].address = REGISTER_BASE_ADDRESS + i;
+    }
+
+    int64_t start_time = esp_timer_get_time();
+    for (int iteration = 0; iteration < iterations; iteration++) {
+        for (int i = 0; i < batch_size; i++) {
+            registers[i].value = iteration * REGISTER_MAX_BATCH + i;
+            fpga_comms_register_write(registers[i].address, registers[i].value);
+        }
+    }
+    fpga_comms_drain();
+    const int64_t single_time = esp_timer_get_time() - start_time;
+
+    register_check("single", registers, batch_size);
+
+    start_time = esp_timer_get_time();
+    for (int iteration = 0; iteration < iterations; iteration++) {
+        for (int i = 0; i < batch_size; i++) {
+            registers[i].value = ~(iteration * REGISTER_MAX_BATCH + i);
+        }
+        fpga_comms_register_write_batch(registers, batch_size);
+    }
+    fpga_comms_drain();
+    const int64_t batch_time = esp_timer_get_time() - start_time;
+
+    register_check("batch", registers, batch_size);
+
+    const uint64_t writes = (uint64_t)iterations * batch_size;
+
+    ESP_LOGI(TAG, "register write: batch_size:%i single writes/s:%" PRIu32 " batched writes/s:%" PRIu32,
+        batch_size,
+        (uint32_t)(writes * 1000000 / single_time),
+        (uint32_t)(writes * 1000000 / batch_time));
+}
+
+// Register reads ////////////////////////////////////////////////////////////////////////
+
+//! @brief Measure register read round-trip time, queued and polled
+//!
+//! @param[in] polling_threshold Polling threshold to use, 0 to queue every read
+static void benchmark_register_read(int polling_threshold)
+{
+    if (fpga_comms_polling_threshold_set(polling_threshold) != ESP_OK) {
+        CHECK(false, "Unable to set polling threshold");
+        return;
+    }
+
+    const int reads = quick ? 256 : 4096;
+    int64_t time_us_max = 0;
+    int read_failures = 0;
+
+    fpga_comms_register_write(REGISTER_BASE_ADDRESS, 0x5AA5);
+
+    const int64_t start_time = esp_timer_get_time();
+    for (int i = 0; i < reads; i++) {
+        const int64_t read_start_time = esp_timer_get_time();
+
+        uint16_t value;
+        if ((fpga_comms_register_read(REGISTER_BASE_ADDRESS, &value) != ESP_OK) || (value != 0x5AA5))
+            read_failures++;
+
+        const int64_t read_time = esp_timer_get_time() - read_start_time;
+        if (read_time > time_us_max)
+            time_us_max = read_time;
+    }
+    const int64_t total_time = esp_timer_get_time() - start_time;
+
+    ESP_LOGI(TAG, "register read: polling_threshold:%i mean us:%.2f max us:%" PRIu32 " failures:%i",
+        polling_threshold,
+        (double)total_time / reads,
+        (uint32_t)time_us_max,
+        read_failures);
+
+    CHECK(read_failures == 0, "register read: %i failures", read_failures);
+
+    fpga_comms_polling_threshold_set(CONFIG_FPGA_COMMS_POLLING_THRESHOLD);
+}
+
+// Memory writes /////////////////////////////////////////////////////////////////////////
+
+#define MEMORY_MAX_WRITE (16 * 1024)
+
+//! @brief Check that the FPGA memory holds a buffer, starting at word 0
+static void memory_check(const char* name, const uint8_t* buffer, int length)
+{
+    int mismatches = 0;
+
+    for (int i = 0; i < length / 2; i++) {
+        if (mock_fpga_memory_get(i) != ((buffer[i * 2] << 8) | buffer[i * 2 + 1]))
+            mismatches++;
+    }
+
+    CHECK(mismatches == 0, "%s: %i of %i words differ", name, mismatches, length / 2);
+}
+
+//! @brief Measure memory write throughput for a given write size
+//!
+//! @param[in] write_size Number of bytes per write
+static void benchmark_memory_write(int write_size)
+{
+    uint8_t* buffer = malloc(write_size);
+    if (buffer == NULL) {
+        CHECK(false, "Unable to allocate memory write buffer");
+        return;
+    }
+
+    const int total_bytes = quick ? (64 * 1024) : (4 * 1024 * 1024);
+    const int iterations = total_bytes / write_size;
+    int write_failures = 0;
+
+    const int64_t start_time = esp_timer_get_time();
+    for (int iteration = 0; iteration < iterations; iteration++) {
+        // Only the last pass is checked, but every pass is different
+        for (int i = 0; i < write_size; i++) {
+            buffer[i] = i + iteration;
+        }
+
+        if (fpga_comms_memory_write(0x0000, buffer, write_size, 10) != ESP_OK)
+            write_failures++;
+    }
+    fpga_comms_drain();
+    const int64_t write_time = esp_timer_get_time() - start_time;
+
+    // Bytes per microsecond is equivalent to MB/s
+    ESP_LOGI(TAG, "memory write: write_size:%i MB/s:%.2f failures:%i",
+        write_size,
+        (double)iterations * write_size / write_time,
+        write_failures);
+
+    CHECK(write_failures == 0, "memory write: %i failures", write_failures);
+    memory_check("memory write", buffer, write_size);
+
+    free(buffer);
+}
+
+//! @brief Check that memory reads return what was written
+static void test_memory_read()
+{
+    const int length = 2 * 1024;
+    uint8_t* written = malloc(length);
+    uint8_t* read = malloc(length);
+
+    for (int i = 0; i < length; i++) {
+        written[i] = (i * 7) ^ 0xA5;
+    }
+
+    CHECK(fpga_comms_memory_write(0x0000, written, length, 10) == ESP_OK, "memory read: write failed");
+
+    // Reads are limited to one pool buffer
+    const int chunk = CONFIG_FPGA_SPI_BUFFER_SIZE - OUTPUT_TRANS_POOL_BUFFER_PADDING;
+    for (int offset = 0; offset < length; offset += chunk) {
+        const int count = (length - offset < chunk) ? (length - offset) : chunk;
+        CHECK(fpga_comms_memory_read(offset, read + offset, count, 10) == ESP_OK,
+            "memory read: read failed, offset:%i", offset);
+    }
+
+    CHECK(memcmp(written, read, length) == 0, "memory read: data differs");
+    ESP_LOGI(TAG, "memory read: %i bytes checked", length);
+
+    free(read);
+    free(written);
+}
+
+// Register cache ///////////////////////////////////////////////////////////////////////
+
+//! Registers used by the coalescing test, clear of the ones the benchmarks use
+#define COALESCE_BASE_ADDRESS 0x0040
+
+//! @brief Check deferred writes against immediate ones
+//!
+//! An immediate write must replace a write staged for the same register, and
+//! deferred writes to uncached registers aren't counted as coalesced.
+static void test_register_coalesce()
+{
+    CHECK(fpga_comms_register_cache_configure(COALESCE_BASE_ADDRESS, 2, FPGA_COMMS_REGISTER_CACHED) == ESP_OK,
+        "register coalesce: configure failed");
+
+    fpga_comms_coalesce_stats_t before;
+    fpga_comms_coalesce_stats_get(&before);
+
+    // Staged, then replaced by an immediate write, in single and batch form
+    fpga_comms_register_write_deferred(COALESCE_BASE_ADDRESS, 0x1111);
+    fpga_comms_register_write(COALESCE_BASE_ADDRESS, 0x2222);
+    fpga_comms_register_write_deferred(COALESCE_BASE_ADDRESS + 1, 0x3333);
+    const fpga_comms_register_t batch[] = { { COALESCE_BASE_ADDRESS + 1, 0x4444 } };
+    fpga_comms_register_write_batch(batch, 1);
+
+    // Uncached, so written immediately
+    fpga_comms_register_write_deferred(COALESCE_BASE_ADDRESS + 2, 0x5555);
+
+    CHECK(fpga_comms_register_flush() == ESP_OK, "register coalesce: flush failed");
+    fpga_comms_drain();
+
+    const fpga_comms_register_t expected[] = {
+        { COALESCE_BASE_ADDRESS, 0x2222 },
+        { COALESCE_BASE_ADDRESS + 1, 0x4444 },
+        { COALESCE_BASE_ADDRESS + 2, 0x5555 },
+    };
+    register_check("coalesce", expected, sizeof(expected) / sizeof(expected[0]));
+
+    fpga_comms_coalesce_stats_t after;
+    fpga_comms_coalesce_stats_get(&after);
+    CHECK(after.writes - before.writes == 2, "register coalesce: %" PRIu32 " writes counted, expected 2",
+        after.writes - before.writes);
+    CHECK(after.flushed == before.flushed, "register coalesce: %" PRIu32 " registers flushed, expected 0",
+        after.flushed - before.flushed);
+}
+
+//! @brief Check that loading a bitstream discards staged register writes
+//!
+//! The registers are reset by the load, so a write staged for the old
+//! bitstream must not be sent to the new one. Uses the registers cached by
+//! test_register_coalesce().
+static void test_load_discards_staged(const fpga_bin_t* bin)
+{
+    fpga_comms_register_write_deferred(COALESCE_BASE_ADDRESS, 0x6666);
+
+    fpga_comms_coalesce_stats_t before;
+    fpga_comms_coalesce_stats_get(&before);
+
+    CHECK(fpga_loader_load_from_rom(bin) == ESP_OK, "load discards staged: load failed");
+    CHECK(fpga_comms_register_flush() == ESP_OK, "load discards staged: flush failed");
+
+    fpga_comms_coalesce_stats_t after;
+    fpga_comms_coalesce_stats_get(&after);
+    CHECK(after.flushed == before.flushed, "load discards staged: %" PRIu32 " registers flushed, expected 0",
+        after.flushed - before.flushed);
+}
+
+// Buffer count ////////////////////////////////////////////////////////////////////////
+
+//! @brief Measure write throughput with fewer pool buffers available
+//!
+//! As in examples/benchmark. The host build is also compiled for several
+//! pool sizes, see CMakeLists.txt.
+//!
+//! @param[in] buffer_count Number of pool buffers left available to the driver
+static void benchmark_buffer_count(int buffer_count)
+{
+    static output_trans_pool_t* held[CONFIG_FPGA_SPI_BUFFER_COUNT];
+
+    int held_count = 0;
+    while (held_count < CONFIG_FPGA_SPI_BUFFER_COUNT - buffer_count) {
+        held[held_count] = output_trans_pool_take(10);
+        if (held[held_count] == NULL) {
+            CHECK(false, "Unable to reserve pool buffer");
+            break;
+        }
+        held_count++;
+    }
+
+    ESP_LOGI(TAG, "buffer count: buffers:%i", CONFIG_FPGA_SPI_BUFFER_COUNT - held_count);
+    benchmark_register_write(16);
+    benchmark_memory_write(4 * 1024);
+
+    for (int i = 0; i < held_count; i++) {
+        output_trans_pool_release(held[i]);
+    }
+}
+
+// Bitstream loading /////////////////////////////////////////////////////////////////////
+
+//! @brief Measure the time to load a bitstream, and check what the FPGA received
+//!
+//! @param[in] name Name to print with the results
+//! @param[in] bin Bitstream to load
+//! @param[in] raw_bin Uncompressed bitstream, that the FPGA should receive
+static void benchmark_bitstream_load(const char* name, const fpga_bin_t* bin, const fpga_bin_t* raw_bin)
+{
+    const int64_t start_time = esp_timer_get_time();
+    const esp_err_t ret = fpga_loader_load_from_rom(bin);
+    const int64_t load_time = esp_timer_get_time() - start_time;
+
+    ESP_LOGI(TAG, "bitstream load: %s size:%i ratio:%.3f ms:%.2f result:%s",
+        name,
+        (int)(bin->end - bin->start),
+        (double)(bin->end - bin->start) / (raw_bin->end - raw_bin->start),
+        load_time / 1000.0,
+        esp_err_to_name(ret));
+
+    CHECK(ret == ESP_OK, "bitstream load: %s failed", name);
+
+    size_t length;
+    const uint8_t* received = mock_fpga_bitstream_get(&length);
+    CHECK((length == (size_t)(raw_bin->end - raw_bin->start))
+            && (memcmp(received, raw_bin->start, length) == 0),
+        "bitstream load: %s received bitstream differs, length:%zu", name, length);
+}
+
+// Deletion //////////////////////////////////////////////////////////////////////////////
+
+#ifdef CONFIG_FPGA_COMMS_COMPLETION_REAPER
+//! @brief Delete the default instance with memory writes still queued
+//!
+//! The reaper must complete them before the SPI device is removed.
+static void test_delete_in_flight()
+{
+    const int length = MEMORY_MAX_WRITE;
+    uint8_t* buffer = malloc(length);
+
+    for (int i = 0; i < length; i++) {
+        buffer[i] = i * 5;
+    }
+
+    esp_err_t ret = fpga_comms_memory_write(0x0000, buffer, length, 10);
+    CHECK(ret == ESP_OK, "delete in flight: memory write failed: %s", esp_err_to_name(ret));
+
+    ret = fpga_comms_delete(fpga_comms_get_default());
+    CHECK(ret == ESP_OK, "delete in flight: %s", esp_err_to_name(ret));
+    CHECK(fpga_comms_get_default() == NULL, "delete in flight: default instance not cleared");
+    memory_check("delete in flight", buffer, length);
+
+    free(buffer);
+}
+#endif
+
+// MAIN ///////////////////////////////////////////////////////////////////////
+
+int main(int argc, char** argv)
+{
+    const char* bin_filename = NULL;
+    const char* rle_filename = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--quick") == 0)
+            quick = true;
+        else if (strcmp(argv[i], "--wire-time") == 0)
+            spi_mock_wire_time_set(true);
+        else if (bin_filename == NULL)
+            bin_filename = argv[i];
+        else
+            rle_filename = argv[i];
+    }
+
+    if (bin_filename == NULL) {
+        fprintf(stderr, "Usage: %s [--quick] [--wire-time] top.bin [top.bin.rle]\n", argv[0]);
+        return 2;
+    }
+
+    fpga_bin_t fpga_bin;
+    fpga_bin_t fpga_bin_rle = {};
+    if ((bin_read(bin_filename, &fpga_bin) != ESP_OK)
+        || ((rle_filename != NULL) && (bin_read(rle_filename, &fpga_bin_rle) != ESP_OK)))
+        return 2;
+
+    mock_fpga_init();
+
+    ESP_ERROR_CHECK(master_spi_init());
+    ESP_ERROR_CHECK(fpga_comms_init());
+    ESP_ERROR_CHECK(fpga_loader_init());
+
+    CHECK(fpga_comms_init() == ESP_ERR_INVALID_STATE, "fpga_comms_init() created a second default instance");
+
+    benchmark_bitstream_load("raw", &fpga_bin, &fpga_bin);
+    if (rle_filename != NULL)
+        benchmark_bitstream_load("compressed", &fpga_bin_rle, &fpga_bin);
+
+#ifdef CONFIG_FPGA_COMMS_COMPLETION_REAPER
+    ESP_LOGI(TAG, "completion: reaper task");
+#else
+    ESP_LOGI(TAG, "completion: SPI ISR");
+#endif
+
+    benchmark_pool(1);
+    benchmark_pool(POOL_MAX_BUFFERS_PER_TASK);
+
+    benchmark_register_write(1);
+    benchmark_register_write(3);
+    benchmark_register_write(16);
+    benchmark_register_write(REGISTER_MAX_BATCH);
+
+    benchmark_register_read(0);
+    benchmark_register_read(2);
+
+    benchmark_memory_write(1024);
+    benchmark_memory_write(4 * 1024);
+    benchmark_memory_write(MEMORY_MAX_WRITE);
+
+    test_memory_read();
+    test_register_coalesce();
+    test_load_discards_staged(&fpga_bin);
+
+    benchmark_buffer_count(2);
+    benchmark_buffer_count(CONFIG_FPGA_SPI_BUFFER_COUNT / 2);
+
+    fpga_comms_latency_print();
+    master_spi_lock_stats_print();
+
+#ifdef CONFIG_FPGA_COMMS_COMPLETION_REAPER
+    test_delete_in_flight();
+#endif
+
+    if (failures != 0) {
+        ESP_LOGE(TAG, "%i checks failed", failures);
+        return 1;
+    }
+
+    ESP_LOGI(TAG, "PASS");
+    return 0;
+}
@@ -0,0 +1,68 @@
+#include "cm2_model.h"
+#include "Vtop.h"
+#include "Vtop__Dpi.h"
+#include <cstring>
+#include <memory>
+#include <svdpi.h>
+#include <verilated.h>
+
+static std::unique_ptr<VerilatedContext> context;
+static std::unique_ptr<Vtop> top;
+static cm2_model_ram_write_cb_t ram_write_cb = nullptr;
+
+// Called by SB_RAM40_4K in ice40_cells.v. The bank is told apart by the
+// instance name, matrix_1_* or matrix_2_*.
+void cm2_model_ram_write(int address, int data)
+{
+    const char* scope = svGetNameFromScope(svGetScope());
+    const int bank = (std::strstr(scope, "matrix_2") != nullptr) ? 1 : 0;
+
+    if (ram_write_cb != nullptr)
+        ram_write_cb(bank, address, data, context->time());
+}
+
+void cm2_model_init(cm2_model_ram_write_cb_t callback)
+{
+    ram_write_cb = callback;
+
+    context = std::make_unique<VerilatedContext>();
+    top = std::make_unique<Vtop>(context.get());
+
+    top->FSPI_CS = 1;
+    top->FSPI_CLK = 1;
+    top->FSPI_MOSI = 0;
+    top->SW_1 = 0;
+    top->SW_2 = 0;
+    top->SW_T = 0;
+    top->eval();
+}
+
+void cm2_model_spi_set(bool cs, bool sck, bool mosi)
+{
+    top->FSPI_CS = cs;
+    top->FSPI_CLK = sck;
+    top->FSPI_MOSI = mosi;
+    top->eval();
+}
+
+bool cm2_model_miso_get()
+{
+    return top->FSPI_MISO;
+}
+
+void cm2_model_advance(uint64_t duration_ps)
+{
+    const uint64_t end = context->time() + duration_ps;
+
+    while (top->eventsPending() && (top->nextTimeSlot() <= end)) {
+        context->time(top->nextTimeSlot());
+        top->eval();
+    }
+
+    context->time(end);
+}
+
+uint64_t cm2_model_time_get()
+{
+    return context->time();
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+//! @file cm2_model.h
+//! @brief Verilated model of the CM-2 gateware
+//!
+//! C interface to examples/cm2/fpga/top.v, built by Verilator with the
+//! primitives in ice40_cells.v. Times are in picoseconds. The model isn't
+//! thread safe; the caller serializes access to it.
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//! Called for each write to the LED RAM
+//!
+//! @param bank LED output (0 for output 1, 1 for output 2)
+//! @param address Word address in the bank
+//! @param data Data written
+//! @param time_ps Simulation time of the write
+typedef void (*cm2_model_ram_write_cb_t)(int bank, uint16_t address, uint16_t data, uint64_t time_ps);
+
+//! @brief Create the model, with CS high and SCK high (idle in SPI mode 3)
+//!
+//! @param ram_write_cb Function to call for each RAM write
+void cm2_model_init(cm2_model_ram_write_cb_t ram_write_cb);
+
+//! @brief Set the SPI inputs, and evaluate the model at the current time
+void cm2_model_spi_set(bool cs, bool sck, bool mosi);
+
+//! @brief Get the SPI output
+bool cm2_model_miso_get();
+
+//! @brief Run the model forward
+void cm2_model_advance(uint64_t duration_ps);
+
+//! @brief Get the simulation time
+uint64_t cm2_model_time_get();
+
+#ifdef __cplusplus
+}
+#endif
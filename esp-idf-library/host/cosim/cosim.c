@@ -0,0 +1,272 @@
+//! @file cosim.c
+//! @brief Co-simulation of the FPGA driver and the CM-2 gateware
+//!
+//! Runs fpga_comms against the Verilated examples/cm2/fpga/top.v (see
+//! cosim_fpga.h), at each SCK frequency the ESP32 can make by dividing its
+//! 80 MHz APB clock, from 10 MHz up. Register writes, register reads and
+//! memory writes are each tried with random data and a random phase between
+//! SCK and the gateware clock. Results at each frequency are checked through
+//! a second device on the same model, which runs at the lowest frequency.
+//!
+//! The fastest frequency at which every transaction works is the limit for
+//! CONFIG_FPGA_SPI_FREQ_COMMS with this gateware. It is printed, and the exit
+//! status is non-zero if:
+//!
+//! * anything fails at or below the FSPI_CLK constraint in clocks.py, or
+//! * the frequency given with --require-mhz (the one the CM-2 example is
+//!   configured for) is above the limit.
+//!
+//! Usage:
+//!
+//!     cosim_cm2 [--quick] [--constraint-mhz N] [--require-mhz N]
+
+#include "cosim_fpga.h"
+#include "fpga_comms.h"
+#include "master_spi.h"
+#include <esp_log.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <inttypes.h>
+#include <soc/soc.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const char* TAG = "cosim";
+
+//! Shorter runs, for CI
+static bool quick = false;
+
+//! Number of failed checks
+static int failures = 0;
+
+#define CHECK(condition, ...)               \
+    do {                                    \
+        if (!(condition)) {                 \
+            ESP_LOGE(TAG, __VA_ARGS__);     \
+            failures++;                     \
+        }                                   \
+    } while (0)
+
+//! Slowest APB clock divider tried. The check device runs at this one too.
+#define DIVIDER_MAX 8
+
+//! Registers F0-F2 (the LED duty cycles) can be written and read back
+#define REGISTER_BASE_ADDRESS 0x00F0
+#define REGISTER_COUNT 3
+
+//! Words in each memory write
+#define MEMORY_WRITE_WORDS 16
+
+//! Most RAM write latency allowed for by spi.v, in system clock cycles
+#define RAM_WRITE_LATENCY_CYCLES_MAX 5
+
+typedef enum {
+    OP_REGISTER_WRITE,
+    OP_REGISTER_READ,
+    OP_MEMORY_WRITE,
+    OP_COUNT,
+} op_t;
+
+static const char* op_names[OP_COUNT] = {
+    "register write",
+    "register read",
+    "memory write",
+};
+
+//! Device at the lowest frequency, to set up and check the results
+static fpga_comms_handle_t check_comms;
+
+static fpga_comms_handle_t comms_create(int clock_speed_hz)
+{
+    fpga_comms_config_t config = FPGA_COMMS_CONFIG_DEFAULT();
+    config.clock_speed_hz = clock_speed_hz;
+    config.bulk_max_queued = 1;
+
+    fpga_comms_handle_t comms;
+    ESP_ERROR_CHECK(fpga_comms_create(&config, &comms));
+    return comms;
+}
+
+//! @brief Wait until every transaction queued on the device has been sent
+//!
+//! Transactions are sent in order, so once a register read returns, all
+//! previously queued writes have been sent.
+static void comms_drain(fpga_comms_handle_t comms)
+{
+    uint16_t value;
+    fpga_comms_device_register_read(comms, REGISTER_BASE_ADDRESS, &value);
+}
+
+static void registers_random(fpga_comms_register_t* registers)
+{
+    for (int i = 0; i < REGISTER_COUNT; i++) {
+        registers[i].address = REGISTER_BASE_ADDRESS + i;
+        registers[i].value = rand();
+    }
+}
+
+//! @brief Write the registers in one transaction, and read them back at the lowest frequency
+static bool register_write_try(fpga_comms_handle_t comms)
+{
+    fpga_comms_register_t registers[REGISTER_COUNT];
+    registers_random(registers);
+
+    if (fpga_comms_device_register_write_batch(comms, registers, REGISTER_COUNT) != ESP_OK)
+        return false;
+    comms_drain(comms);
+
+    for (int i = 0; i < REGISTER_COUNT; i++) {
+        uint16_t value;
+        if ((fpga_comms_device_register_read(check_comms, registers[i].address, &value) != ESP_OK)
+            || (value != registers[i].value))
+            return false;
+    }
+
+    return true;
+}
+
+//! @brief Write the registers at the lowest frequency, and read them back
+static bool register_read_try(fpga_comms_handle_t comms)
+{
+    fpga_comms_register_t registers[REGISTER_COUNT];
+    registers_random(registers);
+
+    if (fpga_comms_device_register_write_batch(check_comms, registers, REGISTER_COUNT) != ESP_OK)
+        return false;
+    comms_drain(check_comms);
+
+    for (int i = 0; i < REGISTER_COUNT; i++) {
+        uint16_t value;
+        if ((fpga_comms_device_register_read(comms, registers[i].address, &value) != ESP_OK)
+            || (value != registers[i].value))
+            return false;
+    }
+
+    return true;
+}
+
+//! @brief Write random words to a random place in the LED RAM, and check the RAM
+static bool memory_write_try(fpga_comms_handle_t comms)
+{
+    const int bank = rand() % 2;
+    const uint16_t offset = rand() % (COSIM_FPGA_BANK_WORDS - MEMORY_WRITE_WORDS + 1);
+
+    uint8_t buffer[MEMORY_WRITE_WORDS * 2];
+    for (size_t i = 0; i < sizeof(buffer); i++)
+        buffer[i] = rand();
+
+    // fpga_comms takes a byte address
+    const uint16_t word_address = (bank << 8) | offset;
+    if (fpga_comms_device_memory_write(comms, word_address * 2, buffer, sizeof(buffer), 10) != ESP_OK)
+        return false;
+    comms_drain(comms);
+
+    for (int word = 0; word < MEMORY_WRITE_WORDS; word++) {
+        const uint16_t expected = (buffer[word * 2] << 8) | buffer[word * 2 + 1];
+        if (cosim_fpga_memory_get(bank, offset + word) != expected)
+            return false;
+    }
+
+    return true;
+}
+
+//! @brief Try every operation at one SCK frequency
+//!
+//! @return true if they all worked every time
+static bool frequency_test(int divider, int constraint_hz)
+{
+    const int clock_hz = spi_get_actual_clock(APB_CLK_FREQ, APB_CLK_FREQ / divider, 0);
+    const int trials = quick ? 32 : 1024;
+
+    fpga_comms_handle_t comms = comms_create(clock_hz);
+    cosim_fpga_stats_reset();
+
+    int op_failures[OP_COUNT] = {};
+    for (int trial = 0; trial < trials; trial++) {
+        op_failures[OP_REGISTER_WRITE] += register_write_try(comms) ? 0 : 1;
+        op_failures[OP_REGISTER_READ] += register_read_try(comms) ? 0 : 1;
+        op_failures[OP_MEMORY_WRITE] += memory_write_try(comms) ? 0 : 1;
+    }
+
+    // The SPI driver finishes with the last transaction just after reporting
+    // that it is done
+    vTaskDelay(1);
+    ESP_ERROR_CHECK(fpga_comms_delete(comms));
+
+    cosim_fpga_stats_t stats;
+    cosim_fpga_stats_get(&stats);
+
+    const uint32_t latency_cycles = (stats.ram_write_latency_ps_max + COSIM_FPGA_SYSTEM_CLOCK_PS - 1)
+        / COSIM_FPGA_SYSTEM_CLOCK_PS;
+    const bool latency_ok = (latency_cycles <= RAM_WRITE_LATENCY_CYCLES_MAX) && (stats.ram_writes_missing == 0);
+
+    bool passed = latency_ok;
+    for (op_t op = 0; op < OP_COUNT; op++) {
+        ESP_LOGI(TAG, "%5.1f MHz %-14s failures:%i/%i",
+            clock_hz / 1e6, op_names[op], op_failures[op], trials);
+        passed = passed && (op_failures[op] == 0);
+    }
+
+    ESP_LOGI(TAG, "%5.1f MHz RAM write latency max:%" PRIu32 " cycles, missing writes:%" PRIu32,
+        clock_hz / 1e6,
+        latency_cycles,
+        stats.ram_writes_missing);
+
+    CHECK(passed || (clock_hz > constraint_hz),
+        "%.1f MHz: failures at or below the %.1f MHz FSPI_CLK constraint",
+        clock_hz / 1e6, constraint_hz / 1e6);
+
+    return passed;
+}
+
+int main(int argc, char** argv)
+{
+    int constraint_mhz = 20;
+    int require_mhz = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--quick") == 0)
+            quick = true;
+        else if ((strcmp(argv[i], "--constraint-mhz") == 0) && (i + 1 < argc))
+            constraint_mhz = atoi(argv[++i]);
+        else if ((strcmp(argv[i], "--require-mhz") == 0) && (i + 1 < argc))
+            require_mhz = atoi(argv[++i]);
+        else {
+            fprintf(stderr, "Usage: %s [--quick] [--constraint-mhz N] [--require-mhz N]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    srand(1);
+    cosim_fpga_init();
+
+    ESP_ERROR_CHECK(master_spi_init());
+    check_comms = comms_create(APB_CLK_FREQ / DIVIDER_MAX);
+
+    // Fastest frequency at which everything worked, along with every slower one
+    int limit_hz = 0;
+    for (int divider = DIVIDER_MAX; divider >= 1; divider--) {
+        if (!frequency_test(divider, constraint_mhz * 1000000))
+            break;
+
+        limit_hz = spi_get_actual_clock(APB_CLK_FREQ, APB_CLK_FREQ / divider, 0);
+    }
+
+    ESP_LOGI(TAG, "fastest working SCK: %.1f MHz (FSPI_CLK constraint: %i MHz)", limit_hz / 1e6, constraint_mhz);
+
+    if (require_mhz > 0) {
+        const int require_hz = spi_get_actual_clock(APB_CLK_FREQ, require_mhz * 1000000, 0);
+        CHECK(require_hz <= limit_hz, "%i MHz (%.1f MHz on the wire) is above the fastest working SCK",
+            require_mhz, require_hz / 1e6);
+    }
+
+    vTaskDelay(1);
+    ESP_ERROR_CHECK(fpga_comms_delete(check_comms));
+
+    if (failures > 0) {
+        ESP_LOGE(TAG, "%i checks failed", failures);
+        return 1;
+    }
+
+    return 0;
+}
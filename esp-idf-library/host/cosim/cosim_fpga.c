@@ -0,0 +1,141 @@
+#include "cosim_fpga.h"
+#include "cm2_model.h"
+#include <driver/spi_master.h>
+#include <pthread.h>
+#include <soc/soc.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define COMMAND_WRITE_MEM 0b00000001
+
+//! Time CS is held high between transactions, in ps. The ESP32 leaves at
+//! least this long between queued transactions.
+#define CS_HIGH_PS 1000000
+
+//! Most memory words that can be waiting for their RAM write
+#define PENDING_WORDS_MAX 64
+
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static uint16_t memory[2][COSIM_FPGA_BANK_WORDS];
+static cosim_fpga_stats_t stats;
+
+// Times at which memory words were clocked in, waiting for their RAM write
+static uint64_t pending_words[PENDING_WORDS_MAX];
+static int pending_word_count = 0;
+
+static void ram_write(int bank, uint16_t address, uint16_t data, uint64_t time_ps)
+{
+    memory[bank][address % COSIM_FPGA_BANK_WORDS] = data;
+
+    if (pending_word_count == 0)
+        return;
+
+    const uint64_t latency = time_ps - pending_words[0];
+    if (latency > stats.ram_write_latency_ps_max)
+        stats.ram_write_latency_ps_max = latency;
+
+    pending_word_count--;
+    memmove(&pending_words[0], &pending_words[1], pending_word_count * sizeof(pending_words[0]));
+}
+
+//! @brief Clock one bit, in SPI mode 3
+//!
+//! MOSI changes on the falling edge of SCK, and both ends sample on the rising
+//! edge.
+//!
+//! @return The MISO level sampled on the rising edge
+static bool bit_clock(bool mosi, uint64_t half_period_ps)
+{
+    cm2_model_spi_set(false, false, mosi);
+    cm2_model_advance(half_period_ps);
+
+    const bool miso = cm2_model_miso_get();
+    cm2_model_spi_set(false, true, mosi);
+    cm2_model_advance(half_period_ps);
+
+    return miso;
+}
+
+static void bits_send(uint32_t value, int bits, uint64_t half_period_ps)
+{
+    for (int bit = bits - 1; bit >= 0; bit--)
+        bit_clock((value >> bit) & 1, half_period_ps);
+}
+
+static void transfer(const spi_device_interface_config_t* config, spi_transaction_t* trans)
+{
+    // The programming device drives CS as a GPIO
+    if (config->spics_io_num < 0)
+        return;
+
+    const int clock_hz = spi_get_actual_clock(APB_CLK_FREQ, config->clock_speed_hz, config->duty_cycle_pos);
+    const uint64_t half_period_ps = 500000000000ULL / clock_hz;
+
+    const uint8_t* tx = (trans->flags & SPI_TRANS_USE_TXDATA) ? trans->tx_data : trans->tx_buffer;
+    uint8_t* rx = (trans->flags & SPI_TRANS_USE_RXDATA) ? trans->rx_data : trans->rx_buffer;
+    const bool memory_write = ((trans->cmd & 0b11) == COMMAND_WRITE_MEM);
+
+    pthread_mutex_lock(&mutex);
+
+    stats.ram_writes_missing += pending_word_count;
+    pending_word_count = 0;
+
+    cm2_model_spi_set(false, true, false);
+    cm2_model_advance(2 * half_period_ps * config->cs_ena_pretrans);
+
+    bits_send(trans->cmd, config->command_bits, half_period_ps);
+    bits_send(trans->addr, config->address_bits, half_period_ps);
+
+    for (size_t bit = 0; bit < trans->length; bit++) {
+        // The word is complete at the rising edge, half a period from now
+        if (memory_write && ((bit % 16) == 15) && (pending_word_count < PENDING_WORDS_MAX))
+            pending_words[pending_word_count++] = cm2_model_time_get() + half_period_ps;
+
+        bit_clock((tx[bit / 8] >> (7 - (bit % 8))) & 1, half_period_ps);
+    }
+
+    if (trans->rxlength > 0)
+        memset(rx, 0, (trans->rxlength + 7) / 8);
+
+    for (size_t bit = 0; bit < trans->rxlength; bit++) {
+        if (bit_clock(false, half_period_ps))
+            rx[bit / 8] |= 0x80 >> (bit % 8);
+    }
+
+    cm2_model_spi_set(true, true, false);
+
+    // Start the next transaction at a random phase of the system clock
+    cm2_model_advance(CS_HIGH_PS + (rand() % COSIM_FPGA_SYSTEM_CLOCK_PS));
+
+    pthread_mutex_unlock(&mutex);
+}
+
+void cosim_fpga_init()
+{
+    cm2_model_init(ram_write);
+    spi_mock_transfer_cb_set(transfer);
+}
+
+uint16_t cosim_fpga_memory_get(int bank, uint16_t word_address)
+{
+    pthread_mutex_lock(&mutex);
+    const uint16_t data = memory[bank][word_address % COSIM_FPGA_BANK_WORDS];
+    pthread_mutex_unlock(&mutex);
+
+    return data;
+}
+
+void cosim_fpga_stats_get(cosim_fpga_stats_t* stats_out)
+{
+    pthread_mutex_lock(&mutex);
+    *stats_out = stats;
+    pthread_mutex_unlock(&mutex);
+}
+
+void cosim_fpga_stats_reset()
+{
+    pthread_mutex_lock(&mutex);
+    memset(&stats, 0, sizeof(stats));
+    pthread_mutex_unlock(&mutex);
+}
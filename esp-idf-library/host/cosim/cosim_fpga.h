@@ -0,0 +1,35 @@
+#pragma once
+
+//! @file cosim_fpga.h
+//! @brief SPI master model, driving the Verilated CM-2 gateware
+//!
+//! Takes the place of mock_fpga.c: each transaction sent on the comms device
+//! is clocked into cm2_model.h one SCK edge at a time, in SPI mode 3, at the
+//! clock the ESP32 would make for the device. Transfers on the programming
+//! device are ignored, as the model starts configured.
+
+#include <stdint.h>
+
+//! Number of 16-bit words in each LED RAM bank
+#define COSIM_FPGA_BANK_WORDS 256
+
+//! Gateware system clock period, in ps (24 MHz)
+#define COSIM_FPGA_SYSTEM_CLOCK_PS 41667
+
+//! Statistics since the last reset
+typedef struct {
+    uint32_t ram_write_latency_ps_max; //!< Longest time from the SCK edge that completes a memory word to its RAM write
+    uint32_t ram_writes_missing; //!< Memory words clocked in that never reached the RAM
+} cosim_fpga_stats_t;
+
+//! @brief Create the model, and connect it to the SPI shim
+void cosim_fpga_init();
+
+//! @brief Get a word of an LED RAM bank, as last written by the gateware
+uint16_t cosim_fpga_memory_get(int bank, uint16_t word_address);
+
+//! @brief Get the statistics since the last reset
+void cosim_fpga_stats_get(cosim_fpga_stats_t* stats);
+
+//! @brief Reset the statistics
+void cosim_fpga_stats_reset();
@@ -0,0 +1,99 @@
+`timescale 1ps/1ps
+
+// Models of the iCE40 primitives used by examples/cm2/fpga/top.v, for
+// Verilator. The yosys cells_sim.v models don't verilate, and only the
+// behaviour the gateware relies on is modelled here.
+
+// Internal oscillator. Runs from time 0; the power-up and enable inputs are
+// ignored.
+module SB_HFOSC #(
+    parameter CLKHF_DIV = "0b00",
+    parameter TRIM_EN = "0b0"
+) (
+    input CLKHFPU,
+    input CLKHFEN,
+    input CLKHF_FABRIC,
+    input TRIM0, TRIM1, TRIM2, TRIM3, TRIM4, TRIM5, TRIM6, TRIM7, TRIM8, TRIM9,
+    output reg CLKHF
+);
+
+    // Half of the period, in ps: 48, 24, 12 or 6 MHz
+    localparam integer HALF_PERIOD =
+        (CLKHF_DIV == "0b00") ? 10417 :
+        (CLKHF_DIV == "0b01") ? 20833 :
+        (CLKHF_DIV == "0b10") ? 41667 :
+                                83333;
+
+    initial CLKHF = 1'b0;
+
+    always #(HALF_PERIOD) CLKHF = ~CLKHF;
+
+endmodule
+
+// 256x16 block RAM (read and write mode 0). Each write is reported to the
+// harness, with the time it happens.
+module SB_RAM40_4K #(
+    parameter WRITE_MODE = 0,
+    parameter READ_MODE = 0
+) (
+    output reg [15:0] RDATA,
+    input [10:0] RADDR,
+    input RCLK,
+    input RCLKE,
+    input RE,
+    input [10:0] WADDR,
+    input WCLK,
+    input WCLKE,
+    input [15:0] WDATA,
+    input WE,
+    input [15:0] MASK
+);
+
+    import "DPI-C" context function void cm2_model_ram_write(input int address, input int data);
+
+    reg [15:0] memory [0:255];
+
+    integer i;
+    initial begin
+        for (i = 0; i < 256; i = i + 1)
+            memory[i] = 16'd0;
+        RDATA = 16'd0;
+    end
+
+    always @(posedge WCLK) begin
+        if (WCLKE && WE) begin
+            memory[WADDR[7:0]] <= (memory[WADDR[7:0]] & MASK) | (WDATA & ~MASK);
+            cm2_model_ram_write({24'd0, WADDR[7:0]}, {16'd0, WDATA & ~MASK});
+        end
+    end
+
+    always @(posedge RCLK) begin
+        if (RCLKE && RE)
+            RDATA <= memory[RADDR[7:0]];
+    end
+
+endmodule
+
+// RGB LED driver, without the current limits
+module SB_RGBA_DRV #(
+    parameter CURRENT_MODE = "0b0",
+    parameter RGB0_CURRENT = "0b000000",
+    parameter RGB1_CURRENT = "0b000000",
+    parameter RGB2_CURRENT = "0b000000"
+) (
+    input CURREN,
+    input RGBLEDEN,
+    input RGB0PWM,
+    input RGB1PWM,
+    input RGB2PWM,
+    output RGB0,
+    output RGB1,
+    output RGB2
+);
+
+    // The outputs sink current, so they are low when the LED is on
+    assign RGB0 = !(CURREN && RGBLEDEN && RGB0PWM);
+    assign RGB1 = !(CURREN && RGBLEDEN && RGB1PWM);
+    assign RGB2 = !(CURREN && RGBLEDEN && RGB2PWM);
+
+endmodule
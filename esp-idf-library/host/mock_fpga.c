@@ -0,0 +1,205 @@
+#include "mock_fpga.h"
+#include <driver/gpio.h>
+#include <driver/spi_master.h>
+#include <pthread.h>
+#include <sdkconfig.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define COMMAND_READ_MEM 0b00000000
+#define COMMAND_WRITE_MEM 0b00000001
+#define COMMAND_READ_REG 0b00000010
+#define COMMAND_WRITE_REG 0b00000011
+
+//! Number of bits between the address and the read data
+#define READ_TURNAROUND_BITS 8
+
+typedef enum {
+    CONFIG_STATE_RESET, //!< CRESET low
+    CONFIG_STATE_LOADING, //!< Receiving a bitstream
+    CONFIG_STATE_DONE, //!< Configured, CDONE high
+} config_state_t;
+
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static uint16_t registers[0x10000];
+static uint16_t memory[MOCK_FPGA_MEMORY_WORDS];
+
+static config_state_t config_state = CONFIG_STATE_RESET;
+static uint8_t* bitstream = NULL;
+static size_t bitstream_length = 0;
+static size_t bitstream_capacity = 0;
+
+static mock_fpga_stats_t stats;
+
+static void bitstream_append(const uint8_t* data, size_t length)
+{
+    if (bitstream_length + length > bitstream_capacity) {
+        bitstream_capacity = (bitstream_length + length) * 2;
+        bitstream = realloc(bitstream, bitstream_capacity);
+    }
+
+    memcpy(bitstream + bitstream_length, data, length);
+    bitstream_length += length;
+}
+
+//! @brief Handle a transfer on the programming device, which drives CS as a GPIO
+static void config_transfer(const spi_transaction_t* trans)
+{
+    if (config_state != CONFIG_STATE_LOADING)
+        return;
+
+    if (gpio_get_level(CONFIG_FPGA_CS_GPIO) == 0) {
+        bitstream_append(trans->tx_buffer, trans->length / 8);
+        return;
+    }
+
+    // Clocks with CS high before the image are ignored, and after it
+    // finish the configuration. The gateware starts from its initial state.
+    if (bitstream_length == 0)
+        return;
+
+    config_state = CONFIG_STATE_DONE;
+    memset(registers, 0, sizeof(registers));
+    memset(memory, 0, sizeof(memory));
+
+    gpio_mock_input_set(CONFIG_FPGA_CDONE_GPIO, 1);
+}
+
+static const uint8_t* tx_bytes(const spi_transaction_t* trans)
+{
+    return (trans->flags & SPI_TRANS_USE_TXDATA) ? trans->tx_data : trans->tx_buffer;
+}
+
+static uint8_t* rx_bytes(spi_transaction_t* trans)
+{
+    return (trans->flags & SPI_TRANS_USE_RXDATA) ? trans->rx_data : trans->rx_buffer;
+}
+
+//! @brief Send words from the register file or memory, after the turnaround bits
+static void read_data(spi_transaction_t* trans, const uint16_t* source, uint16_t address)
+{
+    uint8_t* rx = rx_bytes(trans);
+    const size_t length = trans->rxlength / 8;
+
+    for (size_t index = 0; index < length; index++) {
+        if (index < READ_TURNAROUND_BITS / 8) {
+            rx[index] = 0;
+            continue;
+        }
+
+        const size_t byte = index - READ_TURNAROUND_BITS / 8;
+        const uint16_t word = source[(uint16_t)(address + byte / 2)];
+        rx[index] = (byte & 1) ? (word & 0xFF) : (word >> 8);
+    }
+}
+
+//! @brief Handle a transfer on the communications device
+static void comms_transfer(spi_transaction_t* trans)
+{
+    const uint16_t address = trans->addr;
+    const uint8_t* tx = tx_bytes(trans);
+    const size_t words = trans->length / 16;
+
+    switch (trans->cmd) {
+    case COMMAND_WRITE_REG:
+        for (size_t word = 0; word < words; word++)
+            registers[(uint16_t)(address + word)] = (tx[word * 2] << 8) | tx[word * 2 + 1];
+        stats.register_writes++;
+        stats.register_write_words += words;
+        break;
+
+    case COMMAND_WRITE_MEM:
+        for (size_t word = 0; word < words; word++)
+            memory[(uint16_t)(address + word)] = (tx[word * 2] << 8) | tx[word * 2 + 1];
+        stats.memory_writes++;
+        break;
+
+    case COMMAND_READ_REG:
+        read_data(trans, registers, address);
+        stats.register_reads++;
+        break;
+
+    case COMMAND_READ_MEM:
+        read_data(trans, memory, address);
+        stats.memory_reads++;
+        break;
+    }
+}
+
+static void transfer(const spi_device_interface_config_t* config, spi_transaction_t* trans)
+{
+    pthread_mutex_lock(&mutex);
+
+    if (config->spics_io_num < 0)
+        config_transfer(trans);
+    else if (config_state == CONFIG_STATE_DONE)
+        comms_transfer(trans);
+
+    pthread_mutex_unlock(&mutex);
+}
+
+static void output_changed(gpio_num_t gpio_num, uint32_t level)
+{
+    if (gpio_num != CONFIG_FPGA_CRESET_GPIO)
+        return;
+
+    pthread_mutex_lock(&mutex);
+
+    if (level == 0) {
+        config_state = CONFIG_STATE_RESET;
+        gpio_mock_input_set(CONFIG_FPGA_CDONE_GPIO, 0);
+    } else if (config_state == CONFIG_STATE_RESET) {
+        config_state = CONFIG_STATE_LOADING;
+        bitstream_length = 0;
+    }
+
+    pthread_mutex_unlock(&mutex);
+}
+
+void mock_fpga_init()
+{
+    spi_mock_transfer_cb_set(transfer);
+    gpio_mock_output_cb_set(output_changed);
+}
+
+uint16_t mock_fpga_register_get(uint16_t address)
+{
+    pthread_mutex_lock(&mutex);
+    const uint16_t value = registers[address];
+    pthread_mutex_unlock(&mutex);
+
+    return value;
+}
+
+uint16_t mock_fpga_memory_get(uint16_t word_address)
+{
+    pthread_mutex_lock(&mutex);
+    const uint16_t value = memory[word_address];
+    pthread_mutex_unlock(&mutex);
+
+    return value;
+}
+
+const uint8_t* mock_fpga_bitstream_get(size_t* length)
+{
+    pthread_mutex_lock(&mutex);
+    *length = bitstream_length;
+    pthread_mutex_unlock(&mutex);
+
+    return bitstream;
+}
+
+void mock_fpga_stats_get(mock_fpga_stats_t* out)
+{
+    pthread_mutex_lock(&mutex);
+    *out = stats;
+    pthread_mutex_unlock(&mutex);
+}
+
+void mock_fpga_stats_reset()
+{
+    pthread_mutex_lock(&mutex);
+    memset(&stats, 0, sizeof(stats));
+    pthread_mutex_unlock(&mutex);
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+//! @file mock_fpga.h
+//! @brief Model of the CM-2 gateware, for the host build
+//!
+//! Decodes the transactions sent by fpga_comms the same way as
+//! examples/cm2/fpga/spi.v, into a register file and a word-addressed memory.
+//! Bitstream loads are modelled too: the image sent by fpga_loader is
+//! recorded, and CDONE goes high once it is followed by clocks with CS high.
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+//! Number of 16-bit memory words
+#define MOCK_FPGA_MEMORY_WORDS 0x10000
+
+//! @brief Connect the model to the SPI and GPIO shims
+void mock_fpga_init();
+
+//! @brief Get the value of a register
+uint16_t mock_fpga_register_get(uint16_t address);
+
+//! @brief Get a memory word
+uint16_t mock_fpga_memory_get(uint16_t word_address);
+
+//! @brief Get the bitstream received by the last load
+//!
+//! \param[out] length Length of the bitstream, in bytes
+//! \return The bitstream. Valid until the next load starts.
+const uint8_t* mock_fpga_bitstream_get(size_t* length);
+
+//! Number of transactions decoded, by type
+typedef struct {
+    uint32_t register_writes; //!< Register write transactions
+    uint32_t register_write_words; //!< Registers written
+    uint32_t register_reads;
+    uint32_t memory_writes;
+    uint32_t memory_reads;
+} mock_fpga_stats_t;
+
+//! @brief Get the number of transactions decoded since the last reset
+void mock_fpga_stats_get(mock_fpga_stats_t* stats);
+
+//! @brief Reset the transaction counters
+void mock_fpga_stats_reset();
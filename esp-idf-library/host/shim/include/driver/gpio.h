@@ -0,0 +1,68 @@
+#pragma once
+
+// Host shim: GPIO levels are kept in memory. Inputs are driven by the FPGA
+// model with gpio_mock_input_set(), which also runs any interrupt handler.
+
+#include "esp_err.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+#define GPIO_NUM_MAX 48
+
+typedef int gpio_num_t;
+
+typedef enum {
+    GPIO_MODE_DISABLE,
+    GPIO_MODE_INPUT,
+    GPIO_MODE_OUTPUT,
+} gpio_mode_t;
+
+typedef enum {
+    GPIO_PULLUP_DISABLE,
+    GPIO_PULLUP_ENABLE,
+} gpio_pullup_t;
+
+typedef enum {
+    GPIO_PULLDOWN_DISABLE,
+    GPIO_PULLDOWN_ENABLE,
+} gpio_pulldown_t;
+
+typedef enum {
+    GPIO_INTR_DISABLE,
+    GPIO_INTR_POSEDGE,
+    GPIO_INTR_NEGEDGE,
+    GPIO_INTR_ANYEDGE,
+} gpio_int_type_t;
+
+typedef struct {
+    uint64_t pin_bit_mask;
+    gpio_mode_t mode;
+    gpio_pullup_t pull_up_en;
+    gpio_pulldown_t pull_down_en;
+    gpio_int_type_t intr_type;
+} gpio_config_t;
+
+typedef void (*gpio_isr_t)(void* arg);
+
+esp_err_t gpio_config(const gpio_config_t* config);
+esp_err_t gpio_set_level(gpio_num_t gpio_num, uint32_t level);
+int gpio_get_level(gpio_num_t gpio_num);
+
+esp_err_t gpio_set_intr_type(gpio_num_t gpio_num, gpio_int_type_t intr_type);
+esp_err_t gpio_intr_enable(gpio_num_t gpio_num);
+esp_err_t gpio_intr_disable(gpio_num_t gpio_num);
+esp_err_t gpio_install_isr_service(int intr_alloc_flags);
+esp_err_t gpio_isr_handler_add(gpio_num_t gpio_num, gpio_isr_t isr_handler, void* args);
+
+void gpio_matrix_out(uint32_t gpio, uint32_t signal_idx, bool out_inv, bool oen_inv);
+
+// Shim control ///////////////////////////////////////////////////////////////
+
+//! Called whenever an output level is set, with the new level
+typedef void (*gpio_mock_output_cb_t)(gpio_num_t gpio_num, uint32_t level);
+
+//! @brief Set the function to call when an output level is set
+void gpio_mock_output_cb_set(gpio_mock_output_cb_t callback);
+
+//! @brief Drive an input pin, running its interrupt handler on a matching edge
+void gpio_mock_input_set(gpio_num_t gpio_num, uint32_t level);
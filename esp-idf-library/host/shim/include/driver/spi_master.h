@@ -0,0 +1,115 @@
+#pragma once
+
+// Host shim: the ESP-IDF SPI master driver, including the SPI_DEVICE_DISCARD_AFTER_POST
+// flag from the patches in idf-patch/
+//
+// Queued transactions are sent by a background thread, which stands in for
+// the SPI interrupt. It calls pre_cb and post_cb the same way, and hands the
+// transaction to a transfer callback (the FPGA model) instead of a real bus.
+
+#include "esp_heap_caps.h"
+#include "freertos/FreeRTOS.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef enum {
+    SPI1_HOST = 0,
+    SPI2_HOST = 1,
+    SPI3_HOST = 2,
+} spi_host_device_t;
+
+#define FSPI_HOST SPI2_HOST
+
+#define SPI_DMA_CH_AUTO 3
+
+#define SPICOMMON_BUSFLAG_MASTER (1 << 0)
+#define SPICOMMON_BUSFLAG_IOMUX_PINS (1 << 1)
+#define SPICOMMON_BUSFLAG_GPIO_PINS (1 << 2)
+#define SPICOMMON_BUSFLAG_QUAD (1 << 5)
+
+typedef struct {
+    int mosi_io_num;
+    int miso_io_num;
+    int sclk_io_num;
+    int quadwp_io_num;
+    int quadhd_io_num;
+    int max_transfer_sz;
+    uint32_t flags;
+} spi_bus_config_t;
+
+#define SPI_DEVICE_HALFDUPLEX (1 << 4)
+#define SPI_DEVICE_DISCARD_AFTER_POST (1 << 8)
+
+#define SPI_TRANS_MODE_DIO (1 << 0)
+#define SPI_TRANS_MODE_QIO (1 << 1)
+#define SPI_TRANS_USE_RXDATA (1 << 2)
+#define SPI_TRANS_USE_TXDATA (1 << 3)
+
+typedef struct spi_transaction_t spi_transaction_t;
+typedef void (*transaction_cb_t)(spi_transaction_t* trans);
+
+typedef struct {
+    uint8_t command_bits;
+    uint8_t address_bits;
+    uint8_t dummy_bits;
+    uint8_t mode;
+    uint16_t duty_cycle_pos;
+    uint16_t cs_ena_pretrans;
+    uint8_t cs_ena_posttrans;
+    int clock_speed_hz;
+    int input_delay_ns;
+    int spics_io_num;
+    uint32_t flags;
+    int queue_size;
+    transaction_cb_t pre_cb;
+    transaction_cb_t post_cb;
+} spi_device_interface_config_t;
+
+struct spi_transaction_t {
+    uint32_t flags;
+    uint16_t cmd;
+    uint64_t addr;
+    size_t length;
+    size_t rxlength;
+    void* user;
+    union {
+        const void* tx_buffer;
+        uint8_t tx_data[4];
+    };
+    union {
+        void* rx_buffer;
+        uint8_t rx_data[4];
+    };
+};
+
+typedef struct spi_device_t* spi_device_handle_t;
+
+esp_err_t spi_bus_initialize(spi_host_device_t host, const spi_bus_config_t* bus_config, int dma_chan);
+esp_err_t spi_bus_add_device(spi_host_device_t host, const spi_device_interface_config_t* dev_config, spi_device_handle_t* handle);
+esp_err_t spi_bus_remove_device(spi_device_handle_t handle);
+
+esp_err_t spi_device_queue_trans(spi_device_handle_t handle, spi_transaction_t* trans_desc, TickType_t ticks_to_wait);
+esp_err_t spi_device_get_trans_result(spi_device_handle_t handle, spi_transaction_t** trans_desc, TickType_t ticks_to_wait);
+esp_err_t spi_device_transmit(spi_device_handle_t handle, spi_transaction_t* trans_desc);
+esp_err_t spi_device_polling_transmit(spi_device_handle_t handle, spi_transaction_t* trans_desc);
+
+esp_err_t spi_device_acquire_bus(spi_device_handle_t device, TickType_t wait);
+void spi_device_release_bus(spi_device_handle_t dev);
+
+int spi_get_actual_clock(int fapb, int hz, int duty_cycle);
+
+// Shim control ///////////////////////////////////////////////////////////////
+
+//! Called for each transaction as it is "sent", to fill in any receive data
+typedef void (*spi_mock_transfer_cb_t)(const spi_device_interface_config_t* config, spi_transaction_t* trans);
+
+//! @brief Set the function that handles transfers on the bus
+void spi_mock_transfer_cb_set(spi_mock_transfer_cb_t callback);
+
+//! @brief Model the time each transfer takes on the wire
+//!
+//! If enabled, each transfer takes as long as its bits would at the device's
+//! clock speed. Otherwise transfers complete as quickly as the threads allow,
+//! which measures only the driver overhead.
+void spi_mock_wire_time_set(bool enable);
@@ -0,0 +1,6 @@
+#pragma once
+
+// Host shim: memory placement attributes have no effect
+
+#define IRAM_ATTR
+#define DRAM_ATTR
@@ -0,0 +1,6 @@
+#pragma once
+
+#include <stdint.h>
+
+//! @brief Busy-wait for a number of microseconds
+void esp_rom_delay_us(uint32_t us);
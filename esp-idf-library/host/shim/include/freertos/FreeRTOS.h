@@ -0,0 +1,65 @@
+#pragma once
+
+// Host shim: the parts of FreeRTOS used by the library, on top of pthreads
+//
+// Ticks are milliseconds. Critical sections are mutexes, so they exclude
+// other threads, but unlike on the ESP32 they don't stop the shim's SPI
+// "interrupt" thread from being scheduled while they are held.
+
+#include "esp_attr.h"
+#include "esp_err.h"
+#include "esp_heap_caps.h"
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+typedef int BaseType_t;
+typedef unsigned int UBaseType_t;
+typedef uint32_t TickType_t;
+
+#define pdTRUE ((BaseType_t)1)
+#define pdFALSE ((BaseType_t)0)
+#define pdPASS pdTRUE
+#define pdFAIL pdFALSE
+
+#define portMAX_DELAY ((TickType_t)0xFFFFFFFF)
+
+#define configTICK_RATE_HZ 1000
+#define configMAX_TASK_NAME_LEN 16
+
+#define portTICK_PERIOD_MS ((TickType_t)1000 / configTICK_RATE_HZ)
+#define pdMS_TO_TICKS(ms) ((TickType_t)(((uint64_t)(ms) * configTICK_RATE_HZ) / 1000))
+
+typedef struct {
+    pthread_mutex_t mutex;
+} portMUX_TYPE;
+
+#define portMUX_INITIALIZER_UNLOCKED { PTHREAD_MUTEX_INITIALIZER }
+#define portMUX_INITIALIZE(mux) pthread_mutex_init(&(mux)->mutex, NULL)
+
+#define portENTER_CRITICAL(mux) pthread_mutex_lock(&(mux)->mutex)
+#define portEXIT_CRITICAL(mux) pthread_mutex_unlock(&(mux)->mutex)
+#define portENTER_CRITICAL_ISR(mux) portENTER_CRITICAL(mux)
+#define portEXIT_CRITICAL_ISR(mux) portEXIT_CRITICAL(mux)
+#define portENTER_CRITICAL_SAFE(mux) portENTER_CRITICAL(mux)
+#define portEXIT_CRITICAL_SAFE(mux) portEXIT_CRITICAL(mux)
+
+#define portYIELD_FROM_ISR() \
+    do {                     \
+    } while (0)
+
+//! @brief Check if the caller is running as an interrupt handler
+//!
+//! True while the shim runs SPI or GPIO callbacks, which stand in for the
+//! ESP32 interrupts.
+BaseType_t xPortInIsrContext(void);
+
+//! Semaphore state, also used for the static semaphore buffers
+typedef struct shim_semaphore_t {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    UBaseType_t count;
+    UBaseType_t max_count;
+    bool allocated; //!< True if created on the heap, and freed by vSemaphoreDelete()
+} StaticSemaphore_t;
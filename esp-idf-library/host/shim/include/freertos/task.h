@@ -0,0 +1,20 @@
+#pragma once
+
+#include "freertos/FreeRTOS.h"
+
+typedef struct shim_task_t* TaskHandle_t;
+typedef void (*TaskFunction_t)(void* param);
+
+//! Tasks are threads. The stack size and priority are ignored.
+BaseType_t xTaskCreate(TaskFunction_t function, const char* name, uint32_t stack_depth,
+    void* param, UBaseType_t priority, TaskHandle_t* handle);
+
+//! Deleting another task cancels its thread, which must be blocked in the shim
+void vTaskDelete(TaskHandle_t task);
+
+//! Only the calling task can be suspended. It stays blocked until deleted.
+void vTaskSuspend(TaskHandle_t task);
+
+void vTaskDelay(TickType_t ticks);
+TaskHandle_t xTaskGetCurrentTaskHandle(void);
+char* pcTaskGetName(TaskHandle_t task);
@@ -0,0 +1,8 @@
+#pragma once
+
+// Host shim: newlib functions that older glibc versions lack. Included on
+// the compiler command line, see CMakeLists.txt.
+
+#include <stddef.h>
+
+size_t strlcpy(char* dst, const char* src, size_t size);
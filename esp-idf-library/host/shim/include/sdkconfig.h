@@ -0,0 +1,50 @@
+#pragma once
+
+// Host build configuration
+//
+// The defaults from the library Kconfig. Any of these can be overridden on
+// the compiler command line, see host/CMakeLists.txt.
+
+#ifndef CONFIG_FPGA_SPI_BUFFER_COUNT
+#define CONFIG_FPGA_SPI_BUFFER_COUNT 8
+#endif
+
+#ifndef CONFIG_FPGA_SPI_BUFFER_SIZE
+#define CONFIG_FPGA_SPI_BUFFER_SIZE 512
+#endif
+
+// Scaled with the buffer count, as it must be smaller
+#ifndef CONFIG_FPGA_COMMS_BULK_MAX_QUEUED
+#define CONFIG_FPGA_COMMS_BULK_MAX_QUEUED (CONFIG_FPGA_SPI_BUFFER_COUNT / 2)
+#endif
+
+#define CONFIG_FPGA_CS_GPIO 10
+#define CONFIG_FPGA_SCLK_GPIO 12
+#define CONFIG_FPGA_MOSI_GPIO 11
+#define CONFIG_FPGA_MISO_GPIO 13
+#define CONFIG_FPGA_WP_GPIO 14
+#define CONFIG_FPGA_HD_GPIO 9
+#define CONFIG_FPGA_CRESET_GPIO 36
+#define CONFIG_FPGA_CDONE_GPIO 37
+
+#ifndef CONFIG_FPGA_SPI_FREQ_COMMS
+#define CONFIG_FPGA_SPI_FREQ_COMMS 40
+#endif
+
+#define CONFIG_FPGA_COMMS_REGISTER_CACHE_SIZE 16
+#define CONFIG_FPGA_COMMS_LATENCY_STATS 1
+#define CONFIG_FPGA_MASTER_SPI_LOCK_STATS 1
+
+#if !defined(CONFIG_FPGA_COMMS_COMPLETION_ISR) && !defined(CONFIG_FPGA_COMMS_COMPLETION_REAPER)
+#define CONFIG_FPGA_COMMS_COMPLETION_ISR 1
+#endif
+
+#ifdef CONFIG_FPGA_COMMS_COMPLETION_REAPER
+#define CONFIG_FPGA_COMMS_REAPER_PRIORITY 20
+#endif
+
+#define CONFIG_FPGA_COMMS_POLLING_THRESHOLD 0
+
+#define CONFIG_FPGA_LOADER_CHUNK_SIZE 8192
+
+#define CONFIG_FPGA_SPI_FREQ_PROGRAMMING 20
@@ -0,0 +1,4 @@
+#pragma once
+
+#define FSPICS0_OUT_IDX 68
+#define SIG_GPIO_OUT_IDX 256
@@ -0,0 +1,112 @@
+// Host shim: logging, timers, heap and error names
+
+#include "esp_err.h"
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+#include "esp_rom_sys.h"
+#include "esp_timer.h"
+#include "newlib_compat.h"
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+
+static esp_log_level_t log_level = ESP_LOG_INFO;
+
+void esp_log_level_set(const char* tag, esp_log_level_t level)
+{
+    log_level = level;
+}
+
+void esp_log_write(esp_log_level_t level, const char* tag, const char* format, ...)
+{
+    static const char letters[] = { 'N', 'E', 'W', 'I', 'D', 'V' };
+
+    if (level > log_level)
+        return;
+
+    char line[512];
+    va_list args;
+    va_start(args, format);
+    vsnprintf(line, sizeof(line), format, args);
+    va_end(args);
+
+    fprintf(stderr, "%c (%lld) %s: %s\n", letters[level], (long long)(esp_timer_get_time() / 1000), tag, line);
+}
+
+//! Time the program started, so that times start near zero like on the ESP32
+static struct timespec start;
+
+__attribute__((constructor)) static void timer_start_init(void)
+{
+    clock_gettime(CLOCK_MONOTONIC, &start);
+}
+
+int64_t esp_timer_get_time(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (int64_t)(now.tv_sec - start.tv_sec) * 1000000 + (now.tv_nsec - start.tv_nsec) / 1000;
+}
+
+void esp_rom_delay_us(uint32_t us)
+{
+    const int64_t end_time = esp_timer_get_time() + us;
+
+    while (esp_timer_get_time() < end_time) {
+    }
+}
+
+void* heap_caps_malloc(size_t size, uint32_t caps)
+{
+    return malloc(size);
+}
+
+void heap_caps_free(void* ptr)
+{
+    free(ptr);
+}
+
+const char* esp_err_to_name(esp_err_t code)
+{
+    switch (code) {
+    case ESP_OK:
+        return "ESP_OK";
+    case ESP_FAIL:
+        return "ESP_FAIL";
+    case ESP_ERR_NO_MEM:
+        return "ESP_ERR_NO_MEM";
+    case ESP_ERR_INVALID_ARG:
+        return "ESP_ERR_INVALID_ARG";
+    case ESP_ERR_INVALID_STATE:
+        return "ESP_ERR_INVALID_STATE";
+    case ESP_ERR_INVALID_SIZE:
+        return "ESP_ERR_INVALID_SIZE";
+    case ESP_ERR_NOT_FOUND:
+        return "ESP_ERR_NOT_FOUND";
+    case ESP_ERR_NOT_SUPPORTED:
+        return "ESP_ERR_NOT_SUPPORTED";
+    case ESP_ERR_TIMEOUT:
+        return "ESP_ERR_TIMEOUT";
+    case ESP_ERR_INVALID_RESPONSE:
+        return "ESP_ERR_INVALID_RESPONSE";
+    case ESP_ERR_INVALID_CRC:
+        return "ESP_ERR_INVALID_CRC";
+    default:
+        return "UNKNOWN ERROR";
+    }
+}
+
+// Weak, so that the C library's own version is used where it has one
+__attribute__((weak)) size_t strlcpy(char* dst, const char* src, size_t size)
+{
+    const size_t length = strlen(src);
+
+    if (size > 0) {
+        const size_t count = (length < size - 1) ? length : size - 1;
+        memcpy(dst, src, count);
+        dst[count] = '\0';
+    }
+
+    return length;
+}
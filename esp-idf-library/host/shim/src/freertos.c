@@ -0,0 +1,253 @@
+// Host shim: FreeRTOS semaphores and tasks on top of pthreads
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include "shim.h"
+#include <assert.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+struct shim_task_t {
+    pthread_t thread;
+    char name[configMAX_TASK_NAME_LEN];
+    TaskFunction_t function;
+    void* param;
+};
+
+//! Task running on this thread, created on first use for threads not
+//! started by xTaskCreate()
+static __thread struct shim_task_t* current_task = NULL;
+
+//! Set while the shim runs a callback that stands in for an interrupt
+static __thread bool in_isr = false;
+
+BaseType_t xPortInIsrContext(void)
+{
+    return in_isr ? pdTRUE : pdFALSE;
+}
+
+void shim_isr_enter(void)
+{
+    in_isr = true;
+}
+
+void shim_isr_exit(void)
+{
+    in_isr = false;
+}
+
+void shim_deadline_get(struct timespec* deadline, TickType_t ticks)
+{
+    clock_gettime(CLOCK_MONOTONIC, deadline);
+
+    const uint64_t ns = (uint64_t)ticks * (1000000000 / configTICK_RATE_HZ) + deadline->tv_nsec;
+    deadline->tv_sec += ns / 1000000000;
+    deadline->tv_nsec = ns % 1000000000;
+}
+
+void shim_cond_init(pthread_cond_t* cond)
+{
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(cond, &attr);
+    pthread_condattr_destroy(&attr);
+}
+
+void shim_mutex_unlock_cleanup(void* mutex)
+{
+    pthread_mutex_unlock((pthread_mutex_t*)mutex);
+}
+
+// Semaphores ////////////////////////////////////////////////////////////////
+
+static SemaphoreHandle_t semaphore_init(StaticSemaphore_t* semaphore, UBaseType_t max_count, UBaseType_t initial_count, bool allocated)
+{
+    pthread_mutex_init(&semaphore->mutex, NULL);
+    shim_cond_init(&semaphore->cond);
+    semaphore->count = initial_count;
+    semaphore->max_count = max_count;
+    semaphore->allocated = allocated;
+
+    return semaphore;
+}
+
+static SemaphoreHandle_t semaphore_create(UBaseType_t max_count, UBaseType_t initial_count)
+{
+    StaticSemaphore_t* semaphore = malloc(sizeof(StaticSemaphore_t));
+    if (semaphore == NULL)
+        return NULL;
+
+    return semaphore_init(semaphore, max_count, initial_count, true);
+}
+
+SemaphoreHandle_t xSemaphoreCreateMutex(void)
+{
+    return semaphore_create(1, 1);
+}
+
+SemaphoreHandle_t xSemaphoreCreateBinary(void)
+{
+    return semaphore_create(1, 0);
+}
+
+SemaphoreHandle_t xSemaphoreCreateBinaryStatic(StaticSemaphore_t* buffer)
+{
+    return semaphore_init(buffer, 1, 0, false);
+}
+
+SemaphoreHandle_t xSemaphoreCreateCounting(UBaseType_t max_count, UBaseType_t initial_count)
+{
+    return semaphore_create(max_count, initial_count);
+}
+
+void vSemaphoreDelete(SemaphoreHandle_t semaphore)
+{
+    if (semaphore == NULL)
+        return;
+
+    pthread_cond_destroy(&semaphore->cond);
+    pthread_mutex_destroy(&semaphore->mutex);
+
+    if (semaphore->allocated)
+        free(semaphore);
+}
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t semaphore, TickType_t timeout)
+{
+    struct timespec deadline;
+    if (timeout != portMAX_DELAY)
+        shim_deadline_get(&deadline, timeout);
+
+    BaseType_t ret = pdTRUE;
+
+    pthread_mutex_lock(&semaphore->mutex);
+    pthread_cleanup_push(shim_mutex_unlock_cleanup, &semaphore->mutex);
+
+    while (semaphore->count == 0) {
+        if (timeout == portMAX_DELAY) {
+            pthread_cond_wait(&semaphore->cond, &semaphore->mutex);
+        } else if (pthread_cond_timedwait(&semaphore->cond, &semaphore->mutex, &deadline) == ETIMEDOUT) {
+            ret = pdFALSE;
+            break;
+        }
+    }
+
+    if (ret == pdTRUE)
+        semaphore->count--;
+
+    pthread_cleanup_pop(1);
+
+    return ret;
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t semaphore)
+{
+    BaseType_t ret = pdFALSE;
+
+    pthread_mutex_lock(&semaphore->mutex);
+    if (semaphore->count < semaphore->max_count) {
+        semaphore->count++;
+        pthread_cond_signal(&semaphore->cond);
+        ret = pdTRUE;
+    }
+    pthread_mutex_unlock(&semaphore->mutex);
+
+    return ret;
+}
+
+BaseType_t xSemaphoreGiveFromISR(SemaphoreHandle_t semaphore, BaseType_t* higher_priority_task_woken)
+{
+    const BaseType_t ret = xSemaphoreGive(semaphore);
+
+    if ((ret == pdTRUE) && (higher_priority_task_woken != NULL))
+        *higher_priority_task_woken = pdTRUE;
+
+    return ret;
+}
+
+// Tasks /////////////////////////////////////////////////////////////////////
+
+static struct shim_task_t* task_current(void)
+{
+    if (current_task == NULL) {
+        current_task = calloc(1, sizeof(struct shim_task_t));
+        current_task->thread = pthread_self();
+        strncpy(current_task->name, "main", sizeof(current_task->name) - 1);
+    }
+
+    return current_task;
+}
+
+static void* task_run(void* param)
+{
+    current_task = param;
+    current_task->function(current_task->param);
+
+    return NULL;
+}
+
+BaseType_t xTaskCreate(TaskFunction_t function, const char* name, uint32_t stack_depth,
+    void* param, UBaseType_t priority, TaskHandle_t* handle)
+{
+    struct shim_task_t* task = calloc(1, sizeof(struct shim_task_t));
+    if (task == NULL)
+        return pdFAIL;
+
+    strncpy(task->name, name, sizeof(task->name) - 1);
+    task->function = function;
+    task->param = param;
+
+    if (pthread_create(&task->thread, NULL, task_run, task) != 0) {
+        free(task);
+        return pdFAIL;
+    }
+
+    if (handle != NULL)
+        *handle = task;
+
+    return pdPASS;
+}
+
+void vTaskDelete(TaskHandle_t task)
+{
+    if ((task == NULL) || (task == current_task)) {
+        // The task structure is leaked, as the handle may still be in use
+        pthread_detach(pthread_self());
+        pthread_exit(NULL);
+    }
+
+    pthread_cancel(task->thread);
+    pthread_join(task->thread, NULL);
+    free(task);
+}
+
+void vTaskSuspend(TaskHandle_t task)
+{
+    assert((task == NULL) || (task == current_task));
+
+    // pause() is a cancellation point, so vTaskDelete() can still end the thread
+    while (true)
+        pause();
+}
+
+void vTaskDelay(TickType_t ticks)
+{
+    usleep((useconds_t)ticks * (1000000 / configTICK_RATE_HZ));
+}
+
+TaskHandle_t xTaskGetCurrentTaskHandle(void)
+{
+    return task_current();
+}
+
+char* pcTaskGetName(TaskHandle_t task)
+{
+    if (task == NULL)
+        task = task_current();
+
+    return task->name;
+}
@@ -0,0 +1,160 @@
+// Host shim: GPIO levels and edge interrupts
+
+#include "driver/gpio.h"
+#include "shim.h"
+
+typedef struct {
+    uint32_t level;
+    gpio_int_type_t intr_type;
+    bool intr_enabled;
+    gpio_isr_t isr_handler;
+    void* isr_args;
+} pin_t;
+
+static pin_t pins[GPIO_NUM_MAX];
+static pthread_mutex_t pins_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static gpio_mock_output_cb_t output_cb = NULL;
+
+static bool pin_valid(gpio_num_t gpio_num)
+{
+    return (gpio_num >= 0) && (gpio_num < GPIO_NUM_MAX);
+}
+
+esp_err_t gpio_config(const gpio_config_t* config)
+{
+    if (config == NULL)
+        return ESP_ERR_INVALID_ARG;
+
+    pthread_mutex_lock(&pins_mutex);
+    for (int gpio_num = 0; gpio_num < GPIO_NUM_MAX; gpio_num++) {
+        if (config->pin_bit_mask & (1ULL << gpio_num)) {
+            pins[gpio_num].intr_type = config->intr_type;
+            pins[gpio_num].intr_enabled = (config->intr_type != GPIO_INTR_DISABLE);
+        }
+    }
+    pthread_mutex_unlock(&pins_mutex);
+
+    return ESP_OK;
+}
+
+esp_err_t gpio_set_level(gpio_num_t gpio_num, uint32_t level)
+{
+    if (!pin_valid(gpio_num))
+        return ESP_ERR_INVALID_ARG;
+
+    pthread_mutex_lock(&pins_mutex);
+    pins[gpio_num].level = level ? 1 : 0;
+    pthread_mutex_unlock(&pins_mutex);
+
+    if (output_cb != NULL)
+        output_cb(gpio_num, level ? 1 : 0);
+
+    return ESP_OK;
+}
+
+int gpio_get_level(gpio_num_t gpio_num)
+{
+    if (!pin_valid(gpio_num))
+        return 0;
+
+    pthread_mutex_lock(&pins_mutex);
+    const int level = pins[gpio_num].level;
+    pthread_mutex_unlock(&pins_mutex);
+
+    return level;
+}
+
+esp_err_t gpio_set_intr_type(gpio_num_t gpio_num, gpio_int_type_t intr_type)
+{
+    if (!pin_valid(gpio_num))
+        return ESP_ERR_INVALID_ARG;
+
+    pthread_mutex_lock(&pins_mutex);
+    pins[gpio_num].intr_type = intr_type;
+    pthread_mutex_unlock(&pins_mutex);
+
+    return ESP_OK;
+}
+
+static esp_err_t intr_enable_set(gpio_num_t gpio_num, bool enabled)
+{
+    if (!pin_valid(gpio_num))
+        return ESP_ERR_INVALID_ARG;
+
+    pthread_mutex_lock(&pins_mutex);
+    pins[gpio_num].intr_enabled = enabled;
+    pthread_mutex_unlock(&pins_mutex);
+
+    return ESP_OK;
+}
+
+esp_err_t gpio_intr_enable(gpio_num_t gpio_num)
+{
+    return intr_enable_set(gpio_num, true);
+}
+
+esp_err_t gpio_intr_disable(gpio_num_t gpio_num)
+{
+    return intr_enable_set(gpio_num, false);
+}
+
+esp_err_t gpio_install_isr_service(int intr_alloc_flags)
+{
+    return ESP_OK;
+}
+
+esp_err_t gpio_isr_handler_add(gpio_num_t gpio_num, gpio_isr_t isr_handler, void* args)
+{
+    if (!pin_valid(gpio_num))
+        return ESP_ERR_INVALID_ARG;
+
+    pthread_mutex_lock(&pins_mutex);
+    pins[gpio_num].isr_handler = isr_handler;
+    pins[gpio_num].isr_args = args;
+    pthread_mutex_unlock(&pins_mutex);
+
+    return ESP_OK;
+}
+
+void gpio_matrix_out(uint32_t gpio, uint32_t signal_idx, bool out_inv, bool oen_inv)
+{
+}
+
+void gpio_mock_output_cb_set(gpio_mock_output_cb_t callback)
+{
+    output_cb = callback;
+}
+
+void gpio_mock_input_set(gpio_num_t gpio_num, uint32_t level)
+{
+    if (!pin_valid(gpio_num))
+        return;
+
+    level = level ? 1 : 0;
+
+    pthread_mutex_lock(&pins_mutex);
+    pin_t* pin = &pins[gpio_num];
+    const bool rising = (pin->level == 0) && (level == 1);
+    const bool falling = (pin->level == 1) && (level == 0);
+    pin->level = level;
+
+    bool fire = false;
+    if (pin->intr_enabled) {
+        fire = ((pin->intr_type == GPIO_INTR_POSEDGE) && rising)
+            || ((pin->intr_type == GPIO_INTR_NEGEDGE) && falling)
+            || ((pin->intr_type == GPIO_INTR_ANYEDGE) && (rising || falling));
+    }
+    const gpio_isr_t isr_handler = pin->isr_handler;
+    void* isr_args = pin->isr_args;
+    pthread_mutex_unlock(&pins_mutex);
+
+    if (fire && (isr_handler != NULL)) {
+        const bool nested = xPortInIsrContext();
+
+        shim_isr_enter();
+        isr_handler(isr_args);
+        if (!nested)
+            shim_isr_exit();
+    }
+}
@@ -0,0 +1,22 @@
+#pragma once
+
+// Helpers shared by the shim sources
+
+#include "freertos/FreeRTOS.h"
+#include <pthread.h>
+#include <time.h>
+
+//! @brief Mark the calling thread as running an interrupt handler, see xPortInIsrContext()
+void shim_isr_enter(void);
+void shim_isr_exit(void);
+
+//! @brief Get the CLOCK_MONOTONIC time a number of ticks from now
+void shim_deadline_get(struct timespec* deadline, TickType_t ticks);
+
+//! @brief Initialise a condition variable that waits against CLOCK_MONOTONIC
+void shim_cond_init(pthread_cond_t* cond);
+
+//! @brief pthread_cleanup_push() handler that unlocks a mutex
+//!
+//! Blocking waits use this, so that vTaskDelete() can cancel a task blocked in them.
+void shim_mutex_unlock_cleanup(void* mutex);
@@ -0,0 +1,387 @@
+// Host shim: the ESP-IDF SPI master driver
+//
+// Transactions from all devices go into one queue, and are sent in order by
+// a bus thread that stands in for the SPI interrupt. A device that has
+// acquired the bus has its transactions sent first, and the others wait
+// until it is released.
+
+#include "driver/spi_master.h"
+#include "shim.h"
+#include "soc/soc.h"
+#include <string.h>
+
+//! Transactions queued on the bus, for all devices
+#define BUS_QUEUE_SIZE 256
+
+struct spi_device_t {
+    spi_device_interface_config_t config;
+    int actual_clock_hz;
+
+    //! Transactions queued, being sent, or waiting in the result queue
+    int outstanding;
+
+    //! Finished transactions, for spi_device_get_trans_result()
+    spi_transaction_t** results;
+    int result_head;
+    int result_count;
+    pthread_cond_t result_cond;
+};
+
+typedef struct {
+    spi_device_handle_t device;
+    spi_transaction_t* trans;
+} bus_entry_t;
+
+static struct {
+    bool initialized;
+    pthread_t thread;
+
+    //! Guards everything here and in the devices
+    pthread_mutex_t mutex;
+    //! Signalled when a transaction is queued, or the bus owner changes
+    pthread_cond_t queue_cond;
+    //! Signalled when a transaction finishes
+    pthread_cond_t done_cond;
+
+    bus_entry_t queue[BUS_QUEUE_SIZE];
+    int queue_count;
+
+    //! Device currently sending, or NULL
+    spi_device_handle_t sending;
+    //! Device that has acquired the bus, or NULL
+    spi_device_handle_t owner;
+} bus = {
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static spi_mock_transfer_cb_t transfer_cb = NULL;
+static bool wire_time_enabled = false;
+
+void spi_mock_transfer_cb_set(spi_mock_transfer_cb_t callback)
+{
+    transfer_cb = callback;
+}
+
+void spi_mock_wire_time_set(bool enable)
+{
+    wire_time_enabled = enable;
+}
+
+//! @brief Wait for as long as a transaction would take on the wire
+static void wire_time_wait(spi_device_handle_t device, const spi_transaction_t* trans)
+{
+    if (!wire_time_enabled)
+        return;
+
+    const int data_lines = (trans->flags & SPI_TRANS_MODE_QIO) ? 4
+        : (trans->flags & SPI_TRANS_MODE_DIO) ? 2
+                                              : 1;
+    const uint64_t clocks = device->config.command_bits
+        + device->config.address_bits
+        + device->config.dummy_bits
+        + (trans->length + trans->rxlength + data_lines - 1) / data_lines;
+
+    // Busy-waited, as a sleep this short overshoots by far more than the
+    // transfer time
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    const int64_t end_ns = (int64_t)now.tv_sec * 1000000000 + now.tv_nsec
+        + clocks * 1000000000 / device->actual_clock_hz;
+
+    do {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+    } while ((int64_t)now.tv_sec * 1000000000 + now.tv_nsec < end_ns);
+}
+
+//! @brief Send a transaction: run the callbacks, and hand it to the FPGA model
+static void transfer(spi_device_handle_t device, spi_transaction_t* trans)
+{
+    if (device->config.pre_cb != NULL)
+        device->config.pre_cb(trans);
+
+    wire_time_wait(device, trans);
+
+    if (transfer_cb != NULL)
+        transfer_cb(&device->config, trans);
+
+    if (device->config.post_cb != NULL)
+        device->config.post_cb(trans);
+}
+
+//! @brief Check whether a device's transactions can be sent
+//!
+//! Must be called with bus.mutex held
+static bool device_can_send(spi_device_handle_t device)
+{
+    return (bus.owner == NULL) || (bus.owner == device);
+}
+
+static void* bus_thread(void* param)
+{
+    pthread_mutex_lock(&bus.mutex);
+
+    while (true) {
+        int index = 0;
+        while ((index < bus.queue_count) && !device_can_send(bus.queue[index].device))
+            index++;
+
+        if (index == bus.queue_count) {
+            pthread_cond_wait(&bus.queue_cond, &bus.mutex);
+            continue;
+        }
+
+        const bus_entry_t entry = bus.queue[index];
+        memmove(&bus.queue[index], &bus.queue[index + 1], (bus.queue_count - index - 1) * sizeof(bus_entry_t));
+        bus.queue_count--;
+        bus.sending = entry.device;
+
+        pthread_mutex_unlock(&bus.mutex);
+
+        shim_isr_enter();
+        transfer(entry.device, entry.trans);
+        shim_isr_exit();
+
+        pthread_mutex_lock(&bus.mutex);
+        bus.sending = NULL;
+
+        spi_device_handle_t device = entry.device;
+        if (device->config.flags & SPI_DEVICE_DISCARD_AFTER_POST) {
+            device->outstanding--;
+        } else {
+            const int tail = (device->result_head + device->result_count) % device->config.queue_size;
+            device->results[tail] = entry.trans;
+            device->result_count++;
+            pthread_cond_broadcast(&device->result_cond);
+        }
+
+        pthread_cond_broadcast(&bus.done_cond);
+    }
+
+    return NULL;
+}
+
+esp_err_t spi_bus_initialize(spi_host_device_t host, const spi_bus_config_t* bus_config, int dma_chan)
+{
+    if (bus.initialized)
+        return ESP_ERR_INVALID_STATE;
+
+    shim_cond_init(&bus.queue_cond);
+    shim_cond_init(&bus.done_cond);
+
+    if (pthread_create(&bus.thread, NULL, bus_thread, NULL) != 0)
+        return ESP_ERR_NO_MEM;
+
+    bus.initialized = true;
+    return ESP_OK;
+}
+
+esp_err_t spi_bus_add_device(spi_host_device_t host, const spi_device_interface_config_t* dev_config, spi_device_handle_t* handle)
+{
+    if (!bus.initialized)
+        return ESP_ERR_INVALID_STATE;
+
+    if ((dev_config == NULL) || (handle == NULL) || (dev_config->queue_size < 1)
+        || (dev_config->clock_speed_hz <= 0))
+        return ESP_ERR_INVALID_ARG;
+
+    spi_device_handle_t device = calloc(1, sizeof(struct spi_device_t));
+    if (device == NULL)
+        return ESP_ERR_NO_MEM;
+
+    device->results = calloc(dev_config->queue_size, sizeof(spi_transaction_t*));
+    if (device->results == NULL) {
+        free(device);
+        return ESP_ERR_NO_MEM;
+    }
+
+    device->config = *dev_config;
+    device->actual_clock_hz = spi_get_actual_clock(APB_CLK_FREQ, dev_config->clock_speed_hz, dev_config->duty_cycle_pos);
+    shim_cond_init(&device->result_cond);
+
+    *handle = device;
+    return ESP_OK;
+}
+
+esp_err_t spi_bus_remove_device(spi_device_handle_t handle)
+{
+    if (handle == NULL)
+        return ESP_ERR_INVALID_ARG;
+
+    pthread_mutex_lock(&bus.mutex);
+    const bool busy = (handle->outstanding > 0) || (bus.owner == handle);
+    pthread_mutex_unlock(&bus.mutex);
+
+    if (busy)
+        return ESP_ERR_INVALID_STATE;
+
+    pthread_cond_destroy(&handle->result_cond);
+    free(handle->results);
+    free(handle);
+
+    return ESP_OK;
+}
+
+esp_err_t spi_device_queue_trans(spi_device_handle_t handle, spi_transaction_t* trans_desc, TickType_t ticks_to_wait)
+{
+    if ((handle == NULL) || (trans_desc == NULL))
+        return ESP_ERR_INVALID_ARG;
+
+    struct timespec deadline;
+    if (ticks_to_wait != portMAX_DELAY)
+        shim_deadline_get(&deadline, ticks_to_wait);
+
+    esp_err_t ret = ESP_OK;
+
+    pthread_mutex_lock(&bus.mutex);
+    pthread_cleanup_push(shim_mutex_unlock_cleanup, &bus.mutex);
+
+    while ((handle->outstanding >= handle->config.queue_size) || (bus.queue_count >= BUS_QUEUE_SIZE)) {
+        if (ticks_to_wait == portMAX_DELAY) {
+            pthread_cond_wait(&bus.done_cond, &bus.mutex);
+        } else if (pthread_cond_timedwait(&bus.done_cond, &bus.mutex, &deadline) != 0) {
+            ret = ESP_ERR_TIMEOUT;
+            break;
+        }
+    }
+
+    if (ret == ESP_OK) {
+        bus.queue[bus.queue_count++] = (bus_entry_t) { handle, trans_desc };
+        handle->outstanding++;
+        pthread_cond_signal(&bus.queue_cond);
+    }
+
+    pthread_cleanup_pop(1);
+
+    return ret;
+}
+
+esp_err_t spi_device_get_trans_result(spi_device_handle_t handle, spi_transaction_t** trans_desc, TickType_t ticks_to_wait)
+{
+    if ((handle == NULL) || (trans_desc == NULL))
+        return ESP_ERR_INVALID_ARG;
+
+    if (handle->config.flags & SPI_DEVICE_DISCARD_AFTER_POST)
+        return ESP_ERR_NOT_SUPPORTED;
+
+    struct timespec deadline;
+    if (ticks_to_wait != portMAX_DELAY)
+        shim_deadline_get(&deadline, ticks_to_wait);
+
+    esp_err_t ret = ESP_OK;
+
+    pthread_mutex_lock(&bus.mutex);
+    pthread_cleanup_push(shim_mutex_unlock_cleanup, &bus.mutex);
+
+    while (handle->result_count == 0) {
+        if (ticks_to_wait == portMAX_DELAY) {
+            pthread_cond_wait(&handle->result_cond, &bus.mutex);
+        } else if ((ticks_to_wait == 0)
+            || (pthread_cond_timedwait(&handle->result_cond, &bus.mutex, &deadline) != 0)) {
+            ret = ESP_ERR_TIMEOUT;
+            break;
+        }
+    }
+
+    if (ret == ESP_OK) {
+        *trans_desc = handle->results[handle->result_head];
+        handle->result_head = (handle->result_head + 1) % handle->config.queue_size;
+        handle->result_count--;
+        handle->outstanding--;
+        pthread_cond_broadcast(&bus.done_cond);
+    }
+
+    pthread_cleanup_pop(1);
+
+    return ret;
+}
+
+esp_err_t spi_device_transmit(spi_device_handle_t handle, spi_transaction_t* trans_desc)
+{
+    esp_err_t ret = spi_device_queue_trans(handle, trans_desc, portMAX_DELAY);
+    if (ret != ESP_OK)
+        return ret;
+
+    spi_transaction_t* result;
+    ret = spi_device_get_trans_result(handle, &result, portMAX_DELAY);
+    if ((ret == ESP_OK) && (result != trans_desc))
+        ret = ESP_ERR_INVALID_STATE;
+
+    return ret;
+}
+
+esp_err_t spi_device_polling_transmit(spi_device_handle_t handle, spi_transaction_t* trans_desc)
+{
+    if ((handle == NULL) || (trans_desc == NULL))
+        return ESP_ERR_INVALID_ARG;
+
+    // Polling uses the bus directly, so wait for it to be idle, and hold it
+    // while sending
+    pthread_mutex_lock(&bus.mutex);
+    while ((bus.queue_count > 0) || (bus.sending != NULL) || !device_can_send(handle))
+        pthread_cond_wait(&bus.done_cond, &bus.mutex);
+    bus.sending = handle;
+    pthread_mutex_unlock(&bus.mutex);
+
+    transfer(handle, trans_desc);
+
+    pthread_mutex_lock(&bus.mutex);
+    bus.sending = NULL;
+    pthread_cond_broadcast(&bus.done_cond);
+    pthread_mutex_unlock(&bus.mutex);
+
+    return ESP_OK;
+}
+
+esp_err_t spi_device_acquire_bus(spi_device_handle_t device, TickType_t wait)
+{
+    if (device == NULL)
+        return ESP_ERR_INVALID_ARG;
+
+    if (wait != portMAX_DELAY)
+        return ESP_ERR_INVALID_ARG;
+
+    pthread_mutex_lock(&bus.mutex);
+
+    // Wait for any other device's transactions to finish
+    while (true) {
+        bool other_busy = (bus.owner != NULL) || ((bus.sending != NULL) && (bus.sending != device));
+        for (int index = 0; index < bus.queue_count; index++) {
+            if (bus.queue[index].device != device)
+                other_busy = true;
+        }
+
+        if (!other_busy)
+            break;
+
+        pthread_cond_wait(&bus.done_cond, &bus.mutex);
+    }
+
+    bus.owner = device;
+    pthread_mutex_unlock(&bus.mutex);
+
+    return ESP_OK;
+}
+
+void spi_device_release_bus(spi_device_handle_t dev)
+{
+    pthread_mutex_lock(&bus.mutex);
+    if (bus.owner == dev)
+        bus.owner = NULL;
+    pthread_cond_broadcast(&bus.queue_cond);
+    pthread_cond_broadcast(&bus.done_cond);
+    pthread_mutex_unlock(&bus.mutex);
+}
+
+int spi_get_actual_clock(int fapb, int hz, int duty_cycle)
+{
+    if (hz >= fapb)
+        return fapb;
+
+    // The nearest frequency from a whole divider, which can be faster than
+    // requested, as in the ESP-IDF clock calculation
+    const int divider = fapb / hz;
+    const int slower = fapb / (divider + 1);
+    const int faster = fapb / divider;
+
+    return ((faster - hz) <= (hz - slower)) ? faster : slower;
+}
@@ -2,6 +2,7 @@
 
 #include "fpga_comms.h"
 #include "fpga_loader.h"
+#include "fpga_slots.h"
 #include "master_spi.h"
 
 esp_err_t fpga_start(const fpga_bin_t* fpga_bin);
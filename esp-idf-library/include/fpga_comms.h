@@ -1,6 +1,11 @@
 #pragma once
 
+#include "output_trans_pool.h"
 #include <esp_err.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
+#include <stdbool.h>
 
 //! @defgroup fpga_comms FPGA communication module
 //!
@@ -8,11 +13,71 @@
 //!
 //! @{
 
+//! Handle for one FPGA on the SPI bus
+//!
+//! Each instance has its own SPI device (chip select and clock), register
+//! cache, lane limits, statistics and the locks that guard them. The DMA
+//! buffer pool and the master SPI lock are shared by all instances, as they
+//! share the bus. Each instance reserves up to bulk_max_queued of the pool
+//! entries for memory transactions.
+//!
+//! The fpga_comms_*() functions without a handle use the default instance,
+//! created by @ref fpga_comms_init(). The fpga_comms_device_*() functions
+//! take the instance as their first parameter.
+typedef struct fpga_comms_t* fpga_comms_handle_t;
+
+//! Configuration for @ref fpga_comms_create()
+typedef struct {
+    int cs_gpio; //!< GPIO connected to the FPGA chip select
+    int clock_speed_hz; //!< SPI clock frequency
+    int bulk_max_queued; //!< Maximum number of memory transactions in the SPI queue at once
+    int polling_threshold; //!< Largest register transfer (in data bytes) to send by polling, see @ref fpga_comms_polling_threshold_set()
+} fpga_comms_config_t;
+
+//! Configuration of the default instance, from the Kconfig settings
+#define FPGA_COMMS_CONFIG_DEFAULT() {                           \
+    .cs_gpio = CONFIG_FPGA_CS_GPIO,                             \
+    .clock_speed_hz = CONFIG_FPGA_SPI_FREQ_COMMS * 1000000,     \
+    .bulk_max_queued = CONFIG_FPGA_COMMS_BULK_MAX_QUEUED,       \
+    .polling_threshold = CONFIG_FPGA_COMMS_POLLING_THRESHOLD,   \
+}
+
 //! @brief Initialize the FPGA communication channel
 //!
-//! @return ESP_OK on success, error code otherwise
+//! Creates the default instance, using @ref FPGA_COMMS_CONFIG_DEFAULT().
+//!
+//! @return ESP_OK on success, ESP_ERR_INVALID_STATE if the default instance
+//!         already exists, error code otherwise
 esp_err_t fpga_comms_init();
 
+//! @brief Add an FPGA to the SPI bus
+//!
+//! The SPI bus must already be initialized, see @ref master_spi_init().
+//! One of the CONFIG_FPGA_SPI_BUFFER_COUNT pool entries is reserved for
+//! register transactions, and the total bulk_max_queued of all instances
+//! must fit in the rest.
+//!
+//! @param[in] config Configuration for the instance
+//! @param[out] handle Handle to the new instance
+//! @return ESP_OK on success, error code otherwise
+esp_err_t fpga_comms_create(const fpga_comms_config_t* config, fpga_comms_handle_t* handle);
+
+//! @brief Remove an FPGA from the SPI bus
+//!
+//! All transactions for the instance must have completed. With
+//! CONFIG_FPGA_COMMS_COMPLETION_REAPER, the reaper task is stopped first,
+//! after it has completed the transactions still in the SPI queue.
+//!
+//! @param[in] comms Instance to delete
+//! @return ESP_OK on success, error code otherwise
+esp_err_t fpga_comms_delete(fpga_comms_handle_t comms);
+
+//! @brief Get the default instance
+//!
+//! @return Handle to the default instance, or NULL if @ref fpga_comms_init()
+//!         has not been called.
+fpga_comms_handle_t fpga_comms_get_default();
+
 //! @brief Write a 16-bit register in the FPGA memory
 //!
 //! @param[in] address Byte address to access (must be 16-bit aligned)
@@ -20,6 +85,41 @@ esp_err_t fpga_comms_init();
 //! @return ESP_OK on success, error otherwise.
 esp_err_t fpga_comms_register_write(uint16_t address, uint16_t data);
 
+//! Address/value pair for @ref fpga_comms_register_write_batch()
+typedef struct {
+    uint16_t address; //!< Register address
+    uint16_t value; //!< Value to write to the register
+} fpga_comms_register_t;
+
+//! @brief Set the largest register transfer that is sent by polling
+//!
+//! Register reads and writes with at most this many data bytes are sent with
+//! spi_device_polling_transmit(), without a pool entry, queue or interrupt.
+//! The call first waits for the queued transactions to finish, so ordering
+//! with other transactions is kept. Polled transfers are not counted in the
+//! latency or lane statistics.
+//!
+//! Only @ref fpga_comms_register_write() and @ref fpga_comms_register_read()
+//! use polling. Batches and asynchronous reads are always queued.
+//!
+//! @param[in] threshold Number of data bytes (up to 4), or 0 to queue every
+//!            transaction. The initial value is CONFIG_FPGA_COMMS_POLLING_THRESHOLD.
+//! @return ESP_OK on success, error otherwise.
+esp_err_t fpga_comms_polling_threshold_set(int threshold);
+
+//! @brief Write several 16-bit registers in the FPGA memory
+//!
+//! Runs of consecutive register addresses are packed into a single SPI
+//! transaction, using the auto-increment of the FPGA SPI interface. The
+//! transactions are queued back-to-back, up to four at a time under one bus
+//! lock.
+//!
+//! @param[in] registers Array of registers to write, in order
+//! @param[in] count Number of registers in the array
+//! @return ESP_OK on success, error otherwise. On error, some of the registers
+//!         may already have been written.
+esp_err_t fpga_comms_register_write_batch(const fpga_comms_register_t* registers, int count);
+
 //! @brief Read a 16-bit register from the FPGA memory
 //!
 //! @param[in] address Byte address to access (must be 16-bit aligned)
@@ -27,10 +127,147 @@ esp_err_t fpga_comms_register_write(uint16_t address, uint16_t data);
 //! @return ESP_OK on success, error otherwise.
 esp_err_t fpga_comms_register_read(uint16_t address, uint16_t* data);
 
+struct fpga_comms_read_request_t;
+
+//! Completion callback for an asynchronous register read. Called from the SPI
+//! ISR, or from the reaper task with CONFIG_FPGA_COMMS_COMPLETION_REAPER.
+typedef void (*fpga_comms_read_callback_t)(struct fpga_comms_read_request_t* request);
+
+//! Asynchronous register read request
+//!
+//! The request must stay valid until it completes, or until
+//! @ref fpga_comms_register_read_wait() returns.
+typedef struct fpga_comms_read_request_t {
+    fpga_comms_read_callback_t callback; //!< Optional callback to run on completion, or NULL
+    void* ctx; //!< Caller context for the callback
+
+    uint16_t address; //!< Register address being read
+    uint16_t value; //!< Value read from the register, valid once done is set
+    volatile bool done; //!< Set when the read has completed
+    SemaphoreHandle_t done_semaphore; //!< Given on completion
+    StaticSemaphore_t done_semaphore_buffer; //!< Storage for done_semaphore
+    output_trans_pool_t* output_trans_pool; //!< Pool entry used for the transaction
+} fpga_comms_read_request_t;
+
+//! @brief Start an asynchronous read of a 16-bit register
+//!
+//! The read is queued behind any other pending transactions, and the call
+//! returns immediately. Several reads can be in flight at once. On completion,
+//! request->value is filled in, the callback (if any) is called (see
+//! @ref fpga_comms_read_callback_t), and request->done_semaphore is given.
+//! The calling task's notification value is not used.
+//!
+//! @param[in] address Register address to read
+//! @param[in,out] request Request to fill. The callback and ctx fields must be
+//!                set (or NULL) by the caller.
+//! @return ESP_OK if the read was queued, error otherwise.
+esp_err_t fpga_comms_register_read_start(uint16_t address, fpga_comms_read_request_t* request);
+
+//! @brief Wait for an asynchronous register read to complete
+//!
+//! Only one task may wait for each request.
+//!
+//! @param[in] request Request passed to @ref fpga_comms_register_read_start()
+//! @param[in] timeout Maximum time to wait, in ticks
+//! @return ESP_OK if the read completed, error otherwise. On error, the
+//!         request is abandoned, and will not be completed later.
+esp_err_t fpga_comms_register_read_wait(fpga_comms_read_request_t* request, TickType_t timeout);
+
+//! @brief Read several 16-bit registers from the FPGA memory
+//!
+//! All of the reads are queued at once, so they complete in a single bus
+//! round-trip window rather than one after another.
+//!
+//! @param[in] addresses Register addresses to read
+//! @param[out] values Values read from the registers
+//! @param[in] count Number of registers to read
+//! @return ESP_OK on success, error otherwise.
+esp_err_t fpga_comms_register_read_batch(const uint16_t* addresses, uint16_t* values, int count);
+
+//! Register cache policy, for @ref fpga_comms_register_cache_configure()
+typedef enum {
+    FPGA_COMMS_REGISTER_VOLATILE, //!< Always read from the FPGA. This is the default for all registers.
+    FPGA_COMMS_REGISTER_CACHED, //!< Write-through. Reads are served from the shadow copy once it is valid.
+    FPGA_COMMS_REGISTER_WRITE_ONLY, //!< Can't be read back from the FPGA. Reads return the last value written.
+} fpga_comms_register_policy_t;
+
+//! @brief Keep a shadow copy of a range of registers
+//!
+//! Writes to the range update the shadow copy, and
+//! @ref fpga_comms_register_read() and @ref fpga_comms_register_read_batch()
+//! are served from it when it is valid, without an SPI transaction.
+//! Asynchronous reads with @ref fpga_comms_register_read_start() always read
+//! from the FPGA.
+//!
+//! Only registers that are not changed by the FPGA itself should be cached.
+//! Up to CONFIG_FPGA_COMMS_REGISTER_CACHE_SIZE registers can be cached in total.
+//!
+//! @param[in] address First register address in the range
+//! @param[in] count Number of registers in the range
+//! @param[in] policy FPGA_COMMS_REGISTER_CACHED or FPGA_COMMS_REGISTER_WRITE_ONLY
+//! @return ESP_OK on success, error otherwise.
+esp_err_t fpga_comms_register_cache_configure(uint16_t address, int count, fpga_comms_register_policy_t policy);
+
+//! @brief Mark all shadow register copies as invalid, and discard staged writes
+//!
+//! @ref fpga_loader_finalize() calls this for the default instance, as loading
+//! a bitstream resets the registers to their initial values.
+void fpga_comms_register_cache_invalidate();
+
+//! @brief Invalidate the shadow register copies, then read back the cached registers
+//!
+//! Write-only registers are left invalid, as their values are unknown. Staged
+//! writes are kept.
+//!
+//! @return ESP_OK on success, error otherwise.
+esp_err_t fpga_comms_register_cache_resync();
+
+//! Register write coalescing statistics
+typedef struct {
+    uint32_t writes; //!< Writes staged by @ref fpga_comms_register_write_deferred() (uncached registers aren't counted)
+    uint32_t unchanged; //!< Writes dropped because the register already had the value
+    uint32_t merged; //!< Writes replaced by a later write to the same register before a flush
+    uint32_t flushed; //!< Registers written to the FPGA by @ref fpga_comms_register_flush()
+    uint32_t transactions; //!< SPI transactions used to flush them
+} fpga_comms_coalesce_stats_t;
+
+//! @brief Stage a write to a cached register, to be sent by the next flush
+//!
+//! Writes of the value the register already holds are dropped, and repeated
+//! writes to the same register before a flush are merged into one. Registers
+//! that aren't configured with @ref fpga_comms_register_cache_configure() are
+//! written immediately. An immediate write to a register replaces any write
+//! staged for it.
+//!
+//! @param[in] address Register address
+//! @param[in] data Data to write to the register
+//! @return ESP_OK on success, error otherwise.
+esp_err_t fpga_comms_register_write_deferred(uint16_t address, uint16_t data);
+
+//! @brief Write all staged register writes to the FPGA
+//!
+//! The dirty registers are written in address order, so that runs of
+//! consecutive registers are packed into single transactions.
+//!
+//! @return ESP_OK on success, error otherwise. On error, the registers that
+//!         may not have been written are left dirty.
+esp_err_t fpga_comms_register_flush();
+
+//! @brief Get a copy of the register write coalescing statistics
+//!
+//! @param[out] stats Statistics to copy into
+//! @return ESP_OK on success, error otherwise.
+esp_err_t fpga_comms_coalesce_stats_get(fpga_comms_coalesce_stats_t* stats);
+
+//! @brief Print register write coalescing statistics
+void fpga_comms_coalesce_stats_print();
+
 //! @brief Write a buffer of data to the FPGA memory
 //!
-//! The passed buffer will be automatically copied into a DMA-capable buffer,
-//! then sent over the SPI bus to the FPGA.
+//! The passed buffer will be automatically copied into DMA-capable buffers,
+//! then sent over the SPI bus to the FPGA. Writes larger than
+//! CONFIG_FPGA_SPI_BUFFER_SIZE are split into several transactions, see
+//! @ref fpga_comms_memory_write_chunked().
 //!
 //! @param[in] address Byte address to write to (must be 16-bit aligned)
 //! @param[in] buffer Source buffer to read from.
@@ -39,16 +276,180 @@ esp_err_t fpga_comms_register_read(uint16_t address, uint16_t* data);
 //! @return ESP_OK on success, error otherwise.
 esp_err_t fpga_comms_memory_write(uint16_t address, const uint8_t* buffer, int length, int retry_count);
 
-//! @brief Read a buffer of data from the FPGA memory
+//! @brief Write a buffer of any length to the FPGA memory
 //!
-//! The passed buffer will be automatically copied into a DMA-capable buffer,
-//! then sent over the SPI bus to the FPGA.
+//! The data is split into chunks of up to CONFIG_FPGA_SPI_BUFFER_SIZE bytes,
+//! each copied into its own pool buffer. The chunks are queued back-to-back,
+//! so the SPI DMA does not idle between them. Register transactions can be
+//! queued in between chunks, so they don't wait for the whole write.
 //!
 //! @param[in] address Byte address to write to (must be 16-bit aligned)
+//! @param[in] buffer Source buffer to read from.
+//! @param[in] length Number of bytes to write (must be a multiple of 16 bits,
+//!            and must not run past the end of the address space)
+//! @param[in] retry_count Number of times to attempt to get each buffer before failing.
+//! @param[out] bytes_queued If not NULL, set to the number of bytes (from the
+//!             start of the buffer) that were queued for sending. On failure,
+//!             the remaining data can be resent from this offset.
+//! @return ESP_OK on success, error otherwise.
+esp_err_t fpga_comms_memory_write_chunked(uint16_t address, const uint8_t* buffer, int length, int retry_count, int* bytes_queued);
+
+//! @brief Lease a DMA-capable buffer to render a memory write into
+//!
+//! This is the first half of a zero-copy memory write. The caller fills
+//! lease->buffer (up to CONFIG_FPGA_SPI_BUFFER_SIZE bytes) directly, then
+//! passes the lease to @ref fpga_comms_memory_write_submit() to send it. This
+//! avoids the copy made by @ref fpga_comms_memory_write().
+//!
+//! @param[in] retry_count Number of times to attempt to get a buffer before failing.
+//! @return Leased pool entry on success, NULL otherwise. The lease must be passed
+//!         to either @ref fpga_comms_memory_write_submit() or
+//!         @ref fpga_comms_memory_write_cancel().
+output_trans_pool_t* fpga_comms_memory_write_lease(int retry_count);
+
+//! @brief Send a leased buffer to the FPGA memory
+//!
+//! Ownership of the lease passes to the driver, even if the call fails. It is
+//! released back to the pool once the transaction has been sent.
+//!
+//! @param[in] lease Pool entry returned by @ref fpga_comms_memory_write_lease()
+//! @param[in] address Byte address to write to (must be 16-bit aligned)
+//! @param[in] length Number of bytes to write from the start of lease->buffer
+//!            (must be a multiple of 16 bits)
+//! @return ESP_OK on success, error otherwise.
+esp_err_t fpga_comms_memory_write_submit(output_trans_pool_t* lease, uint16_t address, int length);
+
+//! @brief Return a leased buffer without sending it
+//!
+//! @param[in] lease Pool entry returned by @ref fpga_comms_memory_write_lease()
+void fpga_comms_memory_write_cancel(output_trans_pool_t* lease);
+
+//! @brief Read a buffer of data from the FPGA memory
+//!
+//! The data is read in a single burst transaction into a DMA-capable buffer,
+//! then copied into the passed buffer. The bytes are returned in the same
+//! order that @ref fpga_comms_memory_write() sends them.
+//!
+//! @param[in] address Byte address to read from (must be 16-bit aligned)
 //! @param[out] buffer Buffer to write to.
-//! @param[in] length Number of bytes to write (must be a multiple of 16 bits)
-//! @param[in] retry_count Number of times to attempt transmission before failing.
+//! @param[in] length Number of bytes to read (up to CONFIG_FPGA_SPI_BUFFER_SIZE)
+//! @param[in] retry_count Number of times to attempt to get a buffer before failing.
 //! @return ESP_OK on success, error otherwise.
-esp_err_t fpga_comms_memory_read(uint16_t address, const uint8_t* buffer, int length, int retry_count);
+esp_err_t fpga_comms_memory_read(uint16_t address, uint8_t* buffer, int length, int retry_count);
+
+//! Number of buckets in a latency histogram
+#define FPGA_COMMS_LATENCY_BUCKETS 16
+
+//! Transaction types tracked by the latency statistics
+typedef enum {
+    FPGA_COMMS_TRANS_REGISTER_WRITE,
+    FPGA_COMMS_TRANS_REGISTER_READ,
+    FPGA_COMMS_TRANS_MEMORY_WRITE,
+    FPGA_COMMS_TRANS_MEMORY_READ,
+    FPGA_COMMS_TRANS_TYPE_COUNT,
+} fpga_comms_trans_type_t;
+
+//! Latency histogram for one transaction type
+//!
+//! Bucket 0 counts transactions that took less than 1us, and bucket n counts
+//! transactions that took from 2^(n-1) to 2^n - 1 us. The last bucket also
+//! counts everything longer.
+typedef struct {
+    uint32_t count; //!< Number of completed transactions
+    uint32_t total_us_max; //!< Longest time from queueing to completion
+    uint32_t queued[FPGA_COMMS_LATENCY_BUCKETS]; //!< Time from queueing to the start of the transaction on the bus
+    uint32_t total[FPGA_COMMS_LATENCY_BUCKETS]; //!< Time from queueing to completion
+} fpga_comms_latency_histogram_t;
+
+//! @brief Get a copy of the latency histogram for a transaction type
+//!
+//! The histograms are only recorded if CONFIG_FPGA_COMMS_LATENCY_STATS is
+//! enabled. Otherwise, they are always empty.
+//!
+//! @param[in] type Transaction type
+//! @param[out] histogram Histogram to copy into
+//! @return ESP_OK on success, error otherwise.
+esp_err_t fpga_comms_latency_get(fpga_comms_trans_type_t type, fpga_comms_latency_histogram_t* histogram);
+
+//! @brief Clear the latency histograms for all transaction types
+void fpga_comms_latency_reset();
+
+//! @brief Print a summary of the latency histograms
+void fpga_comms_latency_print();
+
+//! @brief Get a short name for a transaction type, for example "register_write"
+//!
+//! @param[in] type Transaction type
+//! @return Name of the type, or NULL if the type is invalid
+const char* fpga_comms_trans_type_name(fpga_comms_trans_type_t type);
+
+//! Transaction priority lanes
+//!
+//! Memory transactions are bulk traffic. At most bulk_max_queued of them
+//! (CONFIG_FPGA_COMMS_BULK_MAX_QUEUED for the default instance) can be queued
+//! at once, and the rest of the transaction pool is reserved for register
+//! (control) transactions. A register transaction therefore waits behind at
+//! most that many memory transactions.
+typedef enum {
+    FPGA_COMMS_LANE_CONTROL, //!< Register reads and writes
+    FPGA_COMMS_LANE_BULK, //!< Memory reads and writes
+    FPGA_COMMS_LANE_COUNT,
+} fpga_comms_lane_t;
+
+//! Queue statistics for a lane. Latencies are recorded per transaction type,
+//! see @ref fpga_comms_latency_get().
+typedef struct {
+    uint32_t queued; //!< Number of transactions currently in the SPI queue
+    uint32_t queued_max; //!< Largest number of transactions in the SPI queue at once
+} fpga_comms_lane_stats_t;
+
+//! @brief Get the queue statistics for a lane
+//!
+//! @param[in] lane Lane to get the statistics for
+//! @param[out] stats Statistics to copy into
+//! @return ESP_OK on success, error otherwise.
+esp_err_t fpga_comms_lane_stats_get(fpga_comms_lane_t lane, fpga_comms_lane_stats_t* stats);
+
+//! @brief Get a short name for a lane, for example "control"
+//!
+//! @param[in] lane Lane
+//! @return Name of the lane, or NULL if the lane is invalid
+const char* fpga_comms_lane_name(fpga_comms_lane_t lane);
+
+//! @name Functions for a specific instance
+//!
+//! These behave the same as the functions without a handle, but access the
+//! FPGA given by comms instead of the default instance. Leases, read requests
+//! and their completion functions already belong to an instance, so they
+//! don't need a handle.
+//!
+//! @{
+
+esp_err_t fpga_comms_device_polling_threshold_set(fpga_comms_handle_t comms, int threshold);
+esp_err_t fpga_comms_device_register_write(fpga_comms_handle_t comms, uint16_t address, uint16_t data);
+esp_err_t fpga_comms_device_register_write_batch(fpga_comms_handle_t comms, const fpga_comms_register_t* registers, int count);
+esp_err_t fpga_comms_device_register_read(fpga_comms_handle_t comms, uint16_t address, uint16_t* data);
+esp_err_t fpga_comms_device_register_read_start(fpga_comms_handle_t comms, uint16_t address, fpga_comms_read_request_t* request);
+esp_err_t fpga_comms_device_register_read_batch(fpga_comms_handle_t comms, const uint16_t* addresses, uint16_t* values, int count);
+
+esp_err_t fpga_comms_device_register_cache_configure(fpga_comms_handle_t comms, uint16_t address, int count, fpga_comms_register_policy_t policy);
+void fpga_comms_device_register_cache_invalidate(fpga_comms_handle_t comms);
+esp_err_t fpga_comms_device_register_cache_resync(fpga_comms_handle_t comms);
+esp_err_t fpga_comms_device_register_write_deferred(fpga_comms_handle_t comms, uint16_t address, uint16_t data);
+esp_err_t fpga_comms_device_register_flush(fpga_comms_handle_t comms);
+esp_err_t fpga_comms_device_coalesce_stats_get(fpga_comms_handle_t comms, fpga_comms_coalesce_stats_t* stats);
+void fpga_comms_device_coalesce_stats_print(fpga_comms_handle_t comms);
+
+esp_err_t fpga_comms_device_memory_write(fpga_comms_handle_t comms, uint16_t address, const uint8_t* buffer, int length, int retry_count);
+esp_err_t fpga_comms_device_memory_write_chunked(fpga_comms_handle_t comms, uint16_t address, const uint8_t* buffer, int length, int retry_count, int* bytes_queued);
+output_trans_pool_t* fpga_comms_device_memory_write_lease(fpga_comms_handle_t comms, int retry_count);
+esp_err_t fpga_comms_device_memory_read(fpga_comms_handle_t comms, uint16_t address, uint8_t* buffer, int length, int retry_count);
+
+esp_err_t fpga_comms_device_lane_stats_get(fpga_comms_handle_t comms, fpga_comms_lane_t lane, fpga_comms_lane_stats_t* stats);
+esp_err_t fpga_comms_device_latency_get(fpga_comms_handle_t comms, fpga_comms_trans_type_t type, fpga_comms_latency_histogram_t* histogram);
+void fpga_comms_device_latency_reset(fpga_comms_handle_t comms);
+void fpga_comms_device_latency_print(fpga_comms_handle_t comms);
+
+//! @}
 
 //! @}
@@ -0,0 +1,111 @@
+#pragma once
+
+#include "fpga_loader.h"
+#include <esp_err.h>
+#include <stddef.h>
+#include <stdint.h>
+
+//! @defgroup fpga_slots FPGA bitstream slots
+//!
+//! @brief Library of named bitstreams, stored in a flash partition
+//!
+//! The partition (labelled CONFIG_FPGA_SLOTS_PARTITION_LABEL) is split into
+//! CONFIG_FPGA_SLOTS_COUNT equal slots. Each slot starts with a small header
+//! (name, version, size and SHA-256 hash), followed by the bitstream, which
+//! may be raw or compressed (see @ref fpga_loader). The slot headers form the
+//! index of the library.
+//!
+//! Bitstreams are loaded by mapping them into the address space with
+//! esp_partition_mmap(), so they don't pass through the VFS or a RAM copy.
+//!
+//! To use it, add a data partition to the partition table, for example:
+//!
+//!     fpga, data, 0x40, , 512K,
+//!
+//! @{
+
+//! Maximum length of a slot name, not including the terminator
+#define FPGA_SLOTS_NAME_MAX 31
+
+//! Size of a bitstream hash (SHA-256), in bytes
+#define FPGA_SLOTS_HASH_SIZE 32
+
+//! Slot information, see @ref fpga_slots_info_get()
+typedef struct {
+    char name[FPGA_SLOTS_NAME_MAX + 1]; //!< Name of the bitstream
+    uint32_t version; //!< Version number, as given when the bitstream was written
+    size_t size; //!< Size of the bitstream, in bytes
+    uint8_t hash[FPGA_SLOTS_HASH_SIZE]; //!< SHA-256 hash of the bitstream
+} fpga_slot_info_t;
+
+//! @brief Find the bitstream partition
+//!
+//! @return ESP_OK on success, ESP_ERR_NOT_FOUND if there is no partition
+esp_err_t fpga_slots_init();
+
+//! @brief Get the number of slots
+int fpga_slots_count();
+
+//! @brief Get the maximum bitstream size that fits in a slot
+size_t fpga_slots_size_max();
+
+//! @brief Get information about the bitstream in a slot
+//!
+//! @param[in] slot Slot index, from 0 to fpga_slots_count() - 1
+//! @param[out] info Slot information
+//! @return ESP_OK on success, ESP_ERR_NOT_FOUND if the slot is empty
+esp_err_t fpga_slots_info_get(int slot, fpga_slot_info_t* info);
+
+//! @brief Find the slot holding a bitstream
+//!
+//! If a reset left two slots with the same name, the most recently written
+//! one is returned.
+//!
+//! @param[in] name Name of the bitstream
+//! @param[out] slot Slot index
+//! @return ESP_OK on success, ESP_ERR_NOT_FOUND if there is no such bitstream
+esp_err_t fpga_slots_find(const char* name, int* slot);
+
+//! @brief Start writing a bitstream to the library
+//!
+//! The bitstream is written to an empty slot, and replaces any bitstream with
+//! the same name only once @ref fpga_slots_write_finalize() succeeds. If all
+//! slots are in use, the bitstream with the same name is overwritten in place.
+//! Only one write can be in progress at a time.
+//!
+//! @param[in] name Name of the bitstream
+//! @param[in] version Version number to store with it
+//! @param[in] size Size of the bitstream, in bytes
+//! @return ESP_OK on success, ESP_ERR_NO_MEM if there is no free slot,
+//!         ESP_ERR_INVALID_SIZE if it is too large for a slot, error otherwise
+esp_err_t fpga_slots_write_start(const char* name, uint32_t version, size_t size);
+
+//! @brief Add data to an in-progress write
+esp_err_t fpga_slots_write_chunk(const char* chunk, const int length);
+
+//! @brief Finish a write, and add the bitstream to the index
+//!
+//! @return ESP_OK on success, ESP_ERR_INVALID_SIZE if less data was written
+//!         than given to @ref fpga_slots_write_start(), error otherwise
+esp_err_t fpga_slots_write_finalize();
+
+//! @brief Abort an in-progress write. The slot is left empty.
+void fpga_slots_write_abort();
+
+//! @brief Remove a bitstream from the library
+//!
+//! @param[in] name Name of the bitstream
+//! @return ESP_OK on success, ESP_ERR_NOT_FOUND if there is no such bitstream
+esp_err_t fpga_slots_erase(const char* name);
+
+//! @brief Load a bitstream from the library into the FPGA
+//!
+//! The bitstream is checked against the SHA-256 hash in its slot header before
+//! it is loaded.
+//!
+//! @param[in] name Name of the bitstream
+//! @return ESP_OK on success, ESP_ERR_NOT_FOUND if there is no such bitstream,
+//!         ESP_ERR_INVALID_CRC if it doesn't match its hash, error code otherwise
+esp_err_t fpga_slots_load(const char* name);
+
+//! @}
@@ -1,23 +1,29 @@
 #pragma once
 
+#include <driver/spi_master.h>
 #include <esp_err.h>
 #include <freertos/FreeRTOS.h>
 #include <freertos/semphr.h>
+#include <freertos/task.h>
 
 //! @defgroup master_spi Master SPI bus
 //!
 //! @brief Utilities to share the HSPI bus between multiple threads on the ESP32.
 //!
-//! Use init() to initialize the bus and access semaphore, then wrap all SPI
-//! transactions wia call to the semaphore:
+//! Use init() to initialize the bus and access lock, then wrap all SPI
+//! transactions in calls to lock and unlock it:
 //!
-//!     SemaphoreTake(master_spi_semaphore, portMAX_DELAY);
+//!     master_spi_lock(portMAX_DELAY);
 //!     spi_device_transmit(***);
-//!     xSemaphoreGive(master_spi_semaphore);
+//!     master_spi_unlock();
+//!
+//! If CONFIG_FPGA_MASTER_SPI_LOCK_STATS is enabled, the lock records how
+//! long each task waits for it and holds it, see @ref master_spi_lock_stats_get().
 //!
 //! @{
 
-//! Master SPI semaphore. Acquire this before using the master SPI bus
+//! Master SPI semaphore. Prefer @ref master_spi_lock(), which also records
+//! the lock statistics.
 extern SemaphoreHandle_t master_spi_semaphore;
 
 //! @brief Initialize the HSPI SPI bus in master mode
@@ -25,4 +31,61 @@ extern SemaphoreHandle_t master_spi_semaphore;
 //! @return ESP_OK on success, error code otherwise
 esp_err_t master_spi_init();
 
+//! @brief Acquire the master SPI bus
+//!
+//! @param[in] timeout Maximum time to wait for the bus, in ticks
+//! @return ESP_OK on success, ESP_ERR_TIMEOUT if the bus wasn't released in time
+esp_err_t master_spi_lock(TickType_t timeout);
+
+//! @brief Release the master SPI bus
+//!
+//! Must be called by the task that called @ref master_spi_lock()
+void master_spi_unlock();
+
+//! @brief Queue several transactions, taking the bus lock once
+//!
+//! The transactions are queued back-to-back with spi_device_queue_trans(),
+//! and are not waited for. Their results must be collected as usual for the
+//! device (spi_device_get_trans_result(), or its post_cb).
+//!
+//! @param[in] device Device to send the transactions to
+//! @param[in] transactions Transactions to queue, in order
+//! @param[in] count Number of transactions
+//! @param[out] queued If not NULL, set to the number of transactions that were queued
+//! @return ESP_OK if all of the transactions were queued, error code otherwise
+esp_err_t master_spi_queue_trans_batch(spi_device_handle_t device, spi_transaction_t* const* transactions, int count, int* queued);
+
+//! Number of tasks that bus lock statistics are kept for. Further tasks are
+//! counted together in one extra entry, with a NULL task.
+#define MASTER_SPI_LOCK_OWNERS_MAX 8
+
+//! Bus lock statistics for one task
+typedef struct {
+    TaskHandle_t task; //!< Task that took the lock, or NULL for tasks past MASTER_SPI_LOCK_OWNERS_MAX
+    char name[configMAX_TASK_NAME_LEN]; //!< Name of the task when it first took the lock
+    uint32_t acquisitions; //!< Number of times the lock was taken
+    uint32_t contended; //!< Number of times the lock was held by another task, and this one had to wait
+    uint32_t wait_time_us_total; //!< Total time spent waiting for the lock
+    uint32_t wait_time_us_max; //!< Longest time spent waiting for the lock
+    uint32_t hold_time_us_total; //!< Total time the lock was held
+    uint32_t hold_time_us_max; //!< Longest time the lock was held
+} master_spi_lock_stats_t;
+
+//! @brief Get a copy of the bus lock statistics
+//!
+//! The statistics are only recorded if CONFIG_FPGA_MASTER_SPI_LOCK_STATS is
+//! enabled. Otherwise, no entries are returned.
+//!
+//! @param[out] stats Array to copy the statistics into, one entry per task
+//! @param[in] count Number of entries in the array. Up to
+//!            MASTER_SPI_LOCK_OWNERS_MAX + 1 entries are used.
+//! @return Number of entries copied
+int master_spi_lock_stats_get(master_spi_lock_stats_t* stats, int count);
+
+//! @brief Clear the bus lock statistics
+void master_spi_lock_stats_reset();
+
+//! @brief Print the bus lock statistics
+void master_spi_lock_stats_print();
+
 //! @}
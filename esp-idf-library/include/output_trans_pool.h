@@ -1,6 +1,7 @@
 #pragma once
 
 #include <driver/spi_master.h>
+#include <freertos/FreeRTOS.h>
 #include <stdbool.h>
 #include <stdint.h>
 
@@ -11,27 +12,54 @@
 //! All buffers in the pool are created with MALLOC_CAP_DMA, so that
 //! they can be used directly with the SPI DMA hardware.
 //!
+//! Free entries are kept on a singly linked free list, so that taking and
+//! releasing a buffer are constant time operations regardless of
+//! CONFIG_FPGA_SPI_BUFFER_COUNT. The list is guarded by a spinlock critical
+//! section, which makes it safe to release buffers from the SPI ISR while a
+//! task is taking them.
+//!
+//! A counting semaphore tracks the number of free entries. When the pool is
+//! exhausted, a task that is waiting for a buffer is woken directly by the
+//! release in the SPI ISR, instead of polling.
+//!
 //! @{
 
+//! Extra space allocated after each buffer. Reads start with a turnaround
+//! byte, so this allows a read of CONFIG_FPGA_SPI_BUFFER_SIZE bytes of data
+//! (rounded up to a whole number of 32-bit DMA words) to fit in one buffer.
+#define OUTPUT_TRANS_POOL_BUFFER_PADDING 4
+
+//! Wait time represented by one retry in @ref output_trans_pool_take()
 #define POLLING_DELAY_MS 10
 
+struct fpga_comms_t;
+
 //! Output transaction pool entry
 //!
 //! Note: Buffers must be allocated at runtime, so they can be aligned for DMA transactions
-typedef struct {
+typedef struct output_trans_pool_t {
+    struct output_trans_pool_t* next; //!< Next entry in the free list (only valid while not in use)
     bool in_use; //!< True if the buffer is in use
     spi_transaction_t transaction; //!< Type of transaction stored in this buffer
-    uint8_t* buffer; //!< Buffer allocated to this entry. The buffer is owned by the
+    void* ctx; //!< Context for the owner of the transaction, for use on completion
+    struct fpga_comms_t* owner; //!< fpga_comms instance that the transaction is sent to
+    uint32_t queue_time_us; //!< Time the transaction was queued, for latency statistics
+    uint8_t* buffer; //!< Buffer allocated to this entry, CONFIG_FPGA_SPI_BUFFER_SIZE bytes
+        //!< plus OUTPUT_TRANS_POOL_BUFFER_PADDING. The buffer is owned by the
         //!< transaction pool, and should not be freed by the user.
 } output_trans_pool_t;
 
 //! Output transaction pool statistics
 typedef struct {
     uint32_t requests; //!< Number of times a buffer has been requested
-    uint32_t retries; //!< Number of times that a buffer wasn't available, and a retry was needed
+    uint32_t retries; //!< Number of times that a buffer wasn't available, and the caller had to wait
     uint32_t failures; //!< Number of times that a buffer failed to be allocated
     uint32_t double_releases; //!< Number of times that a buffer was released when it wasn't in use
     uint32_t unowned_releases; //!< Number of requests to free a buffer not owned by the pool
+    uint32_t wait_time_us_total; //!< Total time spent waiting for a buffer to become available
+    uint32_t wait_time_us_max; //!< Longest time spent waiting for a buffer to become available
+    uint32_t wake_latency_us_total; //!< Total time from the release that refilled the empty pool to a waiting task resuming
+    uint32_t wake_latency_us_max; //!< Longest time from the release that refilled the empty pool to a waiting task resuming
 } output_trans_pool_stats_t;
 
 extern output_trans_pool_stats_t output_trans_pool_stats;
@@ -42,11 +70,26 @@ void output_trans_pool_init();
 //! @brief Print output buffer pool statistics
 void output_trans_pool_stats_print();
 
+//! @brief Take a buffer from the pool, waiting for one to be released if necessary
+//!
+//! This may block, and must not be called from an interrupt context
+//!
+//! @param[in] timeout Maximum time to wait for a buffer, in ticks. Use 0 to
+//!            return immediately, or portMAX_DELAY to wait forever.
+//! @return Pointer to a buffer pool object if successful, NULL if unsuccessful. Pointers
+//!         are owned by the buffer pool, and must not be freed. To release a buffer,
+//!         pass it in a call to @ref output_trans_pool_release().
+output_trans_pool_t* output_trans_pool_take_wait(TickType_t timeout);
+
 //! @brief Take a buffer from the pool
 //!
-//! This uses vTaskDelay() and not be called from an interrupt context
+//! Equivalent to @ref output_trans_pool_take_wait() with a timeout of
+//! retry_count polling intervals. The caller is woken as soon as a buffer is
+//! released, rather than at the end of the polling interval.
+//!
+//! This may block, and must not be called from an interrupt context
 //!
-//! @param[in] retry_count Number of times to try (with polling delay) before giving up
+//! @param[in] retry_count Number of polling intervals to wait before giving up
 //! @return Pointer to a buffer pool object if successful, NULL if unsuccessful. Pointers
 //!         are owned by the buffer pool, and must not be freed. To release a buffer,
 //!         pass it in a call to @ref output_trans_pool_release().
@@ -1,4 +1,8 @@
 #include "fpga.h"
+#include <esp_log.h>
+#include <esp_timer.h>
+
+static const char* TAG = "fpga";
 
 esp_err_t fpga_start(const fpga_bin_t* fpga_bin)
 {
@@ -7,5 +11,8 @@ esp_err_t fpga_start(const fpga_bin_t* fpga_bin)
     fpga_loader_init();
     fpga_loader_load_from_rom(fpga_bin);
 
+    // Time since boot, to track how long the FPGA takes to come up
+    ESP_LOGI(TAG, "FPGA started, us since boot:%lli", esp_timer_get_time());
+
     return ESP_OK;
 }
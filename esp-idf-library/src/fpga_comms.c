@@ -1,15 +1,19 @@
+#include "fpga_comms.h"
 #include "fpga_loader.h"
 #include "master_spi.h"
 #include "output_trans_pool.h"
 #include <driver/spi_master.h>
 #include <esp_log.h>
+#include <esp_timer.h>
 #include <freertos/FreeRTOS.h>
-#include <freertos/queue.h>
 #include <freertos/semphr.h>
 #include <freertos/task.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
-//#define COMMAND_READ_MEM 0b00000000
+#define COMMAND_READ_MEM 0b00000000
 #define COMMAND_WRITE_MEM 0b00000001
 
 #define COMMAND_READ_REG 0b00000010
@@ -17,28 +21,429 @@
 
 static const char TAG[] = "fpga_comms";
 
-static spi_device_handle_t fpga_comm_device = NULL;
+//! Maximum number of register reads queued by fpga_comms_register_read_batch()
+#define REGISTER_READ_BATCH_MAX 8
 
-SemaphoreHandle_t register_read_semaphore = NULL;
-static QueueHandle_t register_read_queue = NULL;
+//! Timeout for synchronous register reads
+#define REGISTER_READ_TIMEOUT_MS 100
+
+//! Number of data bytes in a register transfer
+#define REGISTER_DATA_BYTES 2
+
+//! Largest transfer that fits in the spi_transaction_t tx_data/rx_data fields
+#define POLLING_THRESHOLD_MAX 4
+
+//! Pool entries reserved for register transactions. The bulk slots of all
+//! instances together can use only the rest of CONFIG_FPGA_SPI_BUFFER_COUNT,
+//! so memory transactions can never hold every entry.
+#define CONTROL_SLOTS_RESERVED 1
+
+#if CONFIG_FPGA_COMMS_BULK_MAX_QUEUED > (CONFIG_FPGA_SPI_BUFFER_COUNT - CONTROL_SLOTS_RESERVED)
+#error "FPGA_COMMS_BULK_MAX_QUEUED must be less than FPGA_SPI_BUFFER_COUNT"
+#endif
+
+//! Maximum number of transactions that register_write_batch() queues with one
+//! master_spi_queue_trans_batch() call. Their pool entries are taken before
+//! the bus lock.
+#define REGISTER_WRITE_QUEUE_MAX 4
+
+//! Maximum number of register ranges passed to fpga_comms_register_cache_configure()
+#define REGISTER_CACHE_RANGES_MAX 4
+
+//! Maximum number of registers written by each batch in fpga_comms_register_flush()
+#define REGISTER_FLUSH_BATCH_MAX 16
+
+//! Range of registers with a shadow copy
+typedef struct {
+    uint16_t address; //!< First register address in the range
+    uint16_t count; //!< Number of registers in the range
+    fpga_comms_register_policy_t policy; //!< Caching policy for the range
+    uint16_t offset; //!< Index of the first register in the cache arrays
+} register_cache_range_t;
+
+//! Driver state for one FPGA
+struct fpga_comms_t {
+    spi_device_handle_t spi_device; //!< SPI device for the FPGA chip select
+
+    SemaphoreHandle_t memory_read_semaphore; //!< Allows one memory read at a time
+    SemaphoreHandle_t memory_read_done; //!< Given on completion of a memory read
+
+#ifdef CONFIG_FPGA_COMMS_COMPLETION_REAPER
+    TaskHandle_t reaper_task; //!< Collects finished transactions from the SPI driver
+    volatile bool reaper_stop; //!< Set by fpga_comms_delete() to stop the reaper
+    SemaphoreHandle_t reaper_stopped; //!< Given by the reaper once it has drained the queue
+#endif
+
+    //! Limits the number of memory transactions in the SPI queue, so that the
+    //! remaining pool entries are kept for register transactions.
+    SemaphoreHandle_t bulk_slots;
+    int bulk_max_queued; //!< Initial count of bulk_slots
+
+    int polling_threshold; //!< Largest register transfer to send by polling, in data bytes
+
+    //! Guards the link between a read transaction and the task waiting for it
+    portMUX_TYPE read_lock;
+
+    portMUX_TYPE lane_lock; //!< Guards lane_stats
+    fpga_comms_lane_stats_t lane_stats[FPGA_COMMS_LANE_COUNT]; //!< Guarded by lane_lock
+
+#ifdef CONFIG_FPGA_COMMS_LATENCY_STATS
+    portMUX_TYPE latency_lock; //!< Guards latency_histograms
+    //! Latency histograms, indexed by fpga_comms_trans_type_t. Guarded by
+    //! latency_lock, since samples are recorded from the SPI ISR or the
+    //! reaper task.
+    fpga_comms_latency_histogram_t latency_histograms[FPGA_COMMS_TRANS_TYPE_COUNT];
+#endif
+
+    // Register cache, guarded by register_cache_lock
+    portMUX_TYPE register_cache_lock;
+    register_cache_range_t register_cache_ranges[REGISTER_CACHE_RANGES_MAX];
+    int register_cache_range_count;
+    uint16_t register_cache_values[CONFIG_FPGA_COMMS_REGISTER_CACHE_SIZE];
+    bool register_cache_valid[CONFIG_FPGA_COMMS_REGISTER_CACHE_SIZE];
+    //! Values staged by fpga_comms_register_write_deferred(), valid when the register is dirty
+    uint16_t register_cache_pending[CONFIG_FPGA_COMMS_REGISTER_CACHE_SIZE];
+    bool register_cache_dirty[CONFIG_FPGA_COMMS_REGISTER_CACHE_SIZE];
+    int register_cache_used;
+
+    fpga_comms_coalesce_stats_t coalesce_stats; //!< Guarded by register_cache_lock
+};
+
+//! Instance used by the fpga_comms_*() functions without a handle
+static fpga_comms_handle_t default_comms = NULL;
+
+//! Number of pool entries reserved for memory transactions, across all instances
+static int bulk_slots_total = 0;
+
+static bool output_trans_pool_ready = false;
+
+//! @brief Find the lane of a transaction, from its command
+static inline fpga_comms_lane_t IRAM_ATTR trans_lane(const spi_transaction_t* spi_transaction)
+{
+    switch (spi_transaction->cmd) {
+    case COMMAND_WRITE_REG:
+    case COMMAND_READ_REG:
+        return FPGA_COMMS_LANE_CONTROL;
+    default:
+        return FPGA_COMMS_LANE_BULK;
+    }
+}
+
+//! @brief Count a pool entry as queued, just before it is queued
+//!
+//! The completion can run as soon as the transaction is queued, so this must
+//! come first. Undo it with trans_queue_undo() if the queueing fails.
+static void IRAM_ATTR trans_queue_begin(output_trans_pool_t* output_trans_pool)
+{
+    fpga_comms_handle_t comms = output_trans_pool->owner;
+    fpga_comms_lane_stats_t* stats = &comms->lane_stats[trans_lane(&output_trans_pool->transaction)];
+
+#ifdef CONFIG_FPGA_COMMS_LATENCY_STATS
+    output_trans_pool->queue_time_us = (uint32_t)esp_timer_get_time();
+#endif
+
+    portENTER_CRITICAL(&comms->lane_lock);
+    stats->queued++;
+    if (stats->queued > stats->queued_max)
+        stats->queued_max = stats->queued;
+    portEXIT_CRITICAL(&comms->lane_lock);
+}
+
+//! @brief Undo trans_queue_begin() for a pool entry that wasn't queued
+static void IRAM_ATTR trans_queue_undo(output_trans_pool_t* output_trans_pool)
+{
+    fpga_comms_handle_t comms = output_trans_pool->owner;
+    fpga_comms_lane_stats_t* stats = &comms->lane_stats[trans_lane(&output_trans_pool->transaction)];
+
+    portENTER_CRITICAL(&comms->lane_lock);
+    stats->queued--;
+    portEXIT_CRITICAL(&comms->lane_lock);
+}
+
+//! @brief Queue the transaction in a pool entry
+//!
+//! The caller must hold the master SPI bus lock, and is responsible for
+//! releasing the entry on failure.
+static esp_err_t IRAM_ATTR trans_queue(output_trans_pool_t* output_trans_pool)
+{
+    fpga_comms_handle_t comms = output_trans_pool->owner;
+
+    trans_queue_begin(output_trans_pool);
+
+    const esp_err_t ret = spi_device_queue_trans(comms->spi_device, &output_trans_pool->transaction, 0);
+
+    if (ret != ESP_OK) {
+        trans_queue_undo(output_trans_pool);
+    }
+
+    return ret;
+}
+
+//! @brief Take a pool entry for a register transaction
+static output_trans_pool_t* IRAM_ATTR control_take(fpga_comms_handle_t comms, int retry_count)
+{
+    output_trans_pool_t* output_trans_pool = output_trans_pool_take(retry_count);
+    if (output_trans_pool != NULL) {
+        output_trans_pool->owner = comms;
+    }
+
+    return output_trans_pool;
+}
+
+//! @brief Take a pool entry for a memory transaction
+//!
+//! Waits for a bulk slot first, then for the pool entry.
+static output_trans_pool_t* IRAM_ATTR bulk_take(fpga_comms_handle_t comms, int retry_count)
+{
+    if (xSemaphoreTake(comms->bulk_slots, pdMS_TO_TICKS(retry_count * POLLING_DELAY_MS)) != pdTRUE) {
+        return NULL;
+    }
+
+    output_trans_pool_t* output_trans_pool = control_take(comms, retry_count);
+    if (output_trans_pool == NULL) {
+        xSemaphoreGive(comms->bulk_slots);
+    }
+
+    return output_trans_pool;
+}
+
+//! @brief Return a pool entry taken with bulk_take(), without sending it
+static void IRAM_ATTR bulk_release(output_trans_pool_t* output_trans_pool)
+{
+    fpga_comms_handle_t comms = output_trans_pool->owner;
+
+    output_trans_pool_release(output_trans_pool);
+    xSemaphoreGive(comms->bulk_slots);
+}
+
+#ifdef CONFIG_FPGA_COMMS_LATENCY_STATS
+//! @brief Find the log2 histogram bucket for a latency
+static inline int IRAM_ATTR latency_bucket(uint32_t time_us)
+{
+    if (time_us == 0)
+        return 0;
+
+    const int bucket = 32 - __builtin_clz(time_us);
+    return (bucket < FPGA_COMMS_LATENCY_BUCKETS) ? bucket : (FPGA_COMMS_LATENCY_BUCKETS - 1);
+}
+
+//! @brief Find the histogram for a transaction, from its command
+static inline fpga_comms_latency_histogram_t* IRAM_ATTR latency_histogram(const spi_transaction_t* spi_transaction)
+{
+    const output_trans_pool_t* output_trans_pool = spi_transaction->user;
+    fpga_comms_latency_histogram_t* latency_histograms = output_trans_pool->owner->latency_histograms;
+
+    switch (spi_transaction->cmd) {
+    case COMMAND_WRITE_REG:
+        return &latency_histograms[FPGA_COMMS_TRANS_REGISTER_WRITE];
+    case COMMAND_READ_REG:
+        return &latency_histograms[FPGA_COMMS_TRANS_REGISTER_READ];
+    case COMMAND_WRITE_MEM:
+        return &latency_histograms[FPGA_COMMS_TRANS_MEMORY_WRITE];
+    case COMMAND_READ_MEM:
+    default:
+        return &latency_histograms[FPGA_COMMS_TRANS_MEMORY_READ];
+    }
+}
+
+//! @brief Record the time a transaction spent in the queue
+//!
+//! Called from the SPI ISR, just before the transaction starts on the bus.
+static void IRAM_ATTR trans_start_callback(spi_transaction_t* spi_transaction)
+{
+    // Polled transfers don't have a pool entry
+    if (spi_transaction->user == NULL)
+        return;
+
+    const output_trans_pool_t* output_trans_pool = spi_transaction->user;
+    fpga_comms_handle_t comms = output_trans_pool->owner;
+    const uint32_t queued_us = (uint32_t)esp_timer_get_time() - output_trans_pool->queue_time_us;
+
+    portENTER_CRITICAL_ISR(&comms->latency_lock);
+    latency_histogram(spi_transaction)->queued[latency_bucket(queued_us)]++;
+    portEXIT_CRITICAL_ISR(&comms->latency_lock);
+}
+
+//! @brief Record the total time a transaction took
+//!
+//! Called from trans_complete(), when the transaction has finished.
+static inline void IRAM_ATTR trans_record_done(spi_transaction_t* spi_transaction)
+{
+    const output_trans_pool_t* output_trans_pool = spi_transaction->user;
+    fpga_comms_handle_t comms = output_trans_pool->owner;
+    const uint32_t total_us = (uint32_t)esp_timer_get_time() - output_trans_pool->queue_time_us;
+
+    fpga_comms_latency_histogram_t* histogram = latency_histogram(spi_transaction);
+
+    portENTER_CRITICAL_SAFE(&comms->latency_lock);
+    histogram->count++;
+    histogram->total[latency_bucket(total_us)]++;
+    if (total_us > histogram->total_us_max)
+        histogram->total_us_max = total_us;
+    portEXIT_CRITICAL_SAFE(&comms->latency_lock);
+}
+#endif
+
+//! @brief Find the shadow copy of a register
+//!
+//! Must be called with register_cache_lock held.
+//!
+//! @param[in] address Register address
+//! @param[out] policy Caching policy of the register
+//! @return Index into the cache arrays, or -1 if the register is not cached
+static int register_cache_find(fpga_comms_handle_t comms, uint16_t address, fpga_comms_register_policy_t* policy)
+{
+    for (int i = 0; i < comms->register_cache_range_count; i++) {
+        const register_cache_range_t* range = &comms->register_cache_ranges[i];
+        if ((address >= range->address) && (address - range->address < range->count)) {
+            *policy = range->policy;
+            return range->offset + (address - range->address);
+        }
+    }
+
+    *policy = FPGA_COMMS_REGISTER_VOLATILE;
+    return -1;
+}
+
+//! @brief Read a register from its shadow copy
+//!
+//! @param[in] address Register address
+//! @param[out] value Value of the register
+//! @return ESP_OK if the value was read from the shadow copy, ESP_ERR_NOT_FOUND if
+//!         it must be read from the FPGA, or ESP_ERR_INVALID_STATE if it is a
+//!         write-only register that hasn't been written yet.
+static esp_err_t register_cache_load(fpga_comms_handle_t comms, uint16_t address, uint16_t* value)
+{
+    esp_err_t ret = ESP_ERR_NOT_FOUND;
+    fpga_comms_register_policy_t policy;
+
+    portENTER_CRITICAL(&comms->register_cache_lock);
+    const int index = register_cache_find(comms, address, &policy);
+    if (index >= 0) {
+        if (comms->register_cache_valid[index]) {
+            *value = comms->register_cache_values[index];
+            ret = ESP_OK;
+        } else if (policy == FPGA_COMMS_REGISTER_WRITE_ONLY) {
+            ret = ESP_ERR_INVALID_STATE;
+        }
+    }
+    portEXIT_CRITICAL(&comms->register_cache_lock);
+
+    if (ret == ESP_ERR_INVALID_STATE) {
+        ESP_LOGE(TAG, "Write-only register has no value, address:0x%04x", address);
+    }
+
+    return ret;
+}
+
+//! @brief Update the shadow copy of a register after it was written
+//!
+//! @param[in] supersede If true, drop any write staged for the register, so
+//!            that a later flush can't overwrite this value with an older one.
+//!            The flush passes false, as it unstages the registers itself and
+//!            a write staged while it runs must not be lost.
+static void register_cache_store(fpga_comms_handle_t comms, uint16_t address, uint16_t value, bool supersede)
+{
+    fpga_comms_register_policy_t policy;
+
+    portENTER_CRITICAL(&comms->register_cache_lock);
+    const int index = register_cache_find(comms, address, &policy);
+    if (index >= 0) {
+        comms->register_cache_values[index] = value;
+        comms->register_cache_valid[index] = true;
+        if (supersede) {
+            comms->register_cache_dirty[index] = false;
+        }
+    }
+    portEXIT_CRITICAL(&comms->register_cache_lock);
+}
+
+//! @brief Fill the shadow copy of a register after it was read
+//!
+//! If the register was written while the read was in flight, the shadow copy
+//! is already valid and is left alone.
+static void register_cache_fill(fpga_comms_handle_t comms, uint16_t address, uint16_t value)
+{
+    fpga_comms_register_policy_t policy;
+
+    portENTER_CRITICAL(&comms->register_cache_lock);
+    const int index = register_cache_find(comms, address, &policy);
+    if ((index >= 0) && (policy == FPGA_COMMS_REGISTER_CACHED) && !comms->register_cache_valid[index]) {
+        comms->register_cache_values[index] = value;
+        comms->register_cache_valid[index] = true;
+    }
+    portEXIT_CRITICAL(&comms->register_cache_lock);
+}
+
+//! @brief Give a semaphore from trans_complete()
+//!
+//! trans_complete() runs in the SPI ISR or in the reaper task, and the
+//! FromISR call must only be used from the former.
+static void IRAM_ATTR trans_semaphore_give(SemaphoreHandle_t semaphore, BaseType_t* xHigherPriorityTaskWoken)
+{
+    if (xPortInIsrContext()) {
+        xSemaphoreGiveFromISR(semaphore, xHigherPriorityTaskWoken);
+    } else {
+        xSemaphoreGive(semaphore);
+    }
+}
 
 //! @brief Handle a finished SPI transaction
 //!
 //! The vanilla ESP-IDF SPI driver places all finished SPI transactions into a
 //! queue, which requires a separate task to clean them up. Our patched
 //! version implements a callback (in the interrupt context), which can be
-//! used to clean up the transactions resources immediately.
+//! used to clean up the transactions resources immediately. With
+//! CONFIG_FPGA_COMMS_COMPLETION_REAPER, the vanilla driver is used instead,
+//! and this is called from the reaper task. The critical sections and
+//! semaphore gives used here work from both contexts.
 //!
 //! In the fpga comms driver, all transactions are performed using memory from
 //! the output_trans_pool. For TX-only transactions (memory_write and
 //! register_write), no completion conformation is needed, so the callback can
-//! directly release the buffer. For RX transactions (register_read), the
-//! return value should be stored in a response queue before releasing the
-//! buffer. If a read_buffer() command is implemented, this method would need
-//! to be extended to handle that case.
-static void IRAM_ATTR trans_done_callback(spi_transaction_t* spi_transaction)
+//! directly release the buffer. For register reads, the value is stored in the
+//! read request attached to the transaction, and the requester is notified
+//! before releasing the buffer. For memory_read, the data is still in the buffer, so the reading
+//! task is signalled and releases the buffer after copying the data out. If
+//! the reader has given up waiting, the buffer is released here instead.
+//!
+//! @param[in] spi_transaction Finished transaction
+//! @param[out] xHigherPriorityTaskWoken Set to pdTRUE if a higher priority task was woken
+static void IRAM_ATTR trans_complete(spi_transaction_t* spi_transaction, BaseType_t* xHigherPriorityTaskWoken)
 {
-    BaseType_t xHigherPriorityTaskWoken = pdFALSE;
+    // Polled transfers are completed by the sending task
+    if (spi_transaction->user == NULL)
+        return;
+
+#ifdef CONFIG_FPGA_COMMS_LATENCY_STATS
+    trans_record_done(spi_transaction);
+#endif
+
+    fpga_comms_handle_t comms = ((output_trans_pool_t*)spi_transaction->user)->owner;
+    const fpga_comms_lane_t lane = trans_lane(spi_transaction);
+
+    portENTER_CRITICAL_SAFE(&comms->lane_lock);
+    comms->lane_stats[lane].queued--;
+    portEXIT_CRITICAL_SAFE(&comms->lane_lock);
+
+    if ((spi_transaction->rxlength > 0) && (spi_transaction->cmd == COMMAND_READ_MEM)) {
+        output_trans_pool_t* output_trans_pool = spi_transaction->user;
+
+        portENTER_CRITICAL_SAFE(&comms->read_lock);
+        const bool waiting = (output_trans_pool->ctx != NULL);
+        output_trans_pool->ctx = NULL;
+        portEXIT_CRITICAL_SAFE(&comms->read_lock);
+
+        if (waiting) {
+            trans_semaphore_give(comms->memory_read_done, xHigherPriorityTaskWoken);
+            return;
+        }
+
+        // The reader gave up waiting, so the entry is released here instead
+        output_trans_pool_release(output_trans_pool);
+        trans_semaphore_give(comms->bulk_slots, xHigherPriorityTaskWoken);
+        return;
+    }
 
     if (spi_transaction->rxlength > 0) {
         // Notes:
@@ -47,118 +452,248 @@ static void IRAM_ATTR trans_done_callback(spi_transaction_t* spi_transaction)
         const uint32_t value = *((uint32_t*)(spi_transaction->rx_buffer));
         const uint16_t value_shifted = ((value >> 16) & 0xFF) | (value & 0xFF00);
 
-        xQueueSendFromISR(
-            register_read_queue,
-            &value_shifted,
-            &xHigherPriorityTaskWoken);
+        output_trans_pool_t* output_trans_pool = spi_transaction->user;
+
+        portENTER_CRITICAL_SAFE(&comms->read_lock);
+        fpga_comms_read_request_t* request = output_trans_pool->ctx;
+        output_trans_pool->ctx = NULL;
+        portEXIT_CRITICAL_SAFE(&comms->read_lock);
+
+        // The request is NULL if the reader gave up waiting
+        if (request != NULL) {
+            request->value = value_shifted;
+            request->done = true;
+
+            if (request->callback != NULL)
+                request->callback(request);
+
+            trans_semaphore_give(request->done_semaphore, xHigherPriorityTaskWoken);
+        }
     }
 
     output_trans_pool_release(spi_transaction->user);
 
+    if (lane == FPGA_COMMS_LANE_BULK)
+        trans_semaphore_give(comms->bulk_slots, xHigherPriorityTaskWoken);
+}
+
+#ifdef CONFIG_FPGA_COMMS_COMPLETION_ISR
+//! @brief SPI post-transaction callback, called from the SPI ISR
+static void IRAM_ATTR trans_done_callback(spi_transaction_t* spi_transaction)
+{
+    BaseType_t xHigherPriorityTaskWoken = pdFALSE;
+
+    trans_complete(spi_transaction, &xHigherPriorityTaskWoken);
+
     if (xHigherPriorityTaskWoken)
         portYIELD_FROM_ISR();
 }
+#else
+//! Maximum number of transactions completed by the reaper before it checks
+//! for new ones again
+#define REAPER_BATCH_MAX CONFIG_FPGA_SPI_BUFFER_COUNT
+
+//! Longest time the reaper waits for a transaction before checking whether
+//! it has been asked to stop
+#define REAPER_STOP_POLL_MS 10
 
-esp_err_t IRAM_ATTR fpga_comms_memory_write(uint16_t address, const uint8_t* buffer, int length, int retry_count)
+//! @brief Check whether the instance has transactions in the SPI queue
+static bool reaper_idle(fpga_comms_handle_t comms)
 {
-    if (fpga_comm_device == NULL) {
-        ESP_LOGE(TAG, "fpga_driver not initialized, aborting");
-        return ESP_FAIL;
+    bool idle = true;
+
+    portENTER_CRITICAL(&comms->lane_lock);
+    for (int lane = 0; lane < FPGA_COMMS_LANE_COUNT; lane++) {
+        if (comms->lane_stats[lane].queued > 0)
+            idle = false;
     }
+    portEXIT_CRITICAL(&comms->lane_lock);
 
-    if (length <= 0) {
-        ESP_LOGE(TAG, "Data length 0");
-        return ESP_FAIL;
+    return idle;
+}
+
+//! @brief Collect finished transactions from the SPI driver, and complete them
+//!
+//! Waits for one transaction, then drains any others that have finished
+//! without waiting, so a burst of completions costs one wakeup. The reaper
+//! runs at a high priority, so tasks woken by the completions run once it
+//! blocks again.
+//!
+//! Once reaper_stop is set, it keeps completing transactions until none are
+//! left in the queue, then gives reaper_stopped and waits to be deleted.
+static void reaper_task(void* param)
+{
+    fpga_comms_handle_t comms = param;
+
+    while (true) {
+        if (comms->reaper_stop && reaper_idle(comms)) {
+            xSemaphoreGive(comms->reaper_stopped);
+            vTaskSuspend(NULL);
+        }
+
+        spi_transaction_t* spi_transaction;
+        if (spi_device_get_trans_result(comms->spi_device, &spi_transaction, pdMS_TO_TICKS(REAPER_STOP_POLL_MS)) != ESP_OK)
+            continue;
+
+        int reaped = 0;
+        do {
+            BaseType_t xHigherPriorityTaskWoken = pdFALSE;
+            trans_complete(spi_transaction, &xHigherPriorityTaskWoken);
+            reaped++;
+        } while ((reaped < REAPER_BATCH_MAX)
+            && (spi_device_get_trans_result(comms->spi_device, &spi_transaction, 0) == ESP_OK));
     }
+}
+#endif
 
-    if (length > CONFIG_FPGA_SPI_BUFFER_SIZE) {
-        ESP_LOGE(TAG, "Data length too large, discarding. address:%i buffer:%p length:%i",
-            address, buffer, length);
-        return ESP_FAIL;
+output_trans_pool_t* IRAM_ATTR fpga_comms_device_memory_write_lease(fpga_comms_handle_t comms, int retry_count)
+{
+    if (comms == NULL) {
+        ESP_LOGE(TAG, "fpga_driver not initialized, aborting");
+        return NULL;
     }
 
-    output_trans_pool_t* output_trans_pool = output_trans_pool_take(retry_count);
+    output_trans_pool_t* output_trans_pool = bulk_take(comms, retry_count);
     if (output_trans_pool == NULL) {
         ESP_LOGE(TAG, "Could not allocate buffer for SPI transaction");
-        return ESP_FAIL;
+        return NULL;
     }
 
-    uint8_t* dma_buffer = output_trans_pool->buffer;
-    spi_transaction_t* spi_transaction = &output_trans_pool->transaction;
+    return output_trans_pool;
+}
 
-    memcpy(dma_buffer, buffer, length);
+//! @brief Queue a memory write transaction for a leased buffer
+//!
+//! The caller must hold the master SPI bus lock. On failure, the lease is released.
+static esp_err_t IRAM_ATTR memory_write_queue(output_trans_pool_t* lease, uint16_t address, int length)
+{
+    spi_transaction_t* spi_transaction = &lease->transaction;
 
     const uint16_t word_address = address >> 1;
     const uint16_t word_length = length >> 1;
 
     memset(spi_transaction, 0, sizeof(*spi_transaction));
     spi_transaction->length = word_length * 16;
-    spi_transaction->tx_buffer = dma_buffer;
+    spi_transaction->tx_buffer = lease->buffer;
     spi_transaction->addr = word_address;
     spi_transaction->cmd = COMMAND_WRITE_MEM;
-    spi_transaction->user = (void*)output_trans_pool;
+    spi_transaction->user = (void*)lease;
 
-    xSemaphoreTake(master_spi_semaphore, portMAX_DELAY);
-    esp_err_t ret = spi_device_queue_trans(fpga_comm_device, spi_transaction, 0);
-    xSemaphoreGive(master_spi_semaphore);
+    esp_err_t ret = trans_queue(lease);
 
     if (ret != ESP_OK) {
         ESP_LOGE(TAG, "Error queueing transaction, error:%s", esp_err_to_name(ret));
-        output_trans_pool_release(output_trans_pool);
+        bulk_release(lease);
+    }
+
+    return ret;
+}
+
+esp_err_t IRAM_ATTR fpga_comms_memory_write_submit(output_trans_pool_t* lease, uint16_t address, int length)
+{
+    if (lease == NULL) {
+        return ESP_FAIL;
+    }
+
+    if ((length <= 0) || (length > CONFIG_FPGA_SPI_BUFFER_SIZE)) {
+        ESP_LOGE(TAG, "Invalid data length, discarding. address:%i length:%i",
+            address, length);
+        bulk_release(lease);
+        return ESP_FAIL;
     }
 
+    master_spi_lock(portMAX_DELAY);
+    esp_err_t ret = memory_write_queue(lease, address, length);
+    master_spi_unlock();
+
     return ret;
 }
 
-esp_err_t IRAM_ATTR fpga_comms_memory_read(uint16_t address, uint8_t* buffer, int length, int retry_count) {
-    ESP_LOGE(TAG, "memory read not implemented");
-    return ESP_FAIL;
+void IRAM_ATTR fpga_comms_memory_write_cancel(output_trans_pool_t* lease)
+{
+    bulk_release(lease);
 }
 
-esp_err_t IRAM_ATTR fpga_comms_register_write(uint16_t address, uint16_t data)
+esp_err_t IRAM_ATTR fpga_comms_device_memory_write_chunked(fpga_comms_handle_t comms, uint16_t address, const uint8_t* buffer, int length, int retry_count, int* bytes_queued)
 {
-    if (fpga_comm_device == NULL) {
+    if (bytes_queued != NULL) {
+        *bytes_queued = 0;
+    }
+
+    if (comms == NULL) {
         ESP_LOGE(TAG, "fpga_driver not initialized, aborting");
         return ESP_FAIL;
     }
 
-    output_trans_pool_t* output_trans_pool = output_trans_pool_take(5);
-    if (output_trans_pool == NULL) {
-        ESP_LOGE(TAG, "Could not allocate buffer for SPI transaction");
+    if ((buffer == NULL) || (length <= 0)) {
+        ESP_LOGE(TAG, "Data length 0");
         return ESP_FAIL;
     }
-    spi_transaction_t* spi_transaction = &output_trans_pool->transaction;
 
-    memset(spi_transaction, 0, sizeof(*spi_transaction));
-    spi_transaction->flags = SPI_TRANS_USE_TXDATA;
-    spi_transaction->length = 16;
-    spi_transaction->tx_data[0] = (data >> 8) & 0xFF;
-    spi_transaction->tx_data[1] = (data)&0xFF;
-    spi_transaction->addr = address;
-    spi_transaction->cmd = COMMAND_WRITE_REG;
-    spi_transaction->user = (void*)output_trans_pool;
+    if (length > 0x10000 - address) {
+        ESP_LOGE(TAG, "Data length too large, discarding. address:%i buffer:%p length:%i",
+            address, buffer, length);
+        return ESP_FAIL;
+    }
 
-    xSemaphoreTake(master_spi_semaphore, portMAX_DELAY);
-    esp_err_t ret = spi_device_queue_trans(fpga_comm_device, spi_transaction, 0);
-    xSemaphoreGive(master_spi_semaphore);
+    esp_err_t ret = ESP_OK;
+    int offset = 0;
 
-    if (ret != ESP_OK) {
-        ESP_LOGE(TAG, "Error queuing transaction, error:%s", esp_err_to_name(ret));
-        output_trans_pool_release(output_trans_pool);
+    // The chunks are queued back-to-back, so the SPI DMA moves straight from
+    // one chunk to the next. The bus lock is only held while queueing each
+    // chunk, so that register transactions can be queued in between while
+    // this waits for a bulk slot.
+    while (offset < length) {
+        int chunk_length = length - offset;
+        if (chunk_length > CONFIG_FPGA_SPI_BUFFER_SIZE)
+            chunk_length = CONFIG_FPGA_SPI_BUFFER_SIZE;
+
+        output_trans_pool_t* lease = bulk_take(comms, retry_count);
+        if (lease == NULL) {
+            ESP_LOGE(TAG, "Could not allocate buffer for SPI transaction, offset:%i length:%i",
+                offset, length);
+            ret = ESP_FAIL;
+            break;
+        }
+
+        memcpy(lease->buffer, buffer + offset, chunk_length);
+
+        master_spi_lock(portMAX_DELAY);
+        ret = memory_write_queue(lease, address + offset, chunk_length);
+        master_spi_unlock();
+
+        if (ret != ESP_OK)
+            break;
+
+        offset += chunk_length;
+    }
+
+    if (bytes_queued != NULL) {
+        *bytes_queued = offset;
     }
 
     return ret;
 }
 
-esp_err_t IRAM_ATTR fpga_comms_register_read(uint16_t address, uint16_t* data)
+esp_err_t IRAM_ATTR fpga_comms_device_memory_write(fpga_comms_handle_t comms, uint16_t address, const uint8_t* buffer, int length, int retry_count)
 {
+    return fpga_comms_device_memory_write_chunked(comms, address, buffer, length, retry_count, NULL);
+}
 
-    if (fpga_comm_device == NULL) {
+esp_err_t IRAM_ATTR fpga_comms_device_memory_read(fpga_comms_handle_t comms, uint16_t address, uint8_t* buffer, int length, int retry_count)
+{
+    if (comms == NULL) {
         ESP_LOGE(TAG, "fpga_driver not initialized, aborting");
         return ESP_FAIL;
     }
 
-    output_trans_pool_t* output_trans_pool = output_trans_pool_take(5);
+    if ((buffer == NULL) || (length <= 0) || (length > CONFIG_FPGA_SPI_BUFFER_SIZE)) {
+        ESP_LOGE(TAG, "Invalid read, address:%i buffer:%p length:%i",
+            address, buffer, length);
+        return ESP_FAIL;
+    }
+
+    output_trans_pool_t* output_trans_pool = bulk_take(comms, retry_count);
     if (output_trans_pool == NULL) {
         ESP_LOGE(TAG, "Could not allocate buffer for SPI transaction");
         return ESP_FAIL;
@@ -166,88 +701,1130 @@ esp_err_t IRAM_ATTR fpga_comms_register_read(uint16_t address, uint16_t* data)
 
     spi_transaction_t* spi_transaction = &output_trans_pool->transaction;
 
-    // TODO: We don't need to clear this?
-    memset(output_trans_pool->buffer, 0, 8);
+    // The FPGA sends 8 turnaround bits, followed by the data words MSB first.
+    // Round the receive length up to a whole number of 32-bit words, so that
+    // the DMA can write directly into the pool buffer. The extra words are
+    // read from the following addresses, and discarded.
+    const uint16_t word_address = address >> 1;
+    const int word_length = (length + 1) >> 1;
+    const int rx_bytes = (1 + word_length * 2 + 3) & ~3;
 
     memset(spi_transaction, 0, sizeof(*spi_transaction));
     spi_transaction->rx_buffer = output_trans_pool->buffer;
     spi_transaction->length = 0;
-    spi_transaction->rxlength = 24; // 8 for turn-around time, 16 for register data
-    spi_transaction->addr = address;
-    spi_transaction->cmd = COMMAND_READ_REG;
+    spi_transaction->rxlength = rx_bytes * 8;
+    spi_transaction->addr = word_address;
+    spi_transaction->cmd = COMMAND_READ_MEM;
     spi_transaction->user = (void*)output_trans_pool;
 
-    xSemaphoreTake(register_read_semaphore, portMAX_DELAY);
+    // Marks the reader as waiting, see trans_complete()
+    output_trans_pool->ctx = comms;
 
-    xSemaphoreTake(master_spi_semaphore, portMAX_DELAY);
-    esp_err_t ret = spi_device_queue_trans(fpga_comm_device, spi_transaction, 0);
-    xSemaphoreGive(master_spi_semaphore);
+    xSemaphoreTake(comms->memory_read_semaphore, portMAX_DELAY);
+
+    master_spi_lock(portMAX_DELAY);
+    esp_err_t ret = trans_queue(output_trans_pool);
+    master_spi_unlock();
 
     if (ret != ESP_OK) {
         ESP_LOGE(TAG, "Error queuing transaction, error:%s", esp_err_to_name(ret));
-        output_trans_pool_release(output_trans_pool);
+        bulk_release(output_trans_pool);
 
         goto done;
     }
 
-    if (pdPASS != xQueueReceive(register_read_queue, data, pdMS_TO_TICKS(100))) {
-        ESP_LOGE(TAG, "Error reading data from address queue");
+    if (pdPASS != xSemaphoreTake(comms->memory_read_done, pdMS_TO_TICKS(100))) {
+        // The transaction may still be in flight, so the buffer can't be
+        // returned to the pool here. Abandon it, so that the completion
+        // releases it without signalling the next read.
+        portENTER_CRITICAL(&comms->read_lock);
+        const bool claimed = (output_trans_pool->ctx == NULL);
+        output_trans_pool->ctx = NULL;
+        portEXIT_CRITICAL(&comms->read_lock);
 
-        ret = ESP_FAIL;
-        goto done;
+        if (!claimed) {
+            ESP_LOGE(TAG, "Timeout waiting for memory read");
+            ret = ESP_ERR_TIMEOUT;
+            goto done;
+        }
+
+        // The completion is already running, and is about to signal
+        xSemaphoreTake(comms->memory_read_done, portMAX_DELAY);
     }
 
+    // Skip the turnaround byte
+    memcpy(buffer, output_trans_pool->buffer + 1, length);
+    bulk_release(output_trans_pool);
+
 done:
-    xSemaphoreGive(register_read_semaphore);
+    xSemaphoreGive(comms->memory_read_semaphore);
     return ret;
 }
 
-static esp_err_t fpga_comms_spi_device_add()
+//! @brief Send a register transfer with the polling driver
+//!
+//! The transaction is not queued, so it doesn't need a pool entry, and
+//! completes without an interrupt. Acquiring the bus waits for the queued
+//! transactions to be sent, so it still goes out after them.
+static esp_err_t IRAM_ATTR polling_transmit(fpga_comms_handle_t comms, spi_transaction_t* spi_transaction)
 {
-    spi_device_interface_config_t devcfg = {
-        .clock_speed_hz = CONFIG_FPGA_SPI_FREQ_COMMS * 1000000,
-        .mode = 3, // CPOL=1 CPHA=1
-        .spics_io_num = CONFIG_FPGA_CS_GPIO,
-        .queue_size = CONFIG_FPGA_SPI_BUFFER_COUNT,
-        .command_bits = 8,
-        .address_bits = 16,
-        .dummy_bits = 0,
-        .duty_cycle_pos = 0,
-        .cs_ena_pretrans = 1,
-        .cs_ena_posttrans = 0,
-        .flags = SPI_DEVICE_HALFDUPLEX | SPI_DEVICE_DISCARD_AFTER_POST,
-        .pre_cb = NULL,
-        .post_cb = trans_done_callback,
-    };
+    master_spi_lock(portMAX_DELAY);
 
-    return spi_bus_add_device(FSPI_HOST, &devcfg, &fpga_comm_device);
-}
+    esp_err_t ret = spi_device_acquire_bus(comms->spi_device, portMAX_DELAY);
+    if (ret == ESP_OK) {
+        ret = spi_device_polling_transmit(comms->spi_device, spi_transaction);
+        spi_device_release_bus(comms->spi_device);
+    }
 
-esp_err_t fpga_comms_init()
-{
-    register_read_queue = xQueueCreate(1, sizeof(uint16_t));
+    master_spi_unlock();
 
-    if (register_read_queue == NULL) {
-        ESP_LOGE(TAG, "Error creating read address queue");
-        return ESP_FAIL;
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "Error sending polled transaction, error:%s", esp_err_to_name(ret));
     }
 
-    register_read_semaphore = xSemaphoreCreateMutex();
+    return ret;
+}
 
-    if (register_read_semaphore == NULL) {
-        ESP_LOGE(TAG, "Error creating read address semaphore");
-        return ESP_FAIL;
-    }
+static esp_err_t IRAM_ATTR register_write_polling(fpga_comms_handle_t comms, uint16_t address, uint16_t data)
+{
+    spi_transaction_t spi_transaction = {
+        .flags = SPI_TRANS_USE_TXDATA,
+        .cmd = COMMAND_WRITE_REG,
+        .addr = address,
+        .length = 16,
+        .user = NULL,
+        .tx_data = { (data >> 8) & 0xFF, data & 0xFF },
+    };
 
-    // Initialize the DMA buffer pool
-    output_trans_pool_init();
+    return polling_transmit(comms, &spi_transaction);
+}
 
-    // And add an output device to it
-    esp_err_t ret = fpga_comms_spi_device_add();
-    if (ret != ESP_OK) {
-        ESP_LOGE(TAG, "Error adding FPGA SPI device");
+static esp_err_t IRAM_ATTR register_read_polling(fpga_comms_handle_t comms, uint16_t address, uint16_t* data)
+{
+    spi_transaction_t spi_transaction = {
+        .flags = SPI_TRANS_USE_RXDATA,
+        .cmd = COMMAND_READ_REG,
+        .addr = address,
+        .length = 0,
+        .rxlength = 24, // 8 for turn-around time, 16 for register data
+        .user = NULL,
+    };
+
+    const esp_err_t ret = polling_transmit(comms, &spi_transaction);
+    if (ret != ESP_OK) {
+        return ret;
+    }
+
+    *data = (spi_transaction.rx_data[1] << 8) | spi_transaction.rx_data[2];
+    return ESP_OK;
+}
+
+esp_err_t fpga_comms_device_polling_threshold_set(fpga_comms_handle_t comms, int threshold)
+{
+    if ((comms == NULL) || (threshold < 0) || (threshold > POLLING_THRESHOLD_MAX)) {
+        return ESP_FAIL;
+    }
+
+    comms->polling_threshold = threshold;
+    return ESP_OK;
+}
+
+esp_err_t IRAM_ATTR fpga_comms_device_register_write(fpga_comms_handle_t comms, uint16_t address, uint16_t data)
+{
+    if (comms == NULL) {
+        ESP_LOGE(TAG, "fpga_driver not initialized, aborting");
+        return ESP_FAIL;
+    }
+
+    if (REGISTER_DATA_BYTES <= comms->polling_threshold) {
+        const esp_err_t ret = register_write_polling(comms, address, data);
+        if (ret == ESP_OK) {
+            register_cache_store(comms, address, data, true);
+        }
+        return ret;
+    }
+
+    output_trans_pool_t* output_trans_pool = control_take(comms, 5);
+    if (output_trans_pool == NULL) {
+        ESP_LOGE(TAG, "Could not allocate buffer for SPI transaction");
+        return ESP_FAIL;
+    }
+    spi_transaction_t* spi_transaction = &output_trans_pool->transaction;
+
+    memset(spi_transaction, 0, sizeof(*spi_transaction));
+    spi_transaction->flags = SPI_TRANS_USE_TXDATA;
+    spi_transaction->length = 16;
+    spi_transaction->tx_data[0] = (data >> 8) & 0xFF;
+    spi_transaction->tx_data[1] = (data)&0xFF;
+    spi_transaction->addr = address;
+    spi_transaction->cmd = COMMAND_WRITE_REG;
+    spi_transaction->user = (void*)output_trans_pool;
+
+    master_spi_lock(portMAX_DELAY);
+    esp_err_t ret = trans_queue(output_trans_pool);
+    master_spi_unlock();
+
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "Error queuing transaction, error:%s", esp_err_to_name(ret));
+        output_trans_pool_release(output_trans_pool);
+        return ret;
+    }
+
+    register_cache_store(comms, address, data, true);
+
+    return ret;
+}
+
+//! @brief Fill a pool entry with a register write transaction for a run of consecutive addresses
+static void IRAM_ATTR register_write_fill(output_trans_pool_t* output_trans_pool, const fpga_comms_register_t* registers, int run_length)
+{
+    spi_transaction_t* spi_transaction = &output_trans_pool->transaction;
+
+    memset(spi_transaction, 0, sizeof(*spi_transaction));
+    spi_transaction->length = run_length * 16;
+    spi_transaction->addr = registers[0].address;
+    spi_transaction->cmd = COMMAND_WRITE_REG;
+    spi_transaction->user = (void*)output_trans_pool;
+
+    uint8_t* tx_data = output_trans_pool->buffer;
+    if (run_length <= 2) {
+        spi_transaction->flags = SPI_TRANS_USE_TXDATA;
+        tx_data = spi_transaction->tx_data;
+    } else {
+        spi_transaction->tx_buffer = tx_data;
+    }
+
+    for (int word = 0; word < run_length; word++) {
+        const uint16_t data = registers[word].value;
+        tx_data[word * 2] = (data >> 8) & 0xFF;
+        tx_data[word * 2 + 1] = (data)&0xFF;
+    }
+}
+
+//! @brief Write a batch of registers, packing runs of consecutive addresses
+//!
+//! The runs are queued in groups of up to REGISTER_WRITE_QUEUE_MAX, each with
+//! one master_spi_queue_trans_batch() call. The pool entries for a group are
+//! taken before the bus lock, so the lock is never held while waiting for the
+//! pool. The SPI queue has room for every pool entry, so queueing doesn't
+//! block either.
+//!
+//! The register cache is updated once a group is queued, outside the bus
+//! lock. Tasks that write the same register at the same time must order the
+//! writes themselves, or the cache may keep the value that was sent first.
+//!
+//! @param[in] supersede Passed to register_cache_store()
+static esp_err_t IRAM_ATTR register_write_batch(fpga_comms_handle_t comms, const fpga_comms_register_t* registers, int count, bool supersede)
+{
+    const int max_run_length = CONFIG_FPGA_SPI_BUFFER_SIZE / sizeof(uint16_t);
+    esp_err_t ret = ESP_OK;
+
+    int index = 0;
+    while ((index < count) && (ret == ESP_OK)) {
+        output_trans_pool_t* group[REGISTER_WRITE_QUEUE_MAX];
+        spi_transaction_t* group_transactions[REGISTER_WRITE_QUEUE_MAX];
+        int group_starts[REGISTER_WRITE_QUEUE_MAX];
+        int group_lengths[REGISTER_WRITE_QUEUE_MAX];
+        int group_count = 0;
+
+        while ((index < count) && (group_count < REGISTER_WRITE_QUEUE_MAX)) {
+            // Find the run of consecutive addresses starting here
+            int run_length = 1;
+            while ((index + run_length < count)
+                && (run_length < max_run_length)
+                && (registers[index + run_length].address == (uint16_t)(registers[index].address + run_length))) {
+                run_length++;
+            }
+
+            output_trans_pool_t* output_trans_pool = control_take(comms, 5);
+            if (output_trans_pool == NULL) {
+                ESP_LOGE(TAG, "Could not allocate buffer for SPI transaction");
+                ret = ESP_FAIL;
+                break;
+            }
+
+            register_write_fill(output_trans_pool, &registers[index], run_length);
+
+            group[group_count] = output_trans_pool;
+            group_transactions[group_count] = &output_trans_pool->transaction;
+            group_starts[group_count] = index;
+            group_lengths[group_count] = run_length;
+            group_count++;
+            index += run_length;
+        }
+
+        // Queue what was filled, even if the pool ran out part way through
+        for (int i = 0; i < group_count; i++) {
+            trans_queue_begin(group[i]);
+        }
+
+        int queued = 0;
+        const esp_err_t queue_ret = master_spi_queue_trans_batch(comms->spi_device, group_transactions, group_count, &queued);
+        if (queue_ret != ESP_OK) {
+            ret = queue_ret;
+        }
+
+        for (int i = 0; i < queued; i++) {
+            for (int word = 0; word < group_lengths[i]; word++) {
+                const fpga_comms_register_t* reg = &registers[group_starts[i] + word];
+                register_cache_store(comms, reg->address, reg->value, supersede);
+            }
+        }
+
+        for (int i = queued; i < group_count; i++) {
+            trans_queue_undo(group[i]);
+            output_trans_pool_release(group[i]);
+        }
+    }
+
+    return ret;
+}
+
+esp_err_t IRAM_ATTR fpga_comms_device_register_write_batch(fpga_comms_handle_t comms, const fpga_comms_register_t* registers, int count)
+{
+    if (comms == NULL) {
+        ESP_LOGE(TAG, "fpga_driver not initialized, aborting");
+        return ESP_FAIL;
+    }
+
+    if ((registers == NULL) || (count < 0)) {
+        return ESP_FAIL;
+    }
+
+    return register_write_batch(comms, registers, count, true);
+}
+
+//! @brief Queue an asynchronous register read
+//!
+//! The caller must hold the master SPI bus lock.
+static esp_err_t IRAM_ATTR register_read_queue(fpga_comms_handle_t comms, uint16_t address, fpga_comms_read_request_t* request)
+{
+    output_trans_pool_t* output_trans_pool = control_take(comms, 5);
+    if (output_trans_pool == NULL) {
+        ESP_LOGE(TAG, "Could not allocate buffer for SPI transaction");
+        return ESP_FAIL;
+    }
+
+    request->address = address;
+    request->value = 0;
+    request->done = false;
+    request->done_semaphore = xSemaphoreCreateBinaryStatic(&request->done_semaphore_buffer);
+    request->output_trans_pool = output_trans_pool;
+
+    output_trans_pool->ctx = request;
+
+    spi_transaction_t* spi_transaction = &output_trans_pool->transaction;
+
+    memset(spi_transaction, 0, sizeof(*spi_transaction));
+    spi_transaction->rx_buffer = output_trans_pool->buffer;
+    spi_transaction->length = 0;
+    spi_transaction->rxlength = 24; // 8 for turn-around time, 16 for register data
+    spi_transaction->addr = address;
+    spi_transaction->cmd = COMMAND_READ_REG;
+    spi_transaction->user = (void*)output_trans_pool;
+
+    const esp_err_t ret = trans_queue(output_trans_pool);
+
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "Error queuing transaction, error:%s", esp_err_to_name(ret));
+        output_trans_pool->ctx = NULL;
+        request->output_trans_pool = NULL;
+        output_trans_pool_release(output_trans_pool);
+    }
+
+    return ret;
+}
+
+esp_err_t IRAM_ATTR fpga_comms_device_register_read_start(fpga_comms_handle_t comms, uint16_t address, fpga_comms_read_request_t* request)
+{
+    if (comms == NULL) {
+        ESP_LOGE(TAG, "fpga_driver not initialized, aborting");
+        return ESP_FAIL;
+    }
+
+    if (request == NULL) {
+        return ESP_FAIL;
+    }
+
+    master_spi_lock(portMAX_DELAY);
+    const esp_err_t ret = register_read_queue(comms, address, request);
+    master_spi_unlock();
+
+    return ret;
+}
+
+esp_err_t IRAM_ATTR fpga_comms_register_read_wait(fpga_comms_read_request_t* request, TickType_t timeout)
+{
+    if ((request == NULL) || (request->output_trans_pool == NULL)) {
+        return ESP_FAIL;
+    }
+
+    if (xSemaphoreTake(request->done_semaphore, timeout) == pdTRUE) {
+        return ESP_OK;
+    }
+
+    // Detach the request, so a late completion doesn't write to it. If the
+    // ISR has already claimed the request, it is about to complete it.
+    fpga_comms_handle_t comms = request->output_trans_pool->owner;
+
+    portENTER_CRITICAL(&comms->read_lock);
+    const bool claimed = (request->output_trans_pool->ctx != request);
+    if (!claimed) {
+        request->output_trans_pool->ctx = NULL;
+    }
+    portEXIT_CRITICAL(&comms->read_lock);
+
+    if (claimed) {
+        xSemaphoreTake(request->done_semaphore, portMAX_DELAY);
+        return ESP_OK;
+    }
+
+    ESP_LOGE(TAG, "Timeout waiting for register read, address:0x%04x", request->address);
+    return ESP_ERR_TIMEOUT;
+}
+
+esp_err_t IRAM_ATTR fpga_comms_device_register_read_batch(fpga_comms_handle_t comms, const uint16_t* addresses, uint16_t* values, int count)
+{
+    if (comms == NULL) {
+        ESP_LOGE(TAG, "fpga_driver not initialized, aborting");
+        return ESP_FAIL;
+    }
+
+    if ((addresses == NULL) || (values == NULL) || (count < 0)) {
+        return ESP_FAIL;
+    }
+
+    fpga_comms_read_request_t requests[REGISTER_READ_BATCH_MAX] = {};
+    int indices[REGISTER_READ_BATCH_MAX];
+    esp_err_t ret = ESP_OK;
+
+    int index = 0;
+    while (index < count) {
+        // Queue reads for the registers that aren't cached, taking the bus
+        // lock once for the whole group, then collect the results
+        int started = 0;
+        master_spi_lock(portMAX_DELAY);
+        while ((index < count) && (started < REGISTER_READ_BATCH_MAX)) {
+            ret = register_cache_load(comms, addresses[index], &values[index]);
+            if (ret == ESP_OK) {
+                index++;
+                continue;
+            }
+            if (ret != ESP_ERR_NOT_FOUND)
+                break;
+
+            ret = register_read_queue(comms, addresses[index], &requests[started]);
+            if (ret != ESP_OK)
+                break;
+
+            indices[started] = index;
+            started++;
+            index++;
+        }
+        master_spi_unlock();
+
+        for (int i = 0; i < started; i++) {
+            const esp_err_t wait_ret = fpga_comms_register_read_wait(&requests[i], pdMS_TO_TICKS(REGISTER_READ_TIMEOUT_MS));
+            if (wait_ret == ESP_OK) {
+                values[indices[i]] = requests[i].value;
+                register_cache_fill(comms, requests[i].address, requests[i].value);
+            } else {
+                ret = wait_ret;
+            }
+        }
+
+        if (ret != ESP_OK)
+            break;
+    }
+
+    return ret;
+}
+
+esp_err_t IRAM_ATTR fpga_comms_device_register_read(fpga_comms_handle_t comms, uint16_t address, uint16_t* data)
+{
+    if (comms == NULL) {
+        ESP_LOGE(TAG, "fpga_driver not initialized, aborting");
+        return ESP_FAIL;
+    }
+
+    if (data == NULL) {
+        return ESP_FAIL;
+    }
+
+    esp_err_t ret = register_cache_load(comms, address, data);
+    if (ret != ESP_ERR_NOT_FOUND) {
+        return ret;
+    }
+
+    if (REGISTER_DATA_BYTES <= comms->polling_threshold) {
+        ret = register_read_polling(comms, address, data);
+        if (ret == ESP_OK) {
+            register_cache_fill(comms, address, *data);
+        }
+        return ret;
+    }
+
+    fpga_comms_read_request_t request = {};
+
+    ret = fpga_comms_device_register_read_start(comms, address, &request);
+    if (ret != ESP_OK) {
+        return ret;
+    }
+
+    ret = fpga_comms_register_read_wait(&request, pdMS_TO_TICKS(REGISTER_READ_TIMEOUT_MS));
+    if (ret != ESP_OK) {
+        return ret;
+    }
+
+    *data = request.value;
+    register_cache_fill(comms, address, request.value);
+    return ESP_OK;
+}
+
+esp_err_t fpga_comms_device_register_cache_configure(fpga_comms_handle_t comms, uint16_t address, int count, fpga_comms_register_policy_t policy)
+{
+    if (comms == NULL) {
+        ESP_LOGE(TAG, "fpga_driver not initialized, aborting");
+        return ESP_FAIL;
+    }
+
+    if ((policy != FPGA_COMMS_REGISTER_CACHED) && (policy != FPGA_COMMS_REGISTER_WRITE_ONLY)) {
+        ESP_LOGE(TAG, "Invalid register cache policy:%i", policy);
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    if ((count <= 0) || (count > 0x10000 - address)) {
+        ESP_LOGE(TAG, "Invalid register cache range, address:0x%04x count:%i", address, count);
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    esp_err_t ret = ESP_OK;
+
+    portENTER_CRITICAL(&comms->register_cache_lock);
+    for (int i = 0; i < comms->register_cache_range_count; i++) {
+        const register_cache_range_t* range = &comms->register_cache_ranges[i];
+        if ((address < range->address + range->count) && (range->address < address + count)) {
+            ret = ESP_ERR_INVALID_ARG;
+        }
+    }
+
+    if ((ret == ESP_OK)
+        && ((comms->register_cache_range_count >= REGISTER_CACHE_RANGES_MAX)
+            || (count > CONFIG_FPGA_COMMS_REGISTER_CACHE_SIZE - comms->register_cache_used))) {
+        ret = ESP_ERR_NO_MEM;
+    }
+
+    if (ret == ESP_OK) {
+        register_cache_range_t* range = &comms->register_cache_ranges[comms->register_cache_range_count];
+        range->address = address;
+        range->count = count;
+        range->policy = policy;
+        range->offset = comms->register_cache_used;
+
+        for (int i = 0; i < count; i++) {
+            comms->register_cache_valid[comms->register_cache_used + i] = false;
+            comms->register_cache_dirty[comms->register_cache_used + i] = false;
+        }
+
+        comms->register_cache_range_count++;
+        comms->register_cache_used += count;
+    }
+    portEXIT_CRITICAL(&comms->register_cache_lock);
+
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "Unable to cache registers, address:0x%04x count:%i error:%s",
+            address, count, esp_err_to_name(ret));
+    }
+
+    return ret;
+}
+
+void fpga_comms_device_register_cache_invalidate(fpga_comms_handle_t comms)
+{
+    if (comms == NULL) {
+        return;
+    }
+
+    portENTER_CRITICAL(&comms->register_cache_lock);
+    for (int i = 0; i < comms->register_cache_used; i++) {
+        comms->register_cache_valid[i] = false;
+        comms->register_cache_dirty[i] = false;
+    }
+    portEXIT_CRITICAL(&comms->register_cache_lock);
+}
+
+esp_err_t fpga_comms_device_register_cache_resync(fpga_comms_handle_t comms)
+{
+    if (comms == NULL) {
+        ESP_LOGE(TAG, "fpga_driver not initialized, aborting");
+        return ESP_FAIL;
+    }
+
+    // Staged writes are kept, so they are still sent by the next flush
+    portENTER_CRITICAL(&comms->register_cache_lock);
+    for (int i = 0; i < comms->register_cache_used; i++) {
+        comms->register_cache_valid[i] = false;
+    }
+    portEXIT_CRITICAL(&comms->register_cache_lock);
+
+    esp_err_t ret = ESP_OK;
+
+    // Ranges are only ever added, so it's safe to walk them without the lock
+    const int range_count = comms->register_cache_range_count;
+
+    for (int i = 0; (i < range_count) && (ret == ESP_OK); i++) {
+        const register_cache_range_t* range = &comms->register_cache_ranges[i];
+        if (range->policy != FPGA_COMMS_REGISTER_CACHED)
+            continue;
+
+        // Read the range back in batches, which fills the shadow copies
+        for (int start = 0; (start < range->count) && (ret == ESP_OK); start += REGISTER_READ_BATCH_MAX) {
+            uint16_t addresses[REGISTER_READ_BATCH_MAX];
+            uint16_t values[REGISTER_READ_BATCH_MAX];
+
+            int batch_count = range->count - start;
+            if (batch_count > REGISTER_READ_BATCH_MAX)
+                batch_count = REGISTER_READ_BATCH_MAX;
+
+            for (int j = 0; j < batch_count; j++) {
+                addresses[j] = range->address + start + j;
+            }
+
+            ret = fpga_comms_device_register_read_batch(comms, addresses, values, batch_count);
+        }
+    }
+
+    return ret;
+}
+
+esp_err_t fpga_comms_device_register_write_deferred(fpga_comms_handle_t comms, uint16_t address, uint16_t data)
+{
+    if (comms == NULL) {
+        ESP_LOGE(TAG, "fpga_driver not initialized, aborting");
+        return ESP_FAIL;
+    }
+
+    bool cached = false;
+    fpga_comms_register_policy_t policy;
+
+    portENTER_CRITICAL(&comms->register_cache_lock);
+    const int index = register_cache_find(comms, address, &policy);
+    if (index >= 0) {
+        cached = true;
+        comms->coalesce_stats.writes++;
+
+        const bool unchanged = comms->register_cache_valid[index] && (comms->register_cache_values[index] == data);
+
+        if (comms->register_cache_dirty[index]) {
+            // Replaces the staged write. If it puts the register back to the
+            // value the FPGA already has, nothing needs to be sent.
+            comms->coalesce_stats.merged++;
+            comms->register_cache_dirty[index] = !unchanged;
+        } else if (unchanged) {
+            comms->coalesce_stats.unchanged++;
+        } else {
+            comms->register_cache_dirty[index] = true;
+        }
+
+        comms->register_cache_pending[index] = data;
+    }
+    portEXIT_CRITICAL(&comms->register_cache_lock);
+
+    if (!cached) {
+        return fpga_comms_device_register_write(comms, address, data);
+    }
+
+    return ESP_OK;
+}
+
+//! @brief Count the transactions fpga_comms_register_write_batch() needs for a set of registers
+static int register_batch_transactions(const fpga_comms_register_t* registers, int count)
+{
+    int transactions = 0;
+
+    for (int i = 0; i < count; i++) {
+        if ((i == 0) || (registers[i].address != (uint16_t)(registers[i - 1].address + 1)))
+            transactions++;
+    }
+
+    return transactions;
+}
+
+esp_err_t fpga_comms_device_register_flush(fpga_comms_handle_t comms)
+{
+    if (comms == NULL) {
+        ESP_LOGE(TAG, "fpga_driver not initialized, aborting");
+        return ESP_FAIL;
+    }
+
+    fpga_comms_register_t registers[REGISTER_FLUSH_BATCH_MAX];
+    esp_err_t ret = ESP_OK;
+
+    // Ranges are only ever added, so it's safe to walk them without the lock
+    const int range_count = comms->register_cache_range_count;
+
+    for (int i = 0; (i < range_count) && (ret == ESP_OK); i++) {
+        const register_cache_range_t* range = &comms->register_cache_ranges[i];
+
+        int offset = 0;
+        while ((offset < range->count) && (ret == ESP_OK)) {
+            // Collect the next batch of dirty registers in the range, in address order
+            int count = 0;
+
+            portENTER_CRITICAL(&comms->register_cache_lock);
+            for (; (offset < range->count) && (count < REGISTER_FLUSH_BATCH_MAX); offset++) {
+                const int index = range->offset + offset;
+                if (!comms->register_cache_dirty[index])
+                    continue;
+
+                registers[count].address = range->address + offset;
+                registers[count].value = comms->register_cache_pending[index];
+                comms->register_cache_dirty[index] = false;
+                count++;
+            }
+            portEXIT_CRITICAL(&comms->register_cache_lock);
+
+            if (count == 0)
+                continue;
+
+            ret = register_write_batch(comms, registers, count, false);
+
+            if (ret != ESP_OK) {
+                // Stage the batch again, unless the registers were written again since
+                portENTER_CRITICAL(&comms->register_cache_lock);
+                for (int j = 0; j < count; j++) {
+                    const int index = range->offset + (registers[j].address - range->address);
+                    if (!comms->register_cache_dirty[index]) {
+                        comms->register_cache_pending[index] = registers[j].value;
+                        comms->register_cache_dirty[index] = true;
+                    }
+                }
+                portEXIT_CRITICAL(&comms->register_cache_lock);
+                break;
+            }
+
+            portENTER_CRITICAL(&comms->register_cache_lock);
+            comms->coalesce_stats.flushed += count;
+            comms->coalesce_stats.transactions += register_batch_transactions(registers, count);
+            portEXIT_CRITICAL(&comms->register_cache_lock);
+        }
+    }
+
+    return ret;
+}
+
+esp_err_t fpga_comms_device_coalesce_stats_get(fpga_comms_handle_t comms, fpga_comms_coalesce_stats_t* stats)
+{
+    if ((comms == NULL) || (stats == NULL)) {
+        return ESP_FAIL;
+    }
+
+    portENTER_CRITICAL(&comms->register_cache_lock);
+    *stats = comms->coalesce_stats;
+    portEXIT_CRITICAL(&comms->register_cache_lock);
+
+    return ESP_OK;
+}
+
+void fpga_comms_device_coalesce_stats_print(fpga_comms_handle_t comms)
+{
+    fpga_comms_coalesce_stats_t stats;
+    if (fpga_comms_device_coalesce_stats_get(comms, &stats) != ESP_OK) {
+        return;
+    }
+
+    ESP_LOGI(TAG, "coalesce writes:%" PRIu32 " unchanged:%" PRIu32 " merged:%" PRIu32 " flushed:%" PRIu32 " transactions:%" PRIu32 " saved:%" PRIu32,
+        stats.writes,
+        stats.unchanged,
+        stats.merged,
+        stats.flushed,
+        stats.transactions,
+        stats.writes - stats.transactions);
+}
+
+esp_err_t fpga_comms_device_lane_stats_get(fpga_comms_handle_t comms, fpga_comms_lane_t lane, fpga_comms_lane_stats_t* stats)
+{
+    if ((comms == NULL) || ((int)lane < 0) || (lane >= FPGA_COMMS_LANE_COUNT) || (stats == NULL)) {
+        return ESP_FAIL;
+    }
+
+    portENTER_CRITICAL(&comms->lane_lock);
+    *stats = comms->lane_stats[lane];
+    portEXIT_CRITICAL(&comms->lane_lock);
+
+    return ESP_OK;
+}
+
+const char* fpga_comms_lane_name(fpga_comms_lane_t lane)
+{
+    switch (lane) {
+    case FPGA_COMMS_LANE_CONTROL:
+        return "control";
+    case FPGA_COMMS_LANE_BULK:
+        return "bulk";
+    default:
+        return NULL;
+    }
+}
+
+esp_err_t fpga_comms_device_latency_get(fpga_comms_handle_t comms, fpga_comms_trans_type_t type, fpga_comms_latency_histogram_t* histogram)
+{
+    if ((comms == NULL) || ((int)type < 0) || (type >= FPGA_COMMS_TRANS_TYPE_COUNT) || (histogram == NULL)) {
+        return ESP_FAIL;
+    }
+
+#ifdef CONFIG_FPGA_COMMS_LATENCY_STATS
+    portENTER_CRITICAL(&comms->latency_lock);
+    *histogram = comms->latency_histograms[type];
+    portEXIT_CRITICAL(&comms->latency_lock);
+#else
+    memset(histogram, 0, sizeof(*histogram));
+#endif
+
+    return ESP_OK;
+}
+
+void fpga_comms_device_latency_reset(fpga_comms_handle_t comms)
+{
+    if (comms == NULL) {
+        return;
+    }
+
+#ifdef CONFIG_FPGA_COMMS_LATENCY_STATS
+    portENTER_CRITICAL(&comms->latency_lock);
+    memset(comms->latency_histograms, 0, sizeof(comms->latency_histograms));
+    portEXIT_CRITICAL(&comms->latency_lock);
+#endif
+}
+
+void fpga_comms_device_latency_print(fpga_comms_handle_t comms)
+{
+    if (comms == NULL) {
+        return;
+    }
+
+    for (int type = 0; type < FPGA_COMMS_TRANS_TYPE_COUNT; type++) {
+        fpga_comms_latency_histogram_t histogram;
+        fpga_comms_device_latency_get(comms, type, &histogram);
+
+        // Bucket counts, as 'queued/total' pairs
+        char buckets[FPGA_COMMS_LATENCY_BUCKETS * 24];
+        int offset = 0;
+        for (int bucket = 0; bucket < FPGA_COMMS_LATENCY_BUCKETS; bucket++) {
+            offset += snprintf(buckets + offset, sizeof(buckets) - offset, " %" PRIu32 "/%" PRIu32,
+                histogram.queued[bucket],
+                histogram.total[bucket]);
+        }
+
+        ESP_LOGI(TAG, "%s count:%" PRIu32 " total_us_max:%" PRIu32 " buckets:%s",
+            fpga_comms_trans_type_name(type),
+            histogram.count,
+            histogram.total_us_max,
+            buckets);
+    }
+
+    for (int lane = 0; lane < FPGA_COMMS_LANE_COUNT; lane++) {
+        fpga_comms_lane_stats_t stats;
+        fpga_comms_device_lane_stats_get(comms, lane, &stats);
+
+        ESP_LOGI(TAG, "%s lane queued:%" PRIu32 " queued_max:%" PRIu32,
+            fpga_comms_lane_name(lane),
+            stats.queued,
+            stats.queued_max);
+    }
+}
+
+const char* fpga_comms_trans_type_name(fpga_comms_trans_type_t type)
+{
+    switch (type) {
+    case FPGA_COMMS_TRANS_REGISTER_WRITE:
+        return "register_write";
+    case FPGA_COMMS_TRANS_REGISTER_READ:
+        return "register_read";
+    case FPGA_COMMS_TRANS_MEMORY_WRITE:
+        return "memory_write";
+    case FPGA_COMMS_TRANS_MEMORY_READ:
+        return "memory_read";
+    default:
+        return NULL;
+    }
+}
+
+static esp_err_t fpga_comms_spi_device_add(fpga_comms_handle_t comms, const fpga_comms_config_t* config)
+{
+    spi_device_interface_config_t devcfg = {
+        .clock_speed_hz = config->clock_speed_hz,
+        .mode = 3, // CPOL=1 CPHA=1
+        .spics_io_num = config->cs_gpio,
+        .queue_size = CONFIG_FPGA_SPI_BUFFER_COUNT,
+        .command_bits = 8,
+        .address_bits = 16,
+        .dummy_bits = 0,
+        .duty_cycle_pos = 0,
+        .cs_ena_pretrans = 1,
+        .cs_ena_posttrans = 0,
+#ifdef CONFIG_FPGA_COMMS_COMPLETION_ISR
+        .flags = SPI_DEVICE_HALFDUPLEX | SPI_DEVICE_DISCARD_AFTER_POST,
+        .post_cb = trans_done_callback,
+#else
+        .flags = SPI_DEVICE_HALFDUPLEX,
+        .post_cb = NULL,
+#endif
+#ifdef CONFIG_FPGA_COMMS_LATENCY_STATS
+        .pre_cb = trans_start_callback,
+#else
+        .pre_cb = NULL,
+#endif
+    };
+
+    return spi_bus_add_device(FSPI_HOST, &devcfg, &comms->spi_device);
+}
+
+esp_err_t fpga_comms_create(const fpga_comms_config_t* config, fpga_comms_handle_t* handle)
+{
+    if ((config == NULL) || (handle == NULL) || (config->bulk_max_queued <= 0)
+        || (config->polling_threshold < 0) || (config->polling_threshold > POLLING_THRESHOLD_MAX)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    *handle = NULL;
+
+    // The bulk slots of every instance come out of the pool entries that
+    // aren't reserved for register transactions
+    if (bulk_slots_total + config->bulk_max_queued > CONFIG_FPGA_SPI_BUFFER_COUNT - CONTROL_SLOTS_RESERVED) {
+        ESP_LOGE(TAG, "Not enough pool buffers for another instance, bulk_max_queued:%i reserved:%i",
+            config->bulk_max_queued, bulk_slots_total);
+        return ESP_ERR_NO_MEM;
+    }
+
+    // The DMA buffer pool is shared by all instances
+    if (!output_trans_pool_ready) {
+        output_trans_pool_init();
+        output_trans_pool_ready = true;
+    }
+
+    fpga_comms_handle_t comms = calloc(1, sizeof(struct fpga_comms_t));
+    if (comms == NULL) {
+        ESP_LOGE(TAG, "Unable to allocate instance");
+        return ESP_ERR_NO_MEM;
+    }
+
+    // Reserved here, so that fpga_comms_delete() can always give them back
+    comms->bulk_max_queued = config->bulk_max_queued;
+    bulk_slots_total += comms->bulk_max_queued;
+
+    portMUX_INITIALIZE(&comms->read_lock);
+    portMUX_INITIALIZE(&comms->lane_lock);
+    portMUX_INITIALIZE(&comms->register_cache_lock);
+#ifdef CONFIG_FPGA_COMMS_LATENCY_STATS
+    portMUX_INITIALIZE(&comms->latency_lock);
+#endif
+
+    comms->memory_read_semaphore = xSemaphoreCreateMutex();
+    comms->memory_read_done = xSemaphoreCreateBinary();
+    comms->bulk_slots = xSemaphoreCreateCounting(config->bulk_max_queued, config->bulk_max_queued);
+    comms->polling_threshold = config->polling_threshold;
+
+    if ((comms->memory_read_semaphore == NULL)
+        || (comms->memory_read_done == NULL)
+        || (comms->bulk_slots == NULL)) {
+        ESP_LOGE(TAG, "Error creating semaphores");
+        fpga_comms_delete(comms);
+        return ESP_FAIL;
+    }
+
+    esp_err_t ret = fpga_comms_spi_device_add(comms, config);
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "Error adding FPGA SPI device");
+        fpga_comms_delete(comms);
         return ret;
     }
 
+#ifdef CONFIG_FPGA_COMMS_COMPLETION_REAPER
+    comms->reaper_stopped = xSemaphoreCreateBinary();
+    if (comms->reaper_stopped == NULL) {
+        ESP_LOGE(TAG, "Error creating semaphores");
+        fpga_comms_delete(comms);
+        return ESP_FAIL;
+    }
+
+    if (xTaskCreate(reaper_task, "fpga_reaper", 2048, comms,
+            CONFIG_FPGA_COMMS_REAPER_PRIORITY, &comms->reaper_task)
+        != pdPASS) {
+        ESP_LOGE(TAG, "Error creating reaper task");
+        fpga_comms_delete(comms);
+        return ESP_FAIL;
+    }
+#endif
+
+    *handle = comms;
     return ESP_OK;
 }
+
+esp_err_t fpga_comms_delete(fpga_comms_handle_t comms)
+{
+    if (comms == NULL) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+#ifdef CONFIG_FPGA_COMMS_COMPLETION_REAPER
+    // Stop the reaper first, once it has completed the queued transactions.
+    // Until then it is the only thing taking their results from the driver.
+    if (comms->reaper_task != NULL) {
+        comms->reaper_stop = true;
+        xSemaphoreTake(comms->reaper_stopped, portMAX_DELAY);
+        vTaskDelete(comms->reaper_task);
+        comms->reaper_task = NULL;
+    }
+
+    if (comms->reaper_stopped != NULL)
+        vSemaphoreDelete(comms->reaper_stopped);
+#endif
+
+    if (comms->spi_device != NULL) {
+        // Fails if there are transactions still in flight
+        esp_err_t ret = spi_bus_remove_device(comms->spi_device);
+        if (ret != ESP_OK) {
+            ESP_LOGE(TAG, "Error removing FPGA SPI device, error:%s", esp_err_to_name(ret));
+            return ret;
+        }
+    }
+
+    if (comms->memory_read_semaphore != NULL)
+        vSemaphoreDelete(comms->memory_read_semaphore);
+    if (comms->memory_read_done != NULL)
+        vSemaphoreDelete(comms->memory_read_done);
+    if (comms->bulk_slots != NULL)
+        vSemaphoreDelete(comms->bulk_slots);
+
+    if (comms == default_comms)
+        default_comms = NULL;
+
+    bulk_slots_total -= comms->bulk_max_queued;
+    free(comms);
+    return ESP_OK;
+}
+
+fpga_comms_handle_t fpga_comms_get_default()
+{
+    return default_comms;
+}
+
+esp_err_t fpga_comms_init()
+{
+    if (default_comms != NULL) {
+        ESP_LOGE(TAG, "Default instance already created");
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    const fpga_comms_config_t config = FPGA_COMMS_CONFIG_DEFAULT();
+
+    return fpga_comms_create(&config, &default_comms);
+}
+
+// Default instance ///////////////////////////////////////////////////////////
+
+esp_err_t fpga_comms_polling_threshold_set(int threshold)
+{
+    return fpga_comms_device_polling_threshold_set(default_comms, threshold);
+}
+
+esp_err_t fpga_comms_register_write(uint16_t address, uint16_t data)
+{
+    return fpga_comms_device_register_write(default_comms, address, data);
+}
+
+esp_err_t fpga_comms_register_write_batch(const fpga_comms_register_t* registers, int count)
+{
+    return fpga_comms_device_register_write_batch(default_comms, registers, count);
+}
+
+esp_err_t fpga_comms_register_read(uint16_t address, uint16_t* data)
+{
+    return fpga_comms_device_register_read(default_comms, address, data);
+}
+
+esp_err_t fpga_comms_register_read_start(uint16_t address, fpga_comms_read_request_t* request)
+{
+    return fpga_comms_device_register_read_start(default_comms, address, request);
+}
+
+esp_err_t fpga_comms_register_read_batch(const uint16_t* addresses, uint16_t* values, int count)
+{
+    return fpga_comms_device_register_read_batch(default_comms, addresses, values, count);
+}
+
+esp_err_t fpga_comms_register_cache_configure(uint16_t address, int count, fpga_comms_register_policy_t policy)
+{
+    return fpga_comms_device_register_cache_configure(default_comms, address, count, policy);
+}
+
+void fpga_comms_register_cache_invalidate()
+{
+    fpga_comms_device_register_cache_invalidate(default_comms);
+}
+
+esp_err_t fpga_comms_register_cache_resync()
+{
+    return fpga_comms_device_register_cache_resync(default_comms);
+}
+
+esp_err_t fpga_comms_register_write_deferred(uint16_t address, uint16_t data)
+{
+    return fpga_comms_device_register_write_deferred(default_comms, address, data);
+}
+
+esp_err_t fpga_comms_register_flush()
+{
+    return fpga_comms_device_register_flush(default_comms);
+}
+
+esp_err_t fpga_comms_coalesce_stats_get(fpga_comms_coalesce_stats_t* stats)
+{
+    return fpga_comms_device_coalesce_stats_get(default_comms, stats);
+}
+
+void fpga_comms_coalesce_stats_print()
+{
+    fpga_comms_device_coalesce_stats_print(default_comms);
+}
+
+esp_err_t fpga_comms_memory_write(uint16_t address, const uint8_t* buffer, int length, int retry_count)
+{
+    return fpga_comms_device_memory_write(default_comms, address, buffer, length, retry_count);
+}
+
+esp_err_t fpga_comms_memory_write_chunked(uint16_t address, const uint8_t* buffer, int length, int retry_count, int* bytes_queued)
+{
+    return fpga_comms_device_memory_write_chunked(default_comms, address, buffer, length, retry_count, bytes_queued);
+}
+
+output_trans_pool_t* fpga_comms_memory_write_lease(int retry_count)
+{
+    return fpga_comms_device_memory_write_lease(default_comms, retry_count);
+}
+
+esp_err_t fpga_comms_memory_read(uint16_t address, uint8_t* buffer, int length, int retry_count)
+{
+    return fpga_comms_device_memory_read(default_comms, address, buffer, length, retry_count);
+}
+
+esp_err_t fpga_comms_lane_stats_get(fpga_comms_lane_t lane, fpga_comms_lane_stats_t* stats)
+{
+    return fpga_comms_device_lane_stats_get(default_comms, lane, stats);
+}
+
+esp_err_t fpga_comms_latency_get(fpga_comms_trans_type_t type, fpga_comms_latency_histogram_t* histogram)
+{
+    return fpga_comms_device_latency_get(default_comms, type, histogram);
+}
+
+void fpga_comms_latency_reset()
+{
+    fpga_comms_device_latency_reset(default_comms);
+}
+
+void fpga_comms_latency_print()
+{
+    fpga_comms_device_latency_print(default_comms);
+}
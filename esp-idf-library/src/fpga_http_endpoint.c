@@ -1,15 +1,22 @@
 #include "fpga_http_endpoint.h"
 #include "fpga_loader.h"
+#include "fpga_slots.h"
 #include "http_response.h"
 #include "http_api.h"
 #include "fpga.h"
 #include <esp_log.h>
+#include <stdlib.h>
+#include <string.h>
 
 static const char* TAG = "fpga_http_endpoint";
 
 // Must be equal to or smaller than FPGA buffer size
 #define CHUNK_SIZE (512)
 
+// Number of polling intervals to wait for a free FPGA buffer, while frames are
+// being streamed to the FPGA
+#define MEMORY_RETRY_COUNT (5)
+
 static esp_err_t bitstream_put_handler(httpd_req_t* req)
 {
     esp_err_t ret;
@@ -73,6 +80,157 @@ static esp_err_t bitstream_put_handler(httpd_req_t* req)
     return ESP_OK;
 }
 
+static esp_err_t slots_get(httpd_req_t* req, cJSON** response)
+{
+    esp_err_t ret = fpga_slots_init();
+    if (ret != ESP_OK) {
+        return ret;
+    }
+
+    *response = cJSON_CreateObject();
+    if (*response == NULL) {
+        return ESP_FAIL;
+    }
+
+    cJSON_AddNumberToObject(*response, "size_max", fpga_slots_size_max());
+
+    cJSON* slots = cJSON_CreateArray();
+    if (slots == NULL) {
+        cJSON_Delete(*response);
+        return ESP_FAIL;
+    }
+    cJSON_AddItemToObject(*response, "slots", slots);
+
+    for (int slot = 0; slot < fpga_slots_count(); slot++) {
+        fpga_slot_info_t info;
+        if (fpga_slots_info_get(slot, &info) != ESP_OK) {
+            continue;
+        }
+
+        char hash[FPGA_SLOTS_HASH_SIZE * 2 + 1];
+        for (int i = 0; i < FPGA_SLOTS_HASH_SIZE; i++) {
+            snprintf(hash + i * 2, 3, "%02x", info.hash[i]);
+        }
+
+        cJSON* item = cJSON_CreateObject();
+        if (item == NULL) {
+            cJSON_Delete(*response);
+            return ESP_FAIL;
+        }
+        cJSON_AddItemToArray(slots, item);
+
+        cJSON_AddNumberToObject(item, "slot", slot);
+        cJSON_AddStringToObject(item, "name", info.name);
+        cJSON_AddNumberToObject(item, "version", info.version);
+        cJSON_AddNumberToObject(item, "size", info.size);
+        cJSON_AddStringToObject(item, "sha256", hash);
+    }
+
+    return ESP_OK;
+}
+
+static esp_err_t slot_put_handler(httpd_req_t* req)
+{
+    esp_err_t ret;
+
+    char name[FPGA_SLOTS_NAME_MAX + 1];
+    uint16_t version;
+    if ((get_query_param(req, "name", name, sizeof(name)) != ESP_OK)
+        || (get_query_param_uint16(req, "version", &version) != ESP_OK)) {
+        RESPOND_ERROR_INVALID_PARAMETERS();
+        return ESP_FAIL;
+    }
+
+    ret = fpga_slots_write_start(name, version, req->content_len);
+    if (ret != ESP_OK) {
+        RESPOND_ERROR(HTTPD_400_BAD_REQUEST, "Error starting write, %s", esp_err_to_name(ret));
+        return ret;
+    }
+
+    char* buf = malloc(CHUNK_SIZE);
+    if (buf == NULL) {
+        ESP_LOGE(TAG, "Unable to reserve memory for slot write");
+        fpga_slots_write_abort();
+        RESPOND_ERROR_RECEIVING_DATA();
+        return ESP_FAIL;
+    }
+
+    size_t remaining = req->content_len;
+
+    while (remaining > 0) {
+        const size_t chunk_size = ((CHUNK_SIZE < remaining) ? CHUNK_SIZE : remaining);
+
+        const int received = httpd_req_recv(req, buf, chunk_size);
+        if (received <= 0) {
+            ESP_LOGE(TAG, "Slot write error receiving data, received:%i", received);
+            fpga_slots_write_abort();
+            RESPOND_ERROR_RECEIVING_DATA();
+            free(buf);
+            return ESP_FAIL;
+        }
+
+        ret = fpga_slots_write_chunk(buf, received);
+        if (ret != ESP_OK) {
+            fpga_slots_write_abort();
+            RESPOND_ERROR_SAVING_STATE();
+            free(buf);
+            return ret;
+        }
+
+        remaining -= received;
+    }
+
+    free(buf);
+
+    ret = fpga_slots_write_finalize();
+    if (ret != ESP_OK) {
+        RESPOND_ERROR_SAVING_STATE();
+        return ret;
+    }
+
+    RESPOND_OK();
+    return ESP_OK;
+}
+
+//! @brief Read the slot name from a JSON request
+static esp_err_t slot_name_get(const cJSON* request, const char** name)
+{
+    if (request == NULL) {
+        return ESP_FAIL;
+    }
+
+    const cJSON* value = cJSON_GetObjectItemCaseSensitive(request, "name");
+    if (!cJSON_IsString(value)) {
+        ESP_LOGE(TAG, "Can't understand JSON");
+        return ESP_FAIL;
+    }
+
+    *name = value->valuestring;
+    return ESP_OK;
+}
+
+static esp_err_t slot_activate_put(httpd_req_t* req, const cJSON* request)
+{
+    const char* name;
+    esp_err_t ret = slot_name_get(request, &name);
+    if (ret != ESP_OK) {
+        return ret;
+    }
+
+    return fpga_slots_load(name);
+}
+
+static esp_err_t slot_erase_put(httpd_req_t* req, const cJSON* request)
+{
+    const char* name;
+    esp_err_t ret = slot_name_get(request, &name);
+    if (ret != ESP_OK) {
+        return ret;
+    }
+
+    return fpga_slots_erase(name);
+}
+
 static esp_err_t register_put(httpd_req_t* req, const cJSON* request)
 {
     uint16_t address;
@@ -134,6 +292,91 @@ static esp_err_t register_get(httpd_req_t* req, cJSON** response)
     return ESP_OK;
 }
 
+static cJSON* latency_buckets_create(const uint32_t* buckets)
+{
+    cJSON* array = cJSON_CreateArray();
+    if (array == NULL) {
+        return NULL;
+    }
+
+    for (int bucket = 0; bucket < FPGA_COMMS_LATENCY_BUCKETS; bucket++) {
+        cJSON_AddItemToArray(array, cJSON_CreateNumber(buckets[bucket]));
+    }
+
+    return array;
+}
+
+static esp_err_t latency_get(httpd_req_t* req, cJSON** response)
+{
+    *response = cJSON_CreateObject();
+    if (*response == NULL) {
+        return ESP_FAIL;
+    }
+
+    for (int type = 0; type < FPGA_COMMS_TRANS_TYPE_COUNT; type++) {
+        fpga_comms_latency_histogram_t histogram;
+        fpga_comms_latency_get(type, &histogram);
+
+        cJSON* item = cJSON_CreateObject();
+        if (item == NULL) {
+            cJSON_Delete(*response);
+            return ESP_FAIL;
+        }
+        cJSON_AddItemToObject(*response, fpga_comms_trans_type_name(type), item);
+
+        cJSON_AddNumberToObject(item, "count", histogram.count);
+        cJSON_AddNumberToObject(item, "total_us_max", histogram.total_us_max);
+        cJSON_AddItemToObject(item, "queued", latency_buckets_create(histogram.queued));
+        cJSON_AddItemToObject(item, "total", latency_buckets_create(histogram.total));
+    }
+
+    for (int lane = 0; lane < FPGA_COMMS_LANE_COUNT; lane++) {
+        fpga_comms_lane_stats_t stats;
+        fpga_comms_lane_stats_get(lane, &stats);
+
+        cJSON* item = cJSON_CreateObject();
+        if (item == NULL) {
+            cJSON_Delete(*response);
+            return ESP_FAIL;
+        }
+        cJSON_AddItemToObject(*response, fpga_comms_lane_name(lane), item);
+
+        cJSON_AddNumberToObject(item, "queued", stats.queued);
+        cJSON_AddNumberToObject(item, "queued_max", stats.queued_max);
+    }
+
+    return ESP_OK;
+}
+
+static esp_err_t bus_lock_get(httpd_req_t* req, cJSON** response)
+{
+    master_spi_lock_stats_t stats[MASTER_SPI_LOCK_OWNERS_MAX + 1];
+    const int count = master_spi_lock_stats_get(stats, MASTER_SPI_LOCK_OWNERS_MAX + 1);
+
+    *response = cJSON_CreateObject();
+    if (*response == NULL) {
+        return ESP_FAIL;
+    }
+
+    for (int i = 0; i < count; i++) {
+        cJSON* item = cJSON_CreateObject();
+        if (item == NULL) {
+            cJSON_Delete(*response);
+            return ESP_FAIL;
+        }
+        cJSON_AddItemToObject(*response, stats[i].name, item);
+
+        cJSON_AddNumberToObject(item, "acquisitions", stats[i].acquisitions);
+        cJSON_AddNumberToObject(item, "contended", stats[i].contended);
+        cJSON_AddNumberToObject(item, "wait_time_us_total", stats[i].wait_time_us_total);
+        cJSON_AddNumberToObject(item, "wait_time_us_max", stats[i].wait_time_us_max);
+        cJSON_AddNumberToObject(item, "hold_time_us_total", stats[i].hold_time_us_total);
+        cJSON_AddNumberToObject(item, "hold_time_us_max", stats[i].hold_time_us_max);
+    }
+
+    return ESP_OK;
+}
+
 static esp_err_t memory_put_handler(httpd_req_t* req)
 {
     esp_err_t ret;
@@ -178,7 +421,7 @@ static esp_err_t memory_put_handler(httpd_req_t* req)
         remaining -= received;
     }
     
-    ret = fpga_comms_memory_write(address, (uint8_t*)buf, length, 0);
+    ret = fpga_comms_memory_write(address, (uint8_t*)buf, length, MEMORY_RETRY_COUNT);
     if(ret != ESP_OK) {
         ESP_LOGE(TAG, "Error writing to FPGA memory");
         RESPOND_ERROR_SAVING_STATE();
@@ -224,7 +467,7 @@ static esp_err_t memory_get_handler(httpd_req_t* req)
         return ESP_FAIL;
     }
    
-    ret = fpga_comms_memory_read(address, (uint8_t*)buf, length, 0);
+    ret = fpga_comms_memory_read(address, (uint8_t*)buf, length, MEMORY_RETRY_COUNT);
     if(ret != ESP_OK) {
         ESP_LOGE(TAG, "Error reading from FPGA memory");
         RESPOND_ERROR(HTTPD_500_INTERNAL_SERVER_ERROR, "Error reading from FPGA");
@@ -259,6 +502,22 @@ esp_err_t fpga_http_endpoint_register(httpd_handle_t httpd_handle)
     http_api_register_json_put_endpoint(httpd_handle, "/fpga/register", register_put);
     http_api_register_json_get_endpoint(httpd_handle, "/fpga/register", register_get);
 
+    http_api_register_json_get_endpoint(httpd_handle, "/fpga/slots", slots_get);
+
+    const httpd_uri_t httpd_uri_slot_put = {
+        .uri = "/fpga/slot",
+        .method = HTTP_PUT,
+        .handler = slot_put_handler,
+        .user_ctx = NULL
+    };
+    httpd_register_uri_handler(httpd_handle, &httpd_uri_slot_put);
+
+    http_api_register_json_put_endpoint(httpd_handle, "/fpga/slot/activate", slot_activate_put);
+    http_api_register_json_put_endpoint(httpd_handle, "/fpga/slot/erase", slot_erase_put);
+
+    http_api_register_json_get_endpoint(httpd_handle, "/fpga/latency", latency_get);
+    http_api_register_json_get_endpoint(httpd_handle, "/fpga/bus_lock", bus_lock_get);
+
     const httpd_uri_t httpd_uri_memory_put = {
         .uri = "/fpga/memory",
         .method = HTTP_PUT,
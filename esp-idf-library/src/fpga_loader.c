@@ -4,16 +4,23 @@
 #include "output_trans_pool.h"
 #include <driver/gpio.h>
 #include <driver/spi_master.h>
+#include <esp_attr.h>
 #include <esp_log.h>
+#include <esp_rom_sys.h>
+#include <esp_timer.h>
 #include <freertos/FreeRTOS.h>
 #include <freertos/semphr.h>
 #include <freertos/task.h>
+#include <inttypes.h>
 #include <soc/gpio_sig_map.h>
 #include <soc/soc.h>
 #include <string.h>
 #include <sys/stat.h>
 
-#define CONFIG_FPGA_LOADER_SIZE (CONFIG_FPGA_SPI_BUFFER_SIZE * 4)
+#define CONFIG_FPGA_LOADER_SIZE CONFIG_FPGA_LOADER_CHUNK_SIZE
+
+//! Number of DMA buffers. One is filled while the other is being sent.
+#define LOADER_BUFFER_COUNT 2
 
 typedef struct {
     size_t size;
@@ -26,16 +33,131 @@ static const char TAG[] = "fpga_loader";
 //! SPI device used for communication with the ICE40 FPGA
 static spi_device_handle_t fpga_update_device = NULL;
 
-//! DMA-capable buffer for writing fpga outputs
+//! True while the load holds the master SPI lock. It is taken before the bus
+//! is acquired, in the same order as fpga_comms, and held until the load ends.
+static bool master_spi_locked = false;
+
+//! DMA-capable buffers for writing fpga outputs
+static char* dma_bufs[LOADER_BUFFER_COUNT] = {};
+
+//! Transaction for each buffer, valid while it is queued
+static spi_transaction_t dma_transactions[LOADER_BUFFER_COUNT];
+
+//! True if the buffer is queued for sending, and must not be written to
+static bool dma_queued[LOADER_BUFFER_COUNT];
+
+//! Index of the buffer currently being filled
+static int dma_buf_index = 0;
+
+//! Buffer currently being filled
 static char* dma_buf = NULL;
 
+//! Number of bytes in dma_buf waiting to be sent
+static size_t dma_buf_fill = 0;
+
+//! Timing of the current (or last) load
+static fpga_loader_stats_t load_stats;
+static int64_t load_start_time = 0;
+
+//! Start time of the current phase of the load
+static int64_t phase_start_time = 0;
+
+//! Given from the GPIO ISR when CDONE changes to the awaited value
+static SemaphoreHandle_t cdone_semaphore = NULL;
+
+// Compressed bitstreams /////////////////////////////////////////////////////
+
+//! Magic number at the start of a compressed bitstream, see fpga_loader.h
+static const uint8_t rle_magic[4] = { 'I', 'C', 'Z', 'R' };
+
+//! Size of the compressed bitstream header (magic, then decompressed size)
+#define RLE_HEADER_SIZE 8
+
+//! Tokens with this bit set are zero runs, otherwise literal runs
+#define RLE_TOKEN_ZERO_RUN 0x80
+
+typedef enum {
+    LOAD_FORMAT_UNKNOWN, //!< Waiting for enough data to check for the magic number
+    LOAD_FORMAT_RAW, //!< Uncompressed bitstream
+    LOAD_FORMAT_RLE, //!< Zero-run compressed bitstream
+} load_format_t;
+
+typedef enum {
+    RLE_STATE_HEADER, //!< Reading the header
+    RLE_STATE_TOKEN, //!< Waiting for the next token
+    RLE_STATE_ZERO_LENGTH, //!< Waiting for the low byte of a zero run length
+    RLE_STATE_LITERAL, //!< Copying literal bytes
+} rle_state_t;
+
+//! State of the bitstream currently being loaded
+static struct {
+    load_format_t format;
+    rle_state_t rle_state;
+
+    uint8_t header[RLE_HEADER_SIZE]; //!< First bytes of the stream, until the format is known
+    size_t header_length;
+
+    uint32_t size; //!< Decompressed size, from the header
+    uint32_t output_count; //!< Number of decompressed bytes produced so far
+    uint8_t token; //!< Current token, while waiting for its length byte
+    size_t literal_remaining; //!< Bytes left in the current literal run
+} load_state;
+
+//! @brief Wait for a queued buffer to finish sending
+//!
+//! \param index Buffer to wait for. Returns immediately if it isn't queued.
+//! \return ESP_OK on success
+static esp_err_t dma_buf_wait(int index)
+{
+    if (!dma_queued[index])
+        return ESP_OK;
+
+    // Up to LOADER_BUFFER_COUNT transfers can be queued, and the driver
+    // returns their results in the order they were queued. The buffers are
+    // queued in turn, and output_flush() waits on the buffer after the one
+    // it just queued, which is the oldest one still queued, so the next
+    // result is for this buffer. dma_buf_wait_all() may take the results
+    // in a different order, but it collects all of them, so that doesn't
+    // matter there.
+    const int64_t start_time = esp_timer_get_time();
+
+    spi_transaction_t* spi_transaction;
+    esp_err_t ret = spi_device_get_trans_result(fpga_update_device, &spi_transaction, portMAX_DELAY);
+
+    load_stats.spi_wait_time_us += esp_timer_get_time() - start_time;
+    dma_queued[index] = false;
+
+    return ret;
+}
+
+//! @brief Wait for all queued buffers to finish sending
+static esp_err_t dma_buf_wait_all()
+{
+    esp_err_t ret = ESP_OK;
+
+    for (int index = 0; index < LOADER_BUFFER_COUNT; index++) {
+        esp_err_t wait_ret = dma_buf_wait(index);
+        if (wait_ret != ESP_OK)
+            ret = wait_ret;
+    }
+
+    return ret;
+}
+
 //! @brief Write a chunk of firmware data to the FPGA
 //!
+//! Waits for any queued buffers to be sent first. The caller must hold the
+//! master SPI lock and the bus, see fpga_loader_start().
+//!
 //! \param buffer Buffer to write. Must have MALLOC_CAP_DMA
 //! \param length Length of buffer to write. Must be <= CONFIG_FPGA_LOADER_SIZE
 //! \return ESP_OK on success
 static esp_err_t write_update_block(const char* buffer, int length)
 {
+    esp_err_t ret = dma_buf_wait_all();
+    if (ret != ESP_OK)
+        return ret;
+
     if (length > CONFIG_FPGA_LOADER_SIZE) {
         ESP_LOGE(TAG, "Data length too large, discarding. buffer:%p length:%i",
             buffer, length);
@@ -49,12 +171,235 @@ static esp_err_t write_update_block(const char* buffer, int length)
         .rx_buffer = NULL,
     };
 
-    xSemaphoreTake(master_spi_semaphore, portMAX_DELAY);
-    esp_err_t ret = spi_device_transmit(fpga_update_device, &spi_transaction);
-    xSemaphoreGive(master_spi_semaphore);
+    return spi_device_transmit(fpga_update_device, &spi_transaction);
+}
+
+//! @brief Queue the data waiting in dma_buf to be sent to the FPGA
+//!
+//! The transfer runs in the background, and filling continues in the other
+//! buffer, once any earlier transfer from it has finished. The caller must
+//! hold the master SPI lock and the bus, see fpga_loader_start().
+static esp_err_t output_flush()
+{
+    if (dma_buf_fill == 0)
+        return ESP_OK;
+
+    spi_transaction_t* spi_transaction = &dma_transactions[dma_buf_index];
+    *spi_transaction = (spi_transaction_t) {
+        .length = dma_buf_fill * 8,
+        .tx_buffer = dma_buf,
+        .rx_buffer = NULL,
+    };
+
+    esp_err_t ret = spi_device_queue_trans(fpga_update_device, spi_transaction, portMAX_DELAY);
+    if (ret != ESP_OK)
+        return ret;
+
+    load_stats.bitstream_bytes += dma_buf_fill;
+    dma_queued[dma_buf_index] = true;
+
+    dma_buf_index = (dma_buf_index + 1) % LOADER_BUFFER_COUNT;
+    dma_buf = dma_bufs[dma_buf_index];
+    dma_buf_fill = 0;
+
+    return dma_buf_wait(dma_buf_index);
+}
+
+//! @brief Add bitstream data to dma_buf, sending it to the FPGA when full
+//!
+//! \param data Data to add, or NULL to add zeros
+//! \param length Number of bytes to add
+//! \return ESP_OK on success
+static esp_err_t output_add(const uint8_t* data, size_t length)
+{
+    while (length > 0) {
+        size_t count = CONFIG_FPGA_LOADER_SIZE - dma_buf_fill;
+        if (count > length)
+            count = length;
+
+        if (data != NULL) {
+            memcpy(dma_buf + dma_buf_fill, data, count);
+            data += count;
+        } else {
+            memset(dma_buf + dma_buf_fill, 0, count);
+        }
+
+        dma_buf_fill += count;
+        length -= count;
+
+        if (dma_buf_fill == CONFIG_FPGA_LOADER_SIZE) {
+            esp_err_t ret = output_flush();
+            if (ret != ESP_OK)
+                return ret;
+        }
+    }
+
+    return ESP_OK;
+}
+
+//! @brief Add data that was written straight into dma_buf, after dma_buf_fill
+//!
+//! \param length Number of bytes written
+//! \return ESP_OK on success
+static esp_err_t output_commit(size_t length)
+{
+    dma_buf_fill += length;
+
+    if (dma_buf_fill == CONFIG_FPGA_LOADER_SIZE)
+        return output_flush();
+
+    return ESP_OK;
+}
+
+//! @brief Add decompressed data, checking that it fits in the size given by the header
+static esp_err_t rle_output_add(const uint8_t* data, size_t length)
+{
+    if (length > load_state.size - load_state.output_count) {
+        ESP_LOGE(TAG, "Compressed bitstream larger than its header, size:%" PRIu32,
+            load_state.size);
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    load_state.output_count += length;
+    return output_add(data, length);
+}
+
+//! @brief Decompress a chunk of a compressed bitstream into dma_buf
+//!
+//! The decoder state is kept between calls, so tokens can be split across
+//! chunks.
+//!
+//! \param data Compressed data, following the header
+//! \param length Length of the compressed data
+//! \return ESP_OK on success
+static esp_err_t rle_decompress(const uint8_t* data, size_t length)
+{
+    esp_err_t ret = ESP_OK;
+
+    while ((length > 0) && (ret == ESP_OK)) {
+        switch (load_state.rle_state) {
+        case RLE_STATE_TOKEN:
+            load_state.token = *data;
+            data++;
+            length--;
+
+            if (load_state.token & RLE_TOKEN_ZERO_RUN) {
+                load_state.rle_state = RLE_STATE_ZERO_LENGTH;
+            } else {
+                load_state.literal_remaining = load_state.token + 1;
+                load_state.rle_state = RLE_STATE_LITERAL;
+            }
+            break;
+
+        case RLE_STATE_ZERO_LENGTH: {
+            const size_t run = (((load_state.token & ~RLE_TOKEN_ZERO_RUN) << 8) | *data) + 1;
+            data++;
+            length--;
+
+            ret = rle_output_add(NULL, run);
+            load_state.rle_state = RLE_STATE_TOKEN;
+        } break;
+
+        case RLE_STATE_LITERAL: {
+            size_t count = load_state.literal_remaining;
+            if (count > length)
+                count = length;
+
+            ret = rle_output_add(data, count);
+            data += count;
+            length -= count;
+
+            load_state.literal_remaining -= count;
+            if (load_state.literal_remaining == 0)
+                load_state.rle_state = RLE_STATE_TOKEN;
+        } break;
+
+        default:
+            ret = ESP_FAIL;
+            break;
+        }
+    }
+
     return ret;
 }
 
+//! @brief Add bitstream data, decompressing it if needed
+//!
+//! The format is detected from the first bytes of the stream, which are held
+//! back until there are enough of them to check for the magic number.
+static esp_err_t bitstream_add(const uint8_t* data, size_t length)
+{
+    if (load_state.format == LOAD_FORMAT_UNKNOWN) {
+        size_t count = sizeof(rle_magic) - load_state.header_length;
+        if (count > length)
+            count = length;
+
+        memcpy(load_state.header + load_state.header_length, data, count);
+        load_state.header_length += count;
+        data += count;
+        length -= count;
+
+        if (load_state.header_length < sizeof(rle_magic))
+            return ESP_OK;
+
+        if (memcmp(load_state.header, rle_magic, sizeof(rle_magic)) == 0) {
+            load_state.format = LOAD_FORMAT_RLE;
+            load_state.rle_state = RLE_STATE_HEADER;
+        } else {
+            load_state.format = LOAD_FORMAT_RAW;
+
+            esp_err_t ret = output_add(load_state.header, load_state.header_length);
+            if (ret != ESP_OK)
+                return ret;
+        }
+    }
+
+    if (load_state.format == LOAD_FORMAT_RAW)
+        return output_add(data, length);
+
+    if (load_state.rle_state == RLE_STATE_HEADER) {
+        size_t count = RLE_HEADER_SIZE - load_state.header_length;
+        if (count > length)
+            count = length;
+
+        memcpy(load_state.header + load_state.header_length, data, count);
+        load_state.header_length += count;
+        data += count;
+        length -= count;
+
+        if (load_state.header_length < RLE_HEADER_SIZE)
+            return ESP_OK;
+
+        load_state.size = load_state.header[4]
+            | (load_state.header[5] << 8)
+            | (load_state.header[6] << 16)
+            | ((uint32_t)load_state.header[7] << 24);
+        load_state.rle_state = RLE_STATE_TOKEN;
+
+        ESP_LOGI(TAG, "Compressed bitstream, size:%" PRIu32, load_state.size);
+    }
+
+    return rle_decompress(data, length);
+}
+
+//! @brief Check whether the bitstream being loaded is raw, from its first chunk
+//!
+//! \param data Start of the chunk
+//! \param length Length of the chunk
+//! \return true if the bitstream is raw. Chunks of a raw bitstream that were
+//!         read straight into dma_buf can be added with output_commit().
+static bool bitstream_is_raw(const uint8_t* data, size_t length)
+{
+    if ((load_state.format == LOAD_FORMAT_UNKNOWN)
+        && (load_state.header_length == 0)
+        && (length >= sizeof(rle_magic))
+        && (memcmp(data, rle_magic, sizeof(rle_magic)) != 0)) {
+        load_state.format = LOAD_FORMAT_RAW;
+    }
+
+    return (load_state.format == LOAD_FORMAT_RAW);
+}
+
 //! @brief Convenience function to control the state of the ICE40 reset pin
 //!
 //! \param value If true, set the pin to logic high, otherwise set the pin low
@@ -63,22 +408,63 @@ static void reset_pin_set(bool value)
     gpio_set_level(CONFIG_FPGA_CRESET_GPIO, value ? 1 : 0);
 }
 
+//! @brief End the current phase of the load, and start the next one
+//!
+//! \param phase_time_us Phase duration to fill in
+static void phase_end(uint32_t* phase_time_us)
+{
+    const int64_t now = esp_timer_get_time();
+
+    *phase_time_us = now - phase_start_time;
+    phase_start_time = now;
+}
+
+static void IRAM_ATTR cdone_isr(void* arg)
+{
+    BaseType_t xHigherPriorityTaskWoken = pdFALSE;
+
+    xSemaphoreGiveFromISR(cdone_semaphore, &xHigherPriorityTaskWoken);
+
+    if (xHigherPriorityTaskWoken)
+        portYIELD_FROM_ISR();
+}
+
 //! @brief Wait for the CDONE pin to reach the given state
 //!
+//! The task sleeps until the CDONE edge interrupt fires. If the interrupt
+//! couldn't be set up, the pin is polled instead, once per tick.
+//!
 //! \param value If true, wait till the pin is high, otherwise wait for it to be low.
 //! \param delay_ms Maximum time to wait for a pin change before timing out
 //! \return ESP_OK if pin value observed, ESP_FAIL on a timeout
 static esp_err_t cdone_pin_wait_for_value(bool value, uint32_t delay_ms)
 {
-    TickType_t timeout_time = xTaskGetTickCount() + pdMS_TO_TICKS(delay_ms);
+    if (cdone_semaphore == NULL) {
+        const int64_t timeout_time = esp_timer_get_time() + delay_ms * 1000;
 
-    bool pin_state;
-    do {
-        pin_state = gpio_get_level(CONFIG_FPGA_CDONE_GPIO) == 1;
+        while ((gpio_get_level(CONFIG_FPGA_CDONE_GPIO) == 1) != value) {
+            if (esp_timer_get_time() > timeout_time)
+                return ESP_FAIL;
 
-        if (xTaskGetTickCount() > timeout_time)
-            return ESP_FAIL;
-    } while (pin_state != value);
+            vTaskDelay(1);
+        }
+
+        return ESP_OK;
+    }
+
+    // Clear any edge left over from an earlier wait, then arm the interrupt
+    // before checking the pin, so that an edge in between isn't missed.
+    xSemaphoreTake(cdone_semaphore, 0);
+    gpio_set_intr_type(CONFIG_FPGA_CDONE_GPIO, value ? GPIO_INTR_POSEDGE : GPIO_INTR_NEGEDGE);
+    gpio_intr_enable(CONFIG_FPGA_CDONE_GPIO);
+
+    if ((gpio_get_level(CONFIG_FPGA_CDONE_GPIO) == 1) != value)
+        xSemaphoreTake(cdone_semaphore, pdMS_TO_TICKS(delay_ms) + 1);
+
+    gpio_intr_disable(CONFIG_FPGA_CDONE_GPIO);
+
+    if ((gpio_get_level(CONFIG_FPGA_CDONE_GPIO) == 1) != value)
+        return ESP_FAIL;
 
     return ESP_OK;
 }
@@ -91,6 +477,10 @@ esp_err_t fpga_loader_start() {
         return ESP_FAIL;
     }
 
+    memset(&load_stats, 0, sizeof(load_stats));
+    load_start_time = esp_timer_get_time();
+    phase_start_time = load_start_time;
+
     // Register a new SPI device with the ESP driver, to use for programming.
     // This new device has a lower speed and slightly different configuration
     // than the device used for ESP-FPGA application communication.
@@ -98,7 +488,7 @@ esp_err_t fpga_loader_start() {
         .clock_speed_hz = CONFIG_FPGA_SPI_FREQ_PROGRAMMING * 1000000,
         .mode = 3,
         .spics_io_num = -1,
-        .queue_size = 1,
+        .queue_size = LOADER_BUFFER_COUNT,
         .command_bits = 0,
         .address_bits = 0,
         .dummy_bits = 0,
@@ -117,7 +507,12 @@ esp_err_t fpga_loader_start() {
         return ret;
     }
 
-    // Claim exclusive use of the SPI bus for the programming device
+    // Claim exclusive use of the SPI bus for the programming device, until
+    // the load ends. The master SPI lock is taken first, as in fpga_comms,
+    // so that a polled transfer can't hold it while waiting for the bus.
+    master_spi_lock(portMAX_DELAY);
+    master_spi_locked = true;
+
     ret = spi_device_acquire_bus(fpga_update_device, portMAX_DELAY);
     if (ret != ESP_OK) {
         ESP_LOGE(TAG, "Error acquiring SPI bus");
@@ -142,13 +537,15 @@ esp_err_t fpga_loader_start() {
     gpio_matrix_out(CONFIG_FPGA_CS_GPIO, SIG_GPIO_OUT_IDX, false, false);
 
     // 3. Wait minimum of 200ns
-    vTaskDelay(1);
+    esp_rom_delay_us(1);
 
     // 4. Release CRESET_B
     reset_pin_set(1);
 
     // 5. Wait minimum of 1200uS
-    vTaskDelay(1);
+    // This is busy-waited, as a tick-based delay can be either far longer,
+    // or (when the next tick is close) shorter than required.
+    esp_rom_delay_us(1200);
 
     // 6. Set SPI_SS_B=1, send 8 dummy clocks
     gpio_set_level(CONFIG_FPGA_CS_GPIO, 1);
@@ -165,13 +562,23 @@ esp_err_t fpga_loader_start() {
 
     gpio_set_level(CONFIG_FPGA_CS_GPIO, 0);
 
-    dma_buf = heap_caps_malloc(CONFIG_FPGA_LOADER_SIZE, MALLOC_CAP_DMA);
-    if (dma_buf == NULL) {
-        ESP_LOGE(TAG, "Error acquiring dma_buf buffer");
-        fpga_loader_abort();
-        return ESP_FAIL;
+    for (int index = 0; index < LOADER_BUFFER_COUNT; index++) {
+        dma_bufs[index] = heap_caps_malloc(CONFIG_FPGA_LOADER_SIZE, MALLOC_CAP_DMA);
+        if (dma_bufs[index] == NULL) {
+            ESP_LOGE(TAG, "Error acquiring dma_buf buffer");
+            fpga_loader_abort();
+            return ESP_FAIL;
+        }
+        dma_queued[index] = false;
     }
 
+    dma_buf_index = 0;
+    dma_buf = dma_bufs[dma_buf_index];
+    dma_buf_fill = 0;
+    memset(&load_state, 0, sizeof(load_state));
+
+    phase_end(&load_stats.reset_time_us);
+
     return ESP_OK;
 }
 
@@ -181,19 +588,17 @@ esp_err_t fpga_loader_add_chunk(const char* chunk, const int length) {
     //    bit first, on falling edge of SPI_SCK. Send the entire image, without
     //    interruption. Ensure that SPI_SCK frequency is between 1 MHz and 25 MHz.
 
-    // TODO: Check that buffer is malloc'd correctly
-
     if (length > CONFIG_FPGA_LOADER_SIZE) {
         ESP_LOGE(TAG, "Firmware chunk too large, length:%i max_length:%i",
             length, CONFIG_FPGA_LOADER_SIZE);
         return ESP_FAIL;
     }
 
-    // Copy the chunk data into a DMA-capable memory
-    // TODO: Allow the caller to specify that it is already DMA-capable
-    memcpy(dma_buf, chunk, length);
+    load_stats.source_bytes += length;
 
-    esp_err_t ret = write_update_block(dma_buf, length);
+    // The chunk is copied (or decompressed) into DMA-capable memory, and
+    // sent whenever that fills up
+    esp_err_t ret = bitstream_add((const uint8_t*)chunk, length);
     if (ret != ESP_OK) {
         ESP_LOGE(TAG, "Error sending chunk");
         return ret;
@@ -203,6 +608,36 @@ esp_err_t fpga_loader_add_chunk(const char* chunk, const int length) {
 }
 
 esp_err_t fpga_loader_finalize() {
+    esp_err_t ret;
+
+    // The FPGA was reset by fpga_loader_start(), so whatever happens here, the
+    // registers no longer hold the values cached or staged for them
+    fpga_comms_register_cache_invalidate();
+
+    // A stream too short to check for the magic number is sent as-is
+    if (load_state.format == LOAD_FORMAT_UNKNOWN)
+        output_add(load_state.header, load_state.header_length);
+
+    if ((load_state.format == LOAD_FORMAT_RLE)
+        && ((load_state.rle_state != RLE_STATE_TOKEN)
+            || (load_state.output_count != load_state.size))) {
+        ESP_LOGE(TAG, "Compressed bitstream truncated, expected:%" PRIu32 " decompressed:%" PRIu32,
+            load_state.size, load_state.output_count);
+        fpga_loader_abort();
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    ret = output_flush();
+    if (ret == ESP_OK)
+        ret = dma_buf_wait_all();
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "Error sending chunk");
+        fpga_loader_abort();
+        return ret;
+    }
+
+    phase_end(&load_stats.bitstream_time_us);
+
     // 8. Wait for 100 clocks cycles for CDONE to go high
 
     gpio_set_level(CONFIG_FPGA_CS_GPIO, 1);
@@ -211,11 +646,13 @@ esp_err_t fpga_loader_finalize() {
     write_update_block(dma_buf, 13); //13*8 = 104
 
     // wait for CDONE signal to go high
-    esp_err_t ret = cdone_pin_wait_for_value(true, 100);
+    ret = cdone_pin_wait_for_value(true, 100);
     if (ret != ESP_OK) {
         ESP_LOGE(TAG, "Error waiting for CDONE to set");
     }
 
+    phase_end(&load_stats.cdone_time_us);
+
     // 9. Send a minimum of 49 additional dummy bits and 49 additional SPI_SCK
     //    clock cycles (rising-edge to rising-edge) to active the user-I/O pins.
 
@@ -225,6 +662,21 @@ esp_err_t fpga_loader_finalize() {
 
     // 10. SPI interface pins available as user-defined I/O pins in application.
 
+    phase_end(&load_stats.wake_time_us);
+    load_stats.total_time_us = esp_timer_get_time() - load_start_time;
+
+    ESP_LOGI(TAG, "Load done, us reset:%" PRIu32 " bitstream:%" PRIu32 " cdone:%" PRIu32 " wake:%" PRIu32 " total:%" PRIu32,
+        load_stats.reset_time_us,
+        load_stats.bitstream_time_us,
+        load_stats.cdone_time_us,
+        load_stats.wake_time_us,
+        load_stats.total_time_us);
+    ESP_LOGI(TAG, "Bitstream, source bytes:%zu bitstream bytes:%zu read us:%" PRIu32 " spi wait us:%" PRIu32,
+        load_stats.source_bytes,
+        load_stats.bitstream_bytes,
+        load_stats.source_time_us,
+        load_stats.spi_wait_time_us);
+
 
     // Release resources
     fpga_loader_abort();
@@ -232,10 +684,16 @@ esp_err_t fpga_loader_finalize() {
 }
 
 void fpga_loader_abort() {
-    if(dma_buf != NULL) {
-        heap_caps_free(dma_buf);
-        dma_buf = NULL;
+    if (fpga_update_device != NULL)
+        dma_buf_wait_all();
+
+    for (int index = 0; index < LOADER_BUFFER_COUNT; index++) {
+        if (dma_bufs[index] != NULL) {
+            heap_caps_free(dma_bufs[index]);
+            dma_bufs[index] = NULL;
+        }
     }
+    dma_buf = NULL;
 
     if(fpga_update_device != NULL) {
         // Release use of the SPI bus
@@ -243,6 +701,8 @@ void fpga_loader_abort() {
  
         // And remove the update device from the SPI bus
         esp_err_t ret = spi_bus_remove_device(fpga_update_device);
+        if (ret != ESP_OK)
+            ESP_LOGE(TAG, "Error removing update device, error:%s", esp_err_to_name(ret));
         fpga_update_device = NULL;
     }
 
@@ -250,30 +710,72 @@ void fpga_loader_abort() {
     // Porting note: This assumes that the output SPI bus uses HSPICS0.
     gpio_set_level(CONFIG_FPGA_CS_GPIO, 1);
     gpio_matrix_out(CONFIG_FPGA_CS_GPIO, FSPICS0_OUT_IDX, false, false); // TODO: FPSI should be using hardware pins, not GPIO
+
+    if (master_spi_locked) {
+        master_spi_locked = false;
+        master_spi_unlock();
+    }
 }
 
+//! @brief Load the FPGA from a firmware source
+//!
+//! The source may hold a raw or a compressed bitstream (see fpga_loader.h).
+//! A raw bitstream is read straight into the free part of dma_buf. A
+//! compressed one is read into a staging buffer, and decompressed from there
+//! into dma_buf. Each full DMA buffer is queued to the SPI driver, so the
+//! next chunk is read while the previous one is being sent.
 static esp_err_t fpga_loader_load(fpga_firmware_source_t* firmware_source)
 {
-    esp_err_t ret;
+    // Only allocated for compressed bitstreams
+    uint8_t* source_buf = NULL;
 
-    ret = fpga_loader_start();
+    esp_err_t ret = fpga_loader_start();
+    if (ret != ESP_OK) {
+        return ret;
+    }
 
     size_t bytes_remaining = firmware_source->size;
 
     while (bytes_remaining > 0) {
-        size_t chunk_size = bytes_remaining;
-        if (chunk_size > CONFIG_FPGA_LOADER_SIZE)
-            chunk_size = CONFIG_FPGA_LOADER_SIZE;
+        const bool in_place = (load_state.format != LOAD_FORMAT_RLE);
+
+        size_t chunk_size = in_place ? (CONFIG_FPGA_LOADER_SIZE - dma_buf_fill) : CONFIG_FPGA_LOADER_SIZE;
+        if (chunk_size > bytes_remaining)
+            chunk_size = bytes_remaining;
 
-        const size_t read_size = firmware_source->read(dma_buf, chunk_size, firmware_source->ctx);
+        uint8_t* chunk = in_place ? (uint8_t*)dma_buf + dma_buf_fill : source_buf;
+
+        const int64_t read_start_time = esp_timer_get_time();
+        const size_t read_size = firmware_source->read(chunk, chunk_size, firmware_source->ctx);
+        load_stats.source_time_us += esp_timer_get_time() - read_start_time;
+        load_stats.source_bytes += read_size;
         if (read_size != chunk_size) {
-            //ret = ESP_FAIL;
-            ESP_LOGE(TAG, "Error reading firmware, expected:%i read:%i",
+            ret = ESP_FAIL;
+            ESP_LOGE(TAG, "Error reading firmware, expected:%zu read:%zu",
                 chunk_size, read_size);
             break;
         }
 
-        ret = write_update_block(dma_buf, chunk_size);
+        if (in_place && bitstream_is_raw(chunk, chunk_size)) {
+            ret = output_commit(chunk_size);
+        } else {
+            // Compressed data is moved out of dma_buf before it is
+            // decompressed into it. This only happens for the first chunk.
+            if (in_place) {
+                if (source_buf == NULL)
+                    source_buf = malloc(CONFIG_FPGA_LOADER_SIZE);
+                if (source_buf == NULL) {
+                    ESP_LOGE(TAG, "Error acquiring source buffer");
+                    ret = ESP_ERR_NO_MEM;
+                    break;
+                }
+
+                memcpy(source_buf, chunk, chunk_size);
+            }
+
+            ret = bitstream_add(source_buf, chunk_size);
+        }
+
         if (ret != ESP_OK) {
             ESP_LOGE(TAG, "Error sending chunk");
             break;
@@ -282,9 +784,14 @@ static esp_err_t fpga_loader_load(fpga_firmware_source_t* firmware_source)
         bytes_remaining -= chunk_size;
     }
 
-    ret = fpga_loader_finalize();
+    free(source_buf);
 
-    return ret;
+    if (ret != ESP_OK) {
+        fpga_loader_abort();
+        return ret;
+    }
+
+    return fpga_loader_finalize();
 }
 
 static size_t fpga_loader_file_read(void* buffer, size_t size, void* ctx)
@@ -301,7 +808,7 @@ esp_err_t fpga_loader_load_from_file(const char* filename)
     }
 
     const size_t file_size = file_stat.st_size;
-    ESP_LOGI(TAG, "File:%s size:%i", filename, file_size);
+    ESP_LOGI(TAG, "File:%s size:%zu", filename, file_size);
 
     ESP_LOGI(TAG, "Opening firmware file");
     FILE* firmware_file;
@@ -317,11 +824,11 @@ esp_err_t fpga_loader_load_from_file(const char* filename)
         .read = &fpga_loader_file_read,
     };
 
-    fpga_loader_load(&firmware_source);
+    esp_err_t ret = fpga_loader_load(&firmware_source);
 
     fclose(firmware_file);
 
-    return ESP_OK;
+    return ret;
 }
 
 //! @brief Load an FPGA image
@@ -372,7 +879,7 @@ esp_err_t fpga_loader_load_from_rom(const fpga_bin_t* fpga_bin)
 
     // TODO: size check
 
-    ESP_LOGI(TAG, "Loading FPGA binary, size:%i", read_ctx.data_size);
+    ESP_LOGI(TAG, "Loading FPGA binary, size:%zu", read_ctx.data_size);
 
     fpga_firmware_source_t firmware_source = {
         .size = read_ctx.data_size,
@@ -380,8 +887,15 @@ esp_err_t fpga_loader_load_from_rom(const fpga_bin_t* fpga_bin)
         .read = &fpga_loader_rom_read,
     };
 
-    fpga_loader_load(&firmware_source);
+    return fpga_loader_load(&firmware_source);
+}
+
+esp_err_t fpga_loader_stats_get(fpga_loader_stats_t* stats)
+{
+    if (stats == NULL)
+        return ESP_ERR_INVALID_ARG;
 
+    *stats = load_stats;
     return ESP_OK;
 }
 
@@ -403,10 +917,36 @@ esp_err_t fpga_loader_init()
         .mode = GPIO_MODE_INPUT,
         .pull_up_en = GPIO_PULLUP_DISABLE,
         .pull_down_en = GPIO_PULLDOWN_DISABLE,
-        .intr_type = GPIO_INTR_DISABLE,
+        .intr_type = GPIO_INTR_POSEDGE,
     };
 
     gpio_config(&cdone_pin);
+    gpio_intr_disable(CONFIG_FPGA_CDONE_GPIO);
+
+    if (cdone_semaphore != NULL)
+        return ESP_OK;
+
+    // The application may have installed the ISR service already
+    esp_err_t ret = gpio_install_isr_service(0);
+    if ((ret != ESP_OK) && (ret != ESP_ERR_INVALID_STATE)) {
+        ESP_LOGE(TAG, "Error installing GPIO ISR service, polling CDONE instead");
+        return ESP_OK;
+    }
+
+    SemaphoreHandle_t semaphore = xSemaphoreCreateBinary();
+    if (semaphore == NULL) {
+        ESP_LOGE(TAG, "Error creating CDONE semaphore, polling CDONE instead");
+        return ESP_OK;
+    }
+
+    cdone_semaphore = semaphore;
+
+    ret = gpio_isr_handler_add(CONFIG_FPGA_CDONE_GPIO, cdone_isr, NULL);
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "Error adding CDONE ISR, polling CDONE instead");
+        cdone_semaphore = NULL;
+        vSemaphoreDelete(semaphore);
+    }
 
     return ESP_OK;
 }
@@ -0,0 +1,402 @@
+#include "fpga_slots.h"
+#include <esp_log.h>
+#include <esp_partition.h>
+#include <esp_spi_flash.h>
+#include <mbedtls/sha256.h>
+#include <stdbool.h>
+#include <string.h>
+
+static const char TAG[] = "fpga_slots";
+
+//! Marks a slot header as valid. Erased flash reads as 0xFFFFFFFF, and an
+//! erased (replaced) slot has this overwritten with 0.
+#define SLOT_MAGIC 0x53475046 // 'FPGS'
+
+//! Space reserved for the header at the start of each slot
+#define SLOT_HEADER_SIZE 128
+
+//! Header stored at the start of each slot
+typedef struct {
+    uint32_t magic;
+    uint32_t sequence; //!< Write counter, to pick the newest of two slots with the same name
+    uint32_t version;
+    uint32_t size;
+    uint8_t hash[FPGA_SLOTS_HASH_SIZE];
+    char name[FPGA_SLOTS_NAME_MAX + 1];
+} slot_header_t;
+
+_Static_assert(sizeof(slot_header_t) <= SLOT_HEADER_SIZE, "Slot header too large");
+
+//! Partition holding the slots
+static const esp_partition_t* partition = NULL;
+
+//! Size of each slot, including the header. A multiple of the flash sector size.
+static size_t slot_size = 0;
+
+//! State of the write in progress
+static struct {
+    bool active;
+    int slot; //!< Slot being written
+    int replaces; //!< Slot holding the previous bitstream with the same name, or -1
+    slot_header_t header; //!< Header to write once the data is complete
+    size_t written; //!< Bytes of data written so far
+    mbedtls_sha256_context sha256;
+} write_state;
+
+//! @brief Get the offset of a slot in the partition
+static size_t slot_offset(int slot)
+{
+    return slot * slot_size;
+}
+
+//! @brief Read and check the header of a slot
+//!
+//! @return ESP_OK if the slot holds a bitstream, ESP_ERR_NOT_FOUND if it is
+//!         empty, error code otherwise
+static esp_err_t slot_header_read(int slot, slot_header_t* header)
+{
+    esp_err_t ret = esp_partition_read(partition, slot_offset(slot), header, sizeof(*header));
+    if (ret != ESP_OK)
+        return ret;
+
+    if ((header->magic != SLOT_MAGIC)
+        || (header->size > fpga_slots_size_max())
+        || (memchr(header->name, '\0', sizeof(header->name)) == NULL))
+        return ESP_ERR_NOT_FOUND;
+
+    return ESP_OK;
+}
+
+//! @brief Check whether a slot header was written after another
+static bool slot_header_newer(const slot_header_t* header, const slot_header_t* other)
+{
+    // Wrap-safe comparison of the write counters
+    return (int32_t)(header->sequence - other->sequence) > 0;
+}
+
+//! @brief Get the write counter for a new slot, one past the newest in use
+static uint32_t slot_sequence_next()
+{
+    uint32_t sequence = 0;
+    bool found = false;
+    for (int i = 0; i < CONFIG_FPGA_SLOTS_COUNT; i++) {
+        slot_header_t header;
+        if (slot_header_read(i, &header) != ESP_OK)
+            continue;
+
+        if (!found || (int32_t)(header.sequence - sequence) > 0)
+            sequence = header.sequence;
+        found = true;
+    }
+
+    return sequence + 1;
+}
+
+//! @brief Mark a slot as empty, without erasing it
+static esp_err_t slot_invalidate(int slot)
+{
+    // Flash bits can be cleared without an erase
+    const uint32_t magic = 0;
+    return esp_partition_write(partition, slot_offset(slot), &magic, sizeof(magic));
+}
+
+esp_err_t fpga_slots_init()
+{
+    if (partition != NULL)
+        return ESP_OK;
+
+    partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY,
+        CONFIG_FPGA_SLOTS_PARTITION_LABEL);
+    if (partition == NULL) {
+        ESP_LOGE(TAG, "No bitstream partition, label:%s", CONFIG_FPGA_SLOTS_PARTITION_LABEL);
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    slot_size = (partition->size / CONFIG_FPGA_SLOTS_COUNT) & ~(SPI_FLASH_SEC_SIZE - 1);
+
+    ESP_LOGI(TAG, "Bitstream partition, slots:%i slot size:%u",
+        CONFIG_FPGA_SLOTS_COUNT, slot_size);
+
+    return ESP_OK;
+}
+
+int fpga_slots_count()
+{
+    return CONFIG_FPGA_SLOTS_COUNT;
+}
+
+size_t fpga_slots_size_max()
+{
+    if (slot_size < SLOT_HEADER_SIZE)
+        return 0;
+
+    return slot_size - SLOT_HEADER_SIZE;
+}
+
+esp_err_t fpga_slots_info_get(int slot, fpga_slot_info_t* info)
+{
+    if ((slot < 0) || (slot >= CONFIG_FPGA_SLOTS_COUNT) || (info == NULL))
+        return ESP_ERR_INVALID_ARG;
+
+    esp_err_t ret = fpga_slots_init();
+    if (ret != ESP_OK)
+        return ret;
+
+    slot_header_t header;
+    ret = slot_header_read(slot, &header);
+    if (ret != ESP_OK)
+        return ret;
+
+    strlcpy(info->name, header.name, sizeof(info->name));
+    info->version = header.version;
+    info->size = header.size;
+    memcpy(info->hash, header.hash, FPGA_SLOTS_HASH_SIZE);
+
+    return ESP_OK;
+}
+
+esp_err_t fpga_slots_find(const char* name, int* slot)
+{
+    if ((name == NULL) || (slot == NULL))
+        return ESP_ERR_INVALID_ARG;
+
+    esp_err_t ret = fpga_slots_init();
+    if (ret != ESP_OK)
+        return ret;
+
+    // A reset between writing a new header and invalidating the slot it
+    // replaces leaves two slots with the same name; the newest one wins.
+    int found = -1;
+    slot_header_t found_header;
+    for (int i = 0; i < CONFIG_FPGA_SLOTS_COUNT; i++) {
+        // Skip the slot being written, until it is complete
+        if (write_state.active && (write_state.slot == i))
+            continue;
+
+        slot_header_t header;
+        if ((slot_header_read(i, &header) != ESP_OK) || (strcmp(header.name, name) != 0))
+            continue;
+
+        if ((found < 0) || slot_header_newer(&header, &found_header)) {
+            found = i;
+            found_header = header;
+        }
+    }
+
+    if (found < 0)
+        return ESP_ERR_NOT_FOUND;
+
+    *slot = found;
+    return ESP_OK;
+}
+
+esp_err_t fpga_slots_write_start(const char* name, uint32_t version, size_t size)
+{
+    if ((name == NULL) || (name[0] == '\0') || (strlen(name) > FPGA_SLOTS_NAME_MAX))
+        return ESP_ERR_INVALID_ARG;
+
+    if (write_state.active)
+        return ESP_ERR_INVALID_STATE;
+
+    esp_err_t ret = fpga_slots_init();
+    if (ret != ESP_OK)
+        return ret;
+
+    if ((size == 0) || (size > fpga_slots_size_max())) {
+        ESP_LOGE(TAG, "Bitstream doesn't fit in a slot, size:%u max:%u",
+            size, fpga_slots_size_max());
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    // Prefer an empty slot, so the old bitstream survives a failed write
+    int replaces = -1;
+    fpga_slots_find(name, &replaces);
+
+    int slot = -1;
+    for (int i = 0; i < CONFIG_FPGA_SLOTS_COUNT; i++) {
+        slot_header_t header;
+        if (slot_header_read(i, &header) == ESP_ERR_NOT_FOUND) {
+            slot = i;
+            break;
+        }
+    }
+
+    if (slot < 0) {
+        if (replaces < 0) {
+            ESP_LOGE(TAG, "No free slot for bitstream:%s", name);
+            return ESP_ERR_NO_MEM;
+        }
+
+        slot = replaces;
+        replaces = -1;
+    }
+
+    // Only the sectors that will be written need erasing
+    const size_t erase_size = (SLOT_HEADER_SIZE + size + SPI_FLASH_SEC_SIZE - 1)
+        & ~(SPI_FLASH_SEC_SIZE - 1);
+
+    ret = esp_partition_erase_range(partition, slot_offset(slot), erase_size);
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "Error erasing slot:%i", slot);
+        return ret;
+    }
+
+    memset(&write_state, 0, sizeof(write_state));
+    write_state.slot = slot;
+    write_state.replaces = replaces;
+    write_state.header.magic = SLOT_MAGIC;
+    write_state.header.sequence = slot_sequence_next();
+    write_state.header.version = version;
+    write_state.header.size = size;
+    strlcpy(write_state.header.name, name, sizeof(write_state.header.name));
+
+    mbedtls_sha256_init(&write_state.sha256);
+    mbedtls_sha256_starts_ret(&write_state.sha256, 0);
+
+    write_state.active = true;
+
+    ESP_LOGI(TAG, "Writing bitstream:%s version:%u size:%u slot:%i",
+        name, version, size, slot);
+
+    return ESP_OK;
+}
+
+esp_err_t fpga_slots_write_chunk(const char* chunk, const int length)
+{
+    if (!write_state.active)
+        return ESP_ERR_INVALID_STATE;
+
+    if ((length < 0) || (write_state.written + length > write_state.header.size)) {
+        ESP_LOGE(TAG, "Too much data for bitstream, size:%u", write_state.header.size);
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    esp_err_t ret = esp_partition_write(partition,
+        slot_offset(write_state.slot) + SLOT_HEADER_SIZE + write_state.written,
+        chunk, length);
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "Error writing slot:%i", write_state.slot);
+        return ret;
+    }
+
+    mbedtls_sha256_update_ret(&write_state.sha256, (const uint8_t*)chunk, length);
+    write_state.written += length;
+
+    return ESP_OK;
+}
+
+esp_err_t fpga_slots_write_finalize()
+{
+    if (!write_state.active)
+        return ESP_ERR_INVALID_STATE;
+
+    if (write_state.written != write_state.header.size) {
+        ESP_LOGE(TAG, "Bitstream incomplete, size:%u written:%u",
+            write_state.header.size, write_state.written);
+        fpga_slots_write_abort();
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    mbedtls_sha256_finish_ret(&write_state.sha256, write_state.header.hash);
+    mbedtls_sha256_free(&write_state.sha256);
+
+    // The header goes in last, so a partial write leaves the slot empty
+    esp_err_t ret = esp_partition_write(partition, slot_offset(write_state.slot),
+        &write_state.header, sizeof(write_state.header));
+    write_state.active = false;
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "Error writing header, slot:%i", write_state.slot);
+        return ret;
+    }
+
+    if (write_state.replaces >= 0) {
+        ret = slot_invalidate(write_state.replaces);
+        if (ret != ESP_OK)
+            ESP_LOGE(TAG, "Error removing old bitstream, slot:%i", write_state.replaces);
+    }
+
+    return ret;
+}
+
+void fpga_slots_write_abort()
+{
+    if (!write_state.active)
+        return;
+
+    mbedtls_sha256_free(&write_state.sha256);
+    write_state.active = false;
+}
+
+esp_err_t fpga_slots_erase(const char* name)
+{
+    int slot;
+    esp_err_t ret = fpga_slots_find(name, &slot);
+    if (ret != ESP_OK)
+        return ret;
+
+    // Remove any older copies too, so they don't reappear
+    do {
+        ESP_LOGI(TAG, "Erasing bitstream:%s slot:%i", name, slot);
+        ret = slot_invalidate(slot);
+    } while ((ret == ESP_OK) && (fpga_slots_find(name, &slot) == ESP_OK));
+
+    return ret;
+}
+
+//! @brief Check the bitstream in a slot against the hash in its header
+static esp_err_t slot_hash_check(const slot_header_t* header, const void* data)
+{
+    uint8_t hash[FPGA_SLOTS_HASH_SIZE];
+    const int ret = mbedtls_sha256_ret(data, header->size, hash, 0);
+    if (ret != 0)
+        return ESP_FAIL;
+
+    if (memcmp(hash, header->hash, sizeof(hash)) != 0)
+        return ESP_ERR_INVALID_CRC;
+
+    return ESP_OK;
+}
+
+esp_err_t fpga_slots_load(const char* name)
+{
+    int slot;
+    esp_err_t ret = fpga_slots_find(name, &slot);
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "No bitstream:%s", name);
+        return ret;
+    }
+
+    slot_header_t header;
+    ret = slot_header_read(slot, &header);
+    if (ret != ESP_OK)
+        return ret;
+
+    const void* data;
+    spi_flash_mmap_handle_t mmap_handle;
+    ret = esp_partition_mmap(partition, slot_offset(slot) + SLOT_HEADER_SIZE, header.size,
+        SPI_FLASH_MMAP_DATA, &data, &mmap_handle);
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "Error mapping slot:%i", slot);
+        return ret;
+    }
+
+    ret = slot_hash_check(&header, data);
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "Bitstream:%s corrupt, slot:%i", name, slot);
+        spi_flash_munmap(mmap_handle);
+        return ret;
+    }
+
+    ESP_LOGI(TAG, "Loading bitstream:%s version:%u slot:%i", name, header.version, slot);
+
+    const fpga_bin_t fpga_bin = {
+        .start = data,
+        .end = (const uint8_t*)data + header.size,
+    };
+
+    ret = fpga_loader_load_from_rom(&fpga_bin);
+
+    spi_flash_munmap(mmap_handle);
+
+    return ret;
+}
@@ -179,10 +179,6 @@ static esp_err_t json_put_handler(httpd_req_t* req)
 
 static esp_err_t json_get_handler(httpd_req_t* req)
 {
-    // Handle messages up to 600 bytes
-    char buf[600];
-
-
     // Pass it to the context
     cJSON* response = NULL;
     const esp_err_t err = ((http_api_json_get_callback_t)req->user_ctx)(req, &response);
@@ -193,12 +189,19 @@ static esp_err_t json_get_handler(httpd_req_t* req)
         return err;
     }
 
-    // TODO:Pack message and send response
-    cJSON_PrintPreallocated(response, buf, sizeof(buf), true);
+    // Pack message and send response
+    char* buf = cJSON_Print(response);
     cJSON_Delete(response);
 
+    if (buf == NULL) {
+        ESP_LOGE(TAG, "Error printing JSON response");
+        RESPOND_ERROR(HTTPD_500_INTERNAL_SERVER_ERROR, "Error creating response");
+        return ESP_FAIL;
+    }
+
     httpd_resp_set_type(req, "application/json");
     httpd_resp_sendstr(req, buf);
+    cJSON_free(buf);
 
     return ESP_OK;
 }
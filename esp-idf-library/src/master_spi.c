@@ -1,11 +1,53 @@
 #include "master_spi.h"
 #include <driver/spi_master.h>
 #include <esp_log.h>
+#include <esp_timer.h>
+#include <inttypes.h>
+#include <string.h>
 
 static const char * TAG = "MASTER_SPI";
 
 SemaphoreHandle_t master_spi_semaphore;
 
+#ifdef CONFIG_FPGA_MASTER_SPI_LOCK_STATS
+//! Per-task statistics. The last entry collects tasks that don't fit.
+static master_spi_lock_stats_t lock_stats[MASTER_SPI_LOCK_OWNERS_MAX + 1];
+static int lock_stats_count = 0;
+
+//! Guards lock_stats
+static portMUX_TYPE lock_stats_lock = portMUX_INITIALIZER_UNLOCKED;
+
+// Statistics entry and start time of the current lock holder
+static master_spi_lock_stats_t* lock_holder_stats = NULL;
+static int64_t lock_acquired_time = 0;
+
+//! @brief Find the statistics entry for the current task, adding it if needed
+//!
+//! Must be called with lock_stats_lock held
+static master_spi_lock_stats_t* lock_stats_find()
+{
+    const TaskHandle_t task = xTaskGetCurrentTaskHandle();
+
+    for (int i = 0; i < lock_stats_count; i++) {
+        if (lock_stats[i].task == task)
+            return &lock_stats[i];
+    }
+
+    if (lock_stats_count < MASTER_SPI_LOCK_OWNERS_MAX) {
+        master_spi_lock_stats_t* stats = &lock_stats[lock_stats_count++];
+        memset(stats, 0, sizeof(*stats));
+        stats->task = task;
+        strlcpy(stats->name, pcTaskGetName(NULL), sizeof(stats->name));
+        return stats;
+    }
+
+    master_spi_lock_stats_t* stats = &lock_stats[MASTER_SPI_LOCK_OWNERS_MAX];
+    if (stats->name[0] == '\0')
+        strlcpy(stats->name, "other", sizeof(stats->name));
+    return stats;
+}
+#endif
+
 esp_err_t master_spi_init()
 {
     if (master_spi_semaphore == NULL)
@@ -17,10 +59,152 @@ esp_err_t master_spi_init()
         .sclk_io_num = CONFIG_FPGA_SCLK_GPIO,
         .quadwp_io_num = CONFIG_FPGA_WP_GPIO,
         .quadhd_io_num = CONFIG_FPGA_HD_GPIO,
-        .max_transfer_sz = CONFIG_FPGA_SPI_BUFFER_SIZE * 4,
+        // Large enough for both fpga_comms and fpga_loader transfers
+        .max_transfer_sz = (CONFIG_FPGA_LOADER_CHUNK_SIZE > CONFIG_FPGA_SPI_BUFFER_SIZE * 4)
+            ? CONFIG_FPGA_LOADER_CHUNK_SIZE
+            : CONFIG_FPGA_SPI_BUFFER_SIZE * 4,
         //.flags = SPICOMMON_BUSFLAG_MASTER | SPICOMMON_BUSFLAG_IOMUX_PINS, // TODO: Fix WP connection in RevB
         .flags = SPICOMMON_BUSFLAG_MASTER | SPICOMMON_BUSFLAG_GPIO_PINS,
     };
 
     return spi_bus_initialize(FSPI_HOST, &buscfg, SPI_DMA_CH_AUTO);
 }
+
+esp_err_t master_spi_lock(TickType_t timeout)
+{
+#ifdef CONFIG_FPGA_MASTER_SPI_LOCK_STATS
+    const int64_t start_time = esp_timer_get_time();
+
+    // Try without waiting first, to tell whether the lock was contended
+    bool contended = false;
+    if (xSemaphoreTake(master_spi_semaphore, 0) != pdTRUE) {
+        contended = true;
+        if (xSemaphoreTake(master_spi_semaphore, timeout) != pdTRUE) {
+            return ESP_ERR_TIMEOUT;
+        }
+    }
+
+    const int64_t acquired_time = esp_timer_get_time();
+    const uint32_t wait_time_us = acquired_time - start_time;
+
+    portENTER_CRITICAL(&lock_stats_lock);
+    master_spi_lock_stats_t* stats = lock_stats_find();
+    stats->acquisitions++;
+    if (contended)
+        stats->contended++;
+    stats->wait_time_us_total += wait_time_us;
+    if (wait_time_us > stats->wait_time_us_max)
+        stats->wait_time_us_max = wait_time_us;
+
+    lock_holder_stats = stats;
+    lock_acquired_time = acquired_time;
+    portEXIT_CRITICAL(&lock_stats_lock);
+#else
+    if (xSemaphoreTake(master_spi_semaphore, timeout) != pdTRUE) {
+        return ESP_ERR_TIMEOUT;
+    }
+#endif
+
+    return ESP_OK;
+}
+
+void master_spi_unlock()
+{
+#ifdef CONFIG_FPGA_MASTER_SPI_LOCK_STATS
+    const uint32_t hold_time_us = esp_timer_get_time() - lock_acquired_time;
+
+    portENTER_CRITICAL(&lock_stats_lock);
+    // NULL if the statistics were reset while the lock was held
+    master_spi_lock_stats_t* stats = lock_holder_stats;
+    if (stats != NULL) {
+        stats->hold_time_us_total += hold_time_us;
+        if (hold_time_us > stats->hold_time_us_max)
+            stats->hold_time_us_max = hold_time_us;
+    }
+    lock_holder_stats = NULL;
+    portEXIT_CRITICAL(&lock_stats_lock);
+#endif
+
+    xSemaphoreGive(master_spi_semaphore);
+}
+
+esp_err_t master_spi_queue_trans_batch(spi_device_handle_t device, spi_transaction_t* const* transactions, int count, int* queued)
+{
+    if (queued != NULL) {
+        *queued = 0;
+    }
+
+    if ((transactions == NULL) || (count < 0)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    master_spi_lock(portMAX_DELAY);
+
+    esp_err_t ret = ESP_OK;
+    int index = 0;
+    for (; index < count; index++) {
+        ret = spi_device_queue_trans(device, transactions[index], portMAX_DELAY);
+        if (ret != ESP_OK) {
+            ESP_LOGE(TAG, "Error queueing transaction, index:%i error:%s", index, esp_err_to_name(ret));
+            break;
+        }
+    }
+
+    master_spi_unlock();
+
+    if (queued != NULL) {
+        *queued = index;
+    }
+
+    return ret;
+}
+
+int master_spi_lock_stats_get(master_spi_lock_stats_t* stats, int count)
+{
+    if ((stats == NULL) || (count <= 0)) {
+        return 0;
+    }
+
+    int copied = 0;
+
+#ifdef CONFIG_FPGA_MASTER_SPI_LOCK_STATS
+    portENTER_CRITICAL(&lock_stats_lock);
+    for (int i = 0; (i < lock_stats_count) && (copied < count); i++) {
+        stats[copied++] = lock_stats[i];
+    }
+    if ((lock_stats[MASTER_SPI_LOCK_OWNERS_MAX].acquisitions > 0) && (copied < count)) {
+        stats[copied++] = lock_stats[MASTER_SPI_LOCK_OWNERS_MAX];
+    }
+    portEXIT_CRITICAL(&lock_stats_lock);
+#endif
+
+    return copied;
+}
+
+void master_spi_lock_stats_reset()
+{
+#ifdef CONFIG_FPGA_MASTER_SPI_LOCK_STATS
+    portENTER_CRITICAL(&lock_stats_lock);
+    memset(lock_stats, 0, sizeof(lock_stats));
+    lock_stats_count = 0;
+    lock_holder_stats = NULL;
+    portEXIT_CRITICAL(&lock_stats_lock);
+#endif
+}
+
+void master_spi_lock_stats_print()
+{
+    master_spi_lock_stats_t stats[MASTER_SPI_LOCK_OWNERS_MAX + 1];
+    const int count = master_spi_lock_stats_get(stats, MASTER_SPI_LOCK_OWNERS_MAX + 1);
+
+    for (int i = 0; i < count; i++) {
+        ESP_LOGI(TAG, "bus lock task:%s acquisitions:%" PRIu32 " contended:%" PRIu32 " wait_us_avg:%" PRIu32 " wait_us_max:%" PRIu32 " hold_us_avg:%" PRIu32 " hold_us_max:%" PRIu32,
+            stats[i].name,
+            stats[i].acquisitions,
+            stats[i].contended,
+            stats[i].acquisitions ? stats[i].wait_time_us_total / stats[i].acquisitions : 0,
+            stats[i].wait_time_us_max,
+            stats[i].acquisitions ? stats[i].hold_time_us_total / stats[i].acquisitions : 0,
+            stats[i].hold_time_us_max);
+    }
+}
@@ -1,9 +1,13 @@
 #include "output_trans_pool.h"
 #include <driver/spi_master.h>
 #include <esp_log.h>
+#include <esp_timer.h>
 #include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
 #include <freertos/task.h>
+#include <inttypes.h>
 #include <stdbool.h>
+#include <stdint.h>
 
 static const char TAG[] = "output_trans_pool";
 
@@ -13,75 +17,183 @@ output_trans_pool_stats_t output_trans_pool_stats = {
     .failures = 0,
     .double_releases = 0,
     .unowned_releases = 0,
+    .wait_time_us_total = 0,
+    .wait_time_us_max = 0,
+    .wake_latency_us_total = 0,
+    .wake_latency_us_max = 0,
 };
 
 static output_trans_pool_t output_trans_pools[CONFIG_FPGA_SPI_BUFFER_COUNT];
 
+//! Head of the list of free pool entries
+static output_trans_pool_t* free_list = NULL;
+
+//! Guards free_list and the in_use flags. Taken from both task and ISR context.
+static portMUX_TYPE free_list_lock = portMUX_INITIALIZER_UNLOCKED;
+
+//! Counts the entries on free_list. Given from the ISR when a buffer is released.
+static SemaphoreHandle_t free_count_semaphore = NULL;
+
+//! Time of the most recent release into an empty pool, which is the release
+//! that wakes a waiting task. Used to measure how long the waiter takes to
+//! run. Guarded by free_list_lock, as a 64-bit access is not atomic on the ESP32.
+static int64_t refill_time_us = 0;
+
 void output_trans_pool_init()
 {
-    for (int index = 0; index < CONFIG_FPGA_SPI_BUFFER_COUNT; index++) {
+    free_list = NULL;
+    UBaseType_t free_count = 0;
+
+    for (int index = CONFIG_FPGA_SPI_BUFFER_COUNT - 1; index >= 0; index--) {
         output_trans_pool_t* output_trans_pool = &output_trans_pools[index];
 
         output_trans_pool->in_use = false;
-        output_trans_pool->buffer = heap_caps_malloc(CONFIG_FPGA_SPI_BUFFER_SIZE, MALLOC_CAP_DMA);
+        output_trans_pool->buffer = heap_caps_malloc(
+            CONFIG_FPGA_SPI_BUFFER_SIZE + OUTPUT_TRANS_POOL_BUFFER_PADDING,
+            MALLOC_CAP_DMA);
 
         if (output_trans_pool->buffer == NULL) {
             ESP_LOGE(TAG, "Failed to allocate memory for output buffer, index=%i", index);
-            // TODO: Fail
+            // Leave the entry off the free list, so it is never handed out
+            output_trans_pool->in_use = true;
             continue;
         }
+
+        output_trans_pool->next = free_list;
+        free_list = output_trans_pool;
+        free_count++;
+    }
+
+    free_count_semaphore = xSemaphoreCreateCounting(CONFIG_FPGA_SPI_BUFFER_COUNT, free_count);
+    if (free_count_semaphore == NULL) {
+        ESP_LOGE(TAG, "Failed to create free count semaphore");
     }
 }
 
+void output_trans_pool_stats_print()
+{
+    ESP_LOGI(TAG, "requests:%" PRIu32 " retries:%" PRIu32 " failures:%" PRIu32 " double_releases:%" PRIu32 " unowned_releases:%" PRIu32,
+        output_trans_pool_stats.requests,
+        output_trans_pool_stats.retries,
+        output_trans_pool_stats.failures,
+        output_trans_pool_stats.double_releases,
+        output_trans_pool_stats.unowned_releases);
+    ESP_LOGI(TAG, "wait_time_us total:%" PRIu32 " max:%" PRIu32 " wake_latency_us total:%" PRIu32 " max:%" PRIu32,
+        output_trans_pool_stats.wait_time_us_total,
+        output_trans_pool_stats.wait_time_us_max,
+        output_trans_pool_stats.wake_latency_us_total,
+        output_trans_pool_stats.wake_latency_us_max);
+}
+
 static output_trans_pool_t* IRAM_ATTR get_free_buffer()
 {
-    // Grab the next available buffer from the pool
-    for (int index = 0; index < CONFIG_FPGA_SPI_BUFFER_COUNT; index++) {
-        if (!output_trans_pools[index].in_use) {
-            output_trans_pools[index].in_use = true;
-            return &output_trans_pools[index];
-        }
+    // Pop the head of the free list
+    portENTER_CRITICAL_SAFE(&free_list_lock);
+
+    output_trans_pool_t* output_trans_pool = free_list;
+    if (output_trans_pool != NULL) {
+        free_list = output_trans_pool->next;
+        output_trans_pool->next = NULL;
+        output_trans_pool->in_use = true;
     }
 
-    return NULL;
+    portEXIT_CRITICAL_SAFE(&free_list_lock);
+
+    return output_trans_pool;
 }
 
-output_trans_pool_t* IRAM_ATTR output_trans_pool_take(int retry_count)
+output_trans_pool_t* IRAM_ATTR output_trans_pool_take_wait(TickType_t timeout)
 {
     output_trans_pool_stats.requests++;
 
-    output_trans_pool_t* output_trans_pool = NULL;
+    // Fast path: a buffer is already available
+    if (xSemaphoreTake(free_count_semaphore, 0) == pdTRUE)
+        return get_free_buffer();
 
-    while (true) {
-        output_trans_pool = get_free_buffer();
+    if (timeout == 0) {
+        output_trans_pool_stats.failures++;
+        return NULL;
+    }
 
-        if (output_trans_pool != NULL)
-            return output_trans_pool;
+    // Slow path: block until the ISR releases a buffer, or the timeout expires
+    output_trans_pool_stats.retries++;
+    const int64_t wait_start_us = esp_timer_get_time();
 
-        if (retry_count > 0) {
-            output_trans_pool_stats.retries++;
-            retry_count--;
-            vTaskDelay(pdMS_TO_TICKS(POLLING_DELAY_MS));
-        } else {
-            output_trans_pool_stats.failures++;
-            return NULL;
-        }
+    if (xSemaphoreTake(free_count_semaphore, timeout) != pdTRUE) {
+        output_trans_pool_stats.failures++;
+        return NULL;
     }
+
+    const int64_t now_us = esp_timer_get_time();
+
+    portENTER_CRITICAL_SAFE(&free_list_lock);
+    int64_t wake_time_us = refill_time_us;
+    portEXIT_CRITICAL_SAFE(&free_list_lock);
+
+    // The pool may have been refilled and emptied again before this task
+    // started waiting
+    if (wake_time_us < wait_start_us)
+        wake_time_us = wait_start_us;
+
+    const uint32_t wait_time_us = now_us - wait_start_us;
+    const uint32_t wake_latency_us = now_us - wake_time_us;
+
+    output_trans_pool_stats.wait_time_us_total += wait_time_us;
+    if (wait_time_us > output_trans_pool_stats.wait_time_us_max)
+        output_trans_pool_stats.wait_time_us_max = wait_time_us;
+
+    output_trans_pool_stats.wake_latency_us_total += wake_latency_us;
+    if (wake_latency_us > output_trans_pool_stats.wake_latency_us_max)
+        output_trans_pool_stats.wake_latency_us_max = wake_latency_us;
+
+    return get_free_buffer();
+}
+
+output_trans_pool_t* IRAM_ATTR output_trans_pool_take(int retry_count)
+{
+    return output_trans_pool_take_wait(retry_count * pdMS_TO_TICKS(POLLING_DELAY_MS));
 }
 
 void IRAM_ATTR output_trans_pool_release(output_trans_pool_t* output_trans_pool)
 {
-    for (int index = 0; index < CONFIG_FPGA_SPI_BUFFER_COUNT; index++) {
-        if (&output_trans_pools[index] == output_trans_pool) {
-            if (!output_trans_pools[index].in_use) {
-                output_trans_pool_stats.double_releases++;
-                return;
-            }
-
-            output_trans_pools[index].in_use = false;
-            return;
-        }
+    // Check that the pointer refers to an entry in the pool, without scanning it
+    const uintptr_t offset = (uintptr_t)output_trans_pool - (uintptr_t)output_trans_pools;
+    if ((output_trans_pool == NULL)
+        || (offset >= sizeof(output_trans_pools))
+        || (offset % sizeof(output_trans_pools[0]) != 0)) {
+        output_trans_pool_stats.unowned_releases++;
+        return;
     }
 
-    output_trans_pool_stats.unowned_releases++;
+    portENTER_CRITICAL_SAFE(&free_list_lock);
+
+    const bool was_in_use = output_trans_pool->in_use;
+    if (!was_in_use) {
+        output_trans_pool_stats.double_releases++;
+    } else {
+        // Tasks only wait while the pool is empty, so the release that
+        // refills it is the one that wakes them
+        if (free_list == NULL)
+            refill_time_us = esp_timer_get_time();
+
+        output_trans_pool->in_use = false;
+        output_trans_pool->next = free_list;
+        free_list = output_trans_pool;
+    }
+
+    portEXIT_CRITICAL_SAFE(&free_list_lock);
+
+    if (!was_in_use)
+        return;
+
+    // Wake up any task waiting for a buffer
+    if (xPortInIsrContext()) {
+        BaseType_t xHigherPriorityTaskWoken = pdFALSE;
+        xSemaphoreGiveFromISR(free_count_semaphore, &xHigherPriorityTaskWoken);
+
+        if (xHigherPriorityTaskWoken)
+            portYIELD_FROM_ISR();
+    } else {
+        xSemaphoreGive(free_count_semaphore);
+    }
 }
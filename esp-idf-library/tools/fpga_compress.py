@@ -0,0 +1,113 @@
+#!/usr/bin/python3
+""" Compress an ICE40 bitstream for fpga_loader
+
+The output can be embedded in place of the raw bitstream, loaded from a file,
+or uploaded to /fpga/bitstream. See fpga_loader.h for the format.
+
+Usage:
+
+    fpga_compress.py top.bin top.bin.rle
+"""
+
+import argparse
+import struct
+import sys
+
+MAGIC = b'ICZR'
+
+# Zero runs shorter than this are cheaper to send as part of a literal
+ZERO_RUN_MIN = 3
+
+LITERAL_MAX = 0x80
+ZERO_RUN_MAX = 0x8000
+
+
+def compress(data):
+    """ Compress a bitstream, returning the container as bytes """
+    out = bytearray(MAGIC)
+    out += struct.pack('<I', len(data))
+
+    literal = bytearray()
+
+    def flush_literal():
+        for start in range(0, len(literal), LITERAL_MAX):
+            run = literal[start:start + LITERAL_MAX]
+            out.append(len(run) - 1)
+            out.extend(run)
+        literal.clear()
+
+    position = 0
+    while position < len(data):
+        run = 0
+        while (position + run < len(data)) and (data[position + run] == 0):
+            run += 1
+
+        if run >= ZERO_RUN_MIN:
+            flush_literal()
+
+            position += run
+            while run > 0:
+                count = min(run, ZERO_RUN_MAX)
+                out += struct.pack('>H', 0x8000 | (count - 1))
+                run -= count
+        else:
+            # Take the short zero run (if any) and the byte after it
+            end = min(position + run + 1, len(data))
+            literal += data[position:end]
+            position = end
+
+    flush_literal()
+
+    return bytes(out)
+
+
+def decompress(data):
+    """ Decompress a container, the same way fpga_loader does """
+    if data[:4] != MAGIC:
+        raise ValueError('Missing magic number')
+
+    (size,) = struct.unpack('<I', data[4:8])
+
+    out = bytearray()
+    position = 8
+    while position < len(data):
+        token = data[position]
+        position += 1
+
+        if token & 0x80:
+            (value,) = struct.unpack('>H', data[position - 1:position + 1])
+            position += 1
+            out += bytes((value & 0x7FFF) + 1)
+        else:
+            out += data[position:position + token + 1]
+            position += token + 1
+
+    if len(out) != size:
+        raise ValueError('Size mismatch, expected:{} got:{}'.format(size, len(out)))
+
+    return bytes(out)
+
+
+if __name__ == '__main__':
+    parser = argparse.ArgumentParser(description='Compress an ICE40 bitstream for fpga_loader')
+    parser.add_argument('input', help='Raw bitstream, as produced by icepack')
+    parser.add_argument('output', help='Compressed bitstream')
+    args = parser.parse_args()
+
+    with open(args.input, 'rb') as f:
+        bitstream = f.read()
+
+    compressed = compress(bitstream)
+
+    # Check that the device will get the same bitstream back
+    if decompress(compressed) != bitstream:
+        sys.exit('Compression check failed')
+
+    with open(args.output, 'wb') as f:
+        f.write(compressed)
+
+    print('{}: {} -> {} bytes ({:.1f}%)'.format(
+        args.output,
+        len(bitstream),
+        len(compressed),
+        100.0 * len(compressed) / len(bitstream)))